@@ -0,0 +1,178 @@
+// Heap allocations per routed message on the relay's io threads.
+// Replaces the global operator new with a counting hook that only counts on threads
+// running the relay, drives binary direct messages and JSON lines through an in-process
+// relay, and reports steady-state allocations per message after a warm-up.
+// Exits non-zero if the steady state allocates.
+#include <atomic>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Connection/connection_lib.h"
+
+namespace {
+    thread_local bool counting = false;
+    std::atomic<std::uint64_t> allocations{0};
+}
+
+void* operator new(std::size_t size) {
+    if (counting) allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](std::size_t size) { return operator new(size); }
+void* operator new(std::size_t size, std::align_val_t align) {
+    if (counting) allocations.fetch_add(1, std::memory_order_relaxed);
+    auto a = static_cast<std::size_t>(align);
+    if (void* p = std::aligned_alloc(a, (size + a - 1) / a * a)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](std::size_t size, std::align_val_t align) { return operator new(size, align); }
+// Every replacement delete frees the malloc'ed block through here. Kept out of line so
+// GCC does not pair the free with the operator new at an inlined call site and warn.
+[[gnu::noinline]] static void release(void* p) noexcept { std::free(p); }
+
+void operator delete(void* p) noexcept { release(p); }
+void operator delete[](void* p) noexcept { release(p); }
+void operator delete(void* p, std::size_t) noexcept { release(p); }
+void operator delete[](void* p, std::size_t) noexcept { release(p); }
+void operator delete(void* p, std::align_val_t) noexcept { release(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { release(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { release(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { release(p); }
+
+constexpr std::size_t kPairs = 8;
+constexpr std::size_t kBurst = 32;
+constexpr std::size_t kWarmupRounds = 200;
+constexpr std::size_t kRounds = 1000;
+
+static void write_frame(tcp::socket& s, Protocol::FrameType type, std::uint32_t peer, std::string_view payload) {
+    boost::asio::write(s, boost::asio::buffer(Protocol::make_frame(type, peer, payload)));
+}
+
+static void read_frame(tcp::socket& s, std::string& payload) {
+    std::array<char, Protocol::kFrameHeaderSize> h{};
+    boost::asio::read(s, boost::asio::buffer(h));
+    payload.resize(Protocol::FrameHeader::decode(h.data()).length);
+    boost::asio::read(s, boost::asio::buffer(payload));
+}
+
+static std::uint32_t login(tcp::socket& s, const std::string& user, bool binary) {
+    boost::asio::streambuf buf;
+    json j = { {"cmd","login"}, {"user", user} };
+    if (binary) {
+        boost::asio::write(s, boost::asio::buffer(std::string(R"({"cmd":"hello","framing":"binary"})") + "\n"));
+        buf.consume(boost::asio::read_until(s, buf, '\n'));
+        write_frame(s, Protocol::FrameType::Json, Protocol::kNoPeer, j.dump());
+        std::string payload;
+        read_frame(s, payload);
+        return json::parse(payload)["id"].get<std::uint32_t>();
+    }
+    boost::asio::write(s, boost::asio::buffer(j.dump() + "\n"));
+    std::size_t n = boost::asio::read_until(s, buf, '\n');
+    std::string line(boost::asio::buffers_begin(buf.data()), boost::asio::buffers_begin(buf.data()) + n);
+    return json::parse(line)["id"].get<std::uint32_t>();
+}
+
+struct Pair {
+    explicit Pair(boost::asio::io_context& ioc) : sender(ioc), receiver(ioc) {}
+    tcp::socket sender;
+    tcp::socket receiver;
+    boost::asio::streambuf receiver_buf;
+    std::uint32_t receiver_id = 0;
+    std::string receiver_name;
+};
+
+// Runs `rounds` bursts per pair and returns the allocations the relay made meanwhile.
+static std::uint64_t drive(std::vector<std::unique_ptr<Pair>>& pairs, bool binary, std::size_t rounds) {
+    std::string body(64, 'x');
+    std::string payload;
+    std::uint64_t before = allocations.load();
+    for (std::size_t r = 0; r < rounds; ++r) {
+        for (auto& p : pairs) {
+            std::string out;
+            for (std::size_t k = 0; k < kBurst; ++k) {
+                if (binary) {
+                    out += Protocol::make_frame(Protocol::FrameType::Msg, p->receiver_id, body);
+                } else {
+                    out += R"({"cmd":"msg","to":")" + p->receiver_name + R"(","body":")" + body + "\"}\n";
+                }
+            }
+            boost::asio::write(p->sender, boost::asio::buffer(out));
+        }
+        for (auto& p : pairs) {
+            for (std::size_t k = 0; k < kBurst; ++k) {
+                if (binary) {
+                    read_frame(p->receiver, payload);
+                } else {
+                    p->receiver_buf.consume(boost::asio::read_until(p->receiver, p->receiver_buf, '\n'));
+                }
+            }
+        }
+    }
+    return allocations.load() - before;
+}
+
+static bool run(IoModel model, bool binary) {
+    ServerConfig config;
+    config.data_dir = (std::filesystem::temp_directory_path() / "alloc_bench").string();
+    std::size_t nworkers = model == IoModel::PerCore ? 2 : 1;
+    std::vector<std::unique_ptr<boost::asio::io_context>> contexts;
+    std::vector<boost::asio::io_context*> workers;
+    for (std::size_t i = 0; i < nworkers; ++i) {
+        contexts.push_back(std::make_unique<boost::asio::io_context>(1));
+        workers.push_back(contexts.back().get());
+    }
+    Server server(workers, 0, config);
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < nworkers; ++i) {
+        threads.emplace_back([&server, i] {
+            counting = true;
+            server.run_worker(i);
+        });
+    }
+
+    boost::asio::io_context client_ioc;
+    tcp::endpoint endpoint(boost::asio::ip::address_v4::loopback(), server.port());
+    std::vector<std::unique_ptr<Pair>> pairs;
+    std::string tag = std::string(model == IoModel::PerCore ? "pc" : "sh") + (binary ? "b" : "j");
+    for (std::size_t i = 0; i < kPairs; ++i) {
+        auto p = std::make_unique<Pair>(client_ioc);
+        p->sender.connect(endpoint);
+        p->receiver.connect(endpoint);
+        login(p->sender, tag + "_s" + std::to_string(i), binary);
+        p->receiver_name = tag + "_r" + std::to_string(i);
+        p->receiver_id = login(p->receiver, p->receiver_name, binary);
+        pairs.push_back(std::move(p));
+    }
+
+    drive(pairs, binary, kWarmupRounds);
+    std::uint64_t counted = drive(pairs, binary, kRounds);
+    double per_message = double(counted) / (kRounds * kPairs * kBurst);
+    std::cout << std::left << std::setw(10) << (model == IoModel::PerCore ? "per-core" : "shared")
+              << std::setw(9) << (binary ? "binary" : "json") << std::right
+              << std::setw(14) << counted << std::fixed << std::setprecision(4) << std::setw(14) << per_message << "\n";
+
+    boost::system::error_code ec;
+    for (auto& p : pairs) {
+        p->sender.close(ec);
+        p->receiver.close(ec);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    for (auto& ctx : contexts) ctx->stop();
+    for (auto& t : threads) t.join();
+    return counted == 0;
+}
+
+int main() {
+    std::cout << "model     framing   allocations   per message\n";
+    bool clean = true;
+    clean &= run(IoModel::Shared, true);
+    clean &= run(IoModel::PerCore, true);
+    clean &= run(IoModel::Shared, false);
+    clean &= run(IoModel::PerCore, false);
+    return clean ? 0 : 1;
+}
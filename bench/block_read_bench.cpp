@@ -0,0 +1,71 @@
+// Throughput of walking a file block by block and touching every byte, page cache warm.
+// ifstream: FileBlockIterator, each block zero-filled and read into its vector.
+// mmap:     MappedBlockRange, each block a view into the mapping.
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <span>
+#include <string>
+#include <vector>
+#include "text_parser_lib.h"
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t kFileSize = 256u << 20;
+
+// Stands in for hashing or chunking: reads every byte once.
+static std::uint64_t consume(std::span<const char> block) {
+    std::uint64_t acc = 0;
+    std::size_t i = 0;
+    for (; i + 8 <= block.size(); i += 8) {
+        std::uint64_t word;
+        std::memcpy(&word, block.data() + i, 8);
+        acc ^= word;
+    }
+    for (; i < block.size(); ++i) acc += static_cast<unsigned char>(block[i]);
+    return acc;
+}
+
+template<typename F>
+static double gb_per_second(F&& walk, int rounds = 4) {
+    std::uint64_t sink = walk();
+    auto start = Clock::now();
+    for (int r = 0; r < rounds; ++r) sink ^= walk();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    if (sink == 42) std::cout << "";
+    return static_cast<double>(kFileSize) * rounds / seconds / 1e9;
+}
+
+int main() {
+    auto path = (std::filesystem::temp_directory_path() / "block_read_bench.bin").string();
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        std::vector<char> chunk(1 << 20);
+        for (std::size_t i = 0; i < chunk.size(); ++i) chunk[i] = static_cast<char>(i * 131);
+        for (std::size_t written = 0; written < kFileSize; written += chunk.size()) out.write(chunk.data(), chunk.size());
+    }
+
+    std::cout << "block bytes   ifstream GB/s   mmap GB/s   speedup\n";
+    for (std::size_t block : {4096, 65536, 1 << 20}) {
+        double stream = gb_per_second([&] {
+            std::uint64_t acc = 0;
+            FileParser::FileBlockIterator it(path, static_cast<std::streamsize>(block));
+            FileParser::FileBlockIterator end(path, static_cast<std::streamsize>(block), true);
+            for (; it != end; ++it) acc ^= consume(*it);
+            return acc;
+        });
+        double mapped = gb_per_second([&] {
+            std::uint64_t acc = 0;
+            for (auto view : FileParser::MappedBlockRange(path, block)) acc ^= consume(view);
+            return acc;
+        });
+        std::cout << std::setw(11) << block << std::fixed << std::setprecision(2)
+                  << std::setw(16) << stream << std::setw(12) << mapped << std::setw(9) << mapped / stream << "x\n";
+    }
+    std::filesystem::remove(path);
+    return 0;
+}
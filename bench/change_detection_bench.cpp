@@ -0,0 +1,88 @@
+// Cost of FileBlockIterator's change detection on many small blocks, page cache warm.
+// Each block is taken with post-increment, so every step copies the iterator, and the
+// copy checks the file as the ChangePolicy says:
+//   every-copy  a stat() per copy, the default
+//   on-open     the identity taken on open only
+//   periodic    a stat() at most once per 100 ms
+//   notify      an inotify watch, an atomic load per copy
+// A copy still reopens the file and seeks, so the check is only part of each step; on a
+// local disk stat() is cheap and the gap is small, on a network file system every stat()
+// is a round trip to the server. Then notify is checked to still see the file replaced.
+//
+//   change_detection_bench [directory, default the temporary directory]
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "text_parser_lib.h"
+
+using Clock = std::chrono::steady_clock;
+using Mode = FileParser::ChangePolicy::Mode;
+
+constexpr std::size_t kFileSize = 32u << 20;
+constexpr std::streamsize kBlockSize = 4096;
+
+static double ns_per_block(const std::string& path, FileParser::ChangePolicy policy, int rounds = 3) {
+    std::uint64_t sink = 0;
+    std::size_t blocks = 0;
+    auto start = Clock::now();
+    for (int r = 0; r < rounds; ++r) {
+        FileParser::FileBlockIterator it(path, kBlockSize, policy);
+        FileParser::FileBlockIterator end(path, kBlockSize, true);
+        while (it != end) {
+            sink += (*it++).size();
+            ++blocks;
+        }
+    }
+    double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    if (sink == 42) std::cout << "";
+    return ns / static_cast<double>(blocks);
+}
+
+int main(int argc, char** argv) {
+    std::filesystem::path dir = argc > 1 ? std::filesystem::path(argv[1]) : std::filesystem::temp_directory_path();
+    auto path = (dir / "change_detection_bench.bin").string();
+    {
+        std::vector<char> data(kFileSize);
+        for (std::size_t i = 0; i < data.size(); ++i) data[i] = static_cast<char>(i * 131);
+        std::ofstream(path, std::ios::binary | std::ios::trunc).write(data.data(), static_cast<std::streamsize>(data.size()));
+    }
+
+    struct Case { const char* name; FileParser::ChangePolicy policy; };
+    const Case cases[] = {
+        {"every-copy", {Mode::EveryCopy}},
+        {"on-open", {Mode::OnOpen}},
+        {"periodic", {Mode::Periodic, false, std::chrono::milliseconds(100)}},
+        {"notify", {Mode::Notify}},
+    };
+    std::cout << kFileSize / kBlockSize << " blocks of " << kBlockSize / 1024 << " KiB, post-increment\n"
+              << std::fixed << std::setprecision(0);
+    for (const auto& c : cases) {
+        std::cout << std::left << std::setw(12) << c.name << std::right << std::setw(8)
+                  << ns_per_block(path, c.policy) << " ns/block\n";
+    }
+
+    // Replace the file under an iterator: the next copy has to throw.
+    bool detected = false;
+    {
+        FileParser::FileBlockIterator it(path, kBlockSize, FileParser::ChangePolicy{Mode::Notify});
+        auto replacement = path + ".new";
+        std::ofstream(replacement, std::ios::binary | std::ios::trunc) << "replaced";
+        std::filesystem::rename(replacement, path);
+        auto deadline = Clock::now() + std::chrono::seconds(2);
+        while (!detected && Clock::now() < deadline) {
+            try {
+                FileParser::FileBlockIterator copy(it);
+            } catch (const std::runtime_error&) {
+                detected = true;
+            }
+        }
+    }
+    std::cout << "notify sees the file replaced: " << (detected ? "yes" : "NO") << "\n";
+    std::filesystem::remove(path);
+    return detected ? 0 : 1;
+}
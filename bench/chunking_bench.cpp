@@ -0,0 +1,106 @@
+// Content-defined chunking throughput, page cache warm, 16/64/256 KiB min/avg/max.
+// cut:     ContentChunker::cut over a buffer in memory, the rolling hash alone.
+// chunker: ContentChunker over the file, FileBlockIterator reads included.
+// Then the point of it: how many chunks of a file survive a small insertion near the
+// start, against fixed-size blocks of the average chunk size.
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "text_parser_lib.h"
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t kFileSize = 256u << 20;
+
+template<typename F>
+static double gb_per_second(F&& run, int rounds = 4) {
+    std::size_t sink = run();
+    auto start = Clock::now();
+    for (int r = 0; r < rounds; ++r) sink += run();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    if (sink == 42) std::cout << "";
+    return static_cast<double>(kFileSize) * rounds / seconds / 1e9;
+}
+
+static std::set<std::string> chunk_set(const std::string& path) {
+    std::set<std::string> chunks;
+    FileParser::ContentChunker chunker(path);
+    while (auto chunk = chunker.next()) chunks.emplace(chunk->data.data(), chunk->data.size());
+    return chunks;
+}
+
+static std::set<std::string> block_set(const std::vector<char>& data, std::size_t block) {
+    std::set<std::string> blocks;
+    for (std::size_t at = 0; at < data.size(); at += block) {
+        blocks.emplace(data.data() + at, std::min(block, data.size() - at));
+    }
+    return blocks;
+}
+
+static std::size_t shared(const std::set<std::string>& a, const std::set<std::string>& b) {
+    std::size_t n = 0;
+    for (const auto& chunk : b) n += a.count(chunk);
+    return n;
+}
+
+int main() {
+    std::vector<char> data(kFileSize);
+    std::mt19937_64 rng(7);
+    for (std::size_t i = 0; i + 8 <= data.size(); i += 8) {
+        std::uint64_t v = rng();
+        std::memcpy(data.data() + i, &v, 8);
+    }
+    auto dir = std::filesystem::temp_directory_path();
+    auto path = (dir / "chunking_bench.bin").string();
+    std::ofstream(path, std::ios::binary | std::ios::trunc).write(data.data(), static_cast<std::streamsize>(data.size()));
+
+    FileParser::ContentChunker::Params params;
+    std::size_t chunks = 0;
+    double cut = gb_per_second([&] {
+        chunks = 0;
+        for (std::size_t at = 0; at < data.size(); ++chunks) {
+            at += FileParser::ContentChunker::cut(data.data() + at, data.size() - at, params);
+        }
+        return chunks;
+    });
+    double chunker = gb_per_second([&] {
+        std::size_t n = 0;
+        FileParser::ContentChunker chunks(path);
+        while (chunks.next()) ++n;
+        return n;
+    });
+
+    // A few bytes inserted 1 MiB in, as an edit to a re-sent attachment would.
+    std::vector<char> edited(data.begin(), data.begin() + (1 << 20));
+    for (char c : std::string_view("an edit")) edited.push_back(c);
+    edited.insert(edited.end(), data.begin() + (1 << 20), data.end());
+    auto edited_path = (dir / "chunking_bench_edited.bin").string();
+    std::ofstream(edited_path, std::ios::binary | std::ios::trunc).write(edited.data(), static_cast<std::streamsize>(edited.size()));
+
+    auto original_chunks = chunk_set(path);
+    auto edited_chunks = chunk_set(edited_path);
+    auto original_blocks = block_set(data, params.avgSize);
+    auto edited_blocks = block_set(edited, params.avgSize);
+
+    std::cout << "256 MiB random data, " << chunks << " chunks, average " << kFileSize / chunks / 1024 << " KiB\n"
+              << std::fixed << std::setprecision(2)
+              << std::left << std::setw(10) << "cut" << std::right << std::setw(8) << cut << " GB/s\n"
+              << std::left << std::setw(10) << "chunker" << std::right << std::setw(8) << chunker << " GB/s\n\n"
+              << "after a 7-byte insertion at 1 MiB, pieces already stored:\n"
+              << std::left << std::setw(22) << "content-defined" << std::right << std::setw(6) << shared(original_chunks, edited_chunks)
+              << " of " << edited_chunks.size() << "\n"
+              << std::left << std::setw(22) << "fixed 64 KiB blocks" << std::right << std::setw(6) << shared(original_blocks, edited_blocks)
+              << " of " << edited_blocks.size() << "\n";
+    std::filesystem::remove(path);
+    std::filesystem::remove(edited_path);
+    return 0;
+}
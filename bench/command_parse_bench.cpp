@@ -0,0 +1,81 @@
+// Per-message CPU cost of parsing and routing a JSON "msg" command.
+// DOM: what the relay did before, json::parse, copy cmd/to/body out, resolve the
+// recipient, then build and dump a second DOM for the outgoing line.
+// Scan: scan_command pulls the routing fields as views, the body is copied once into a
+// RoutedMessage and spliced into the outgoing line.
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include "Protocol/CommandScanner.h"
+#include "Protocol/RoutedMessage.h"
+#include "Registry/NameDirectory.h"
+
+using json = nlohmann::json;
+using Clock = std::chrono::steady_clock;
+namespace Protocol = CPCDMessenger::Protocol;
+
+constexpr std::size_t kRecipients = 1024;
+
+static std::vector<std::string> make_lines(std::size_t body_size, std::size_t count) {
+    std::vector<std::string> lines;
+    std::string body(body_size, 'a');
+    for (std::size_t i = 0; i < body_size; i += 7) body[i] = ' ';
+    for (std::size_t i = 0; i < count; ++i) {
+        json j = { {"cmd","msg"}, {"to", "user" + std::to_string(i % kRecipients)}, {"body", body} };
+        lines.push_back(j.dump());
+    }
+    return lines;
+}
+
+static std::size_t route_dom(CPCDMessenger::NameDirectory& users, const std::string& line) {
+    json j = json::parse(line);
+    std::string cmd = j["cmd"].get<std::string>();
+    if (cmd != "msg") return 0;
+    auto to = users.find(j["to"].get<std::string>()).value_or(CPCDMessenger::kInvalidUser);
+    std::string body = j["body"].get<std::string>();
+    json out = { {"type","msg"}, {"from", "sender"}, {"body", body} };
+    std::string s = out.dump(-1, ' ', false, json::error_handler_t::replace);
+    s.push_back('\n');
+    return s.size() + to;
+}
+
+static std::size_t route_scan(CPCDMessenger::NameDirectory& users, const std::string& line) {
+    auto scanned = Protocol::scan_command(line);
+    if (!scanned || *scanned->cmd != "msg") return 0;
+    auto to = users.find(std::string(*scanned->to)).value_or(CPCDMessenger::kInvalidUser);
+    Protocol::RoutedMessage message(0, "sender", std::string(*scanned->body));
+    return message.encoded(Protocol::Framing::JsonLines)->size() + to;
+}
+
+template<typename F>
+static double ns_per_message(const std::vector<std::string>& lines, std::size_t rounds, F&& route) {
+    CPCDMessenger::NameDirectory users;
+    for (std::size_t i = 0; i < kRecipients; ++i) users.intern("user" + std::to_string(i));
+    std::size_t sink = 0;
+    for (const auto& line : lines) sink += route(users, line);
+    auto start = Clock::now();
+    for (std::size_t r = 0; r < rounds; ++r) {
+        for (const auto& line : lines) sink += route(users, line);
+    }
+    double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    if (sink == 42) std::cout << "";
+    return ns / (lines.size() * rounds);
+}
+
+int main() {
+    std::cout << "body bytes   dom ns/msg   scan ns/msg   speedup\n";
+    for (std::size_t body_size : {16, 256, 4096, 65536}) {
+        std::size_t count = 4096;
+        std::size_t rounds = std::max<std::size_t>(1, (64u << 20) / (count * (body_size + 64)));
+        auto lines = make_lines(body_size, count);
+        double dom = ns_per_message(lines, rounds, route_dom);
+        double scan = ns_per_message(lines, rounds, route_scan);
+        std::cout << std::setw(10) << body_size << std::fixed << std::setprecision(1)
+                  << std::setw(13) << dom << std::setw(14) << scan
+                  << std::setprecision(2) << std::setw(9) << dom / scan << "x\n";
+    }
+    return 0;
+}
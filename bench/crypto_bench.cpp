@@ -0,0 +1,84 @@
+// Messages per second for sealing and opening message bodies, 64 B .. 64 KiB.
+// rsa/msg: hybrid encryption without a session, the peer's PEM parsed, a fresh AES key
+//          RSA-wrapped (or unwrapped) and the body run through aes_gcm_* per message.
+// per-call: Crypto::aes_gcm_encrypt/decrypt, a new EVP context and RAND_bytes IV per call.
+// span:     the std::span / std::array overloads, this thread's context and the caller's
+//           buffers, still a RAND_bytes IV and a key schedule per call.
+// session: SessionKeyCache, one RSA exchange up front, then a reused context per
+//          direction and a counter nonce.
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "Crypto/SessionKeys.h"
+
+using Clock = std::chrono::steady_clock;
+
+template<typename F>
+static double per_second(F&& op, double min_seconds = 0.3) {
+    std::size_t n = 0;
+    auto start = Clock::now();
+    double elapsed = 0;
+    do {
+        for (int i = 0; i < 16; ++i) {
+            if (!op()) {
+                std::cerr << "crypto operation failed\n";
+                std::exit(1);
+            }
+        }
+        n += 16;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    } while (elapsed < min_seconds);
+    return n / elapsed;
+}
+
+int main() {
+    Crypto crypto;
+    std::string alice_priv, alice_pub, bob_priv, bob_pub;
+    if (!crypto.generate_rsa_pem(alice_priv, alice_pub) || !crypto.generate_rsa_pem(bob_priv, bob_pub)) return 1;
+
+    CPCDMessenger::SessionKeyCache alice, bob;
+    alice.load_private_key(alice_priv);
+    bob.load_private_key(bob_priv);
+    std::vector<unsigned char> wrapped;
+    if (!alice.begin_session("bob", bob_pub, wrapped) || !bob.accept_session("alice", wrapped)) return 1;
+
+    std::cout << "                 ------------------ encrypt msg/s ------------------   ------------------ decrypt msg/s ------------------\n"
+              << "body bytes       rsa/msg    per-call        span     session   gain     rsa/msg    per-call        span     session   gain\n";
+    for (std::size_t size : {64, 256, 1024, 4096, 16384, 65536}) {
+        std::vector<unsigned char> body(size, 0x5a), key = Crypto::gen_aes_key();
+        std::vector<unsigned char> iv, cipher, tag, plain, sealed, opened, wrapped_key;
+
+        double rsa_enc = per_second([&] {
+            EVP_PKEY* pub = crypto.load_pubkey_from_pem(bob_pub);
+            bool ok = pub && crypto.rsa_encrypt(pub, key, wrapped_key) && crypto.aes_gcm_encrypt(key, body, iv, cipher, tag);
+            EVP_PKEY_free(pub);
+            return ok;
+        }, 0.2);
+        double call_enc = per_second([&] { return crypto.aes_gcm_encrypt(key, body, iv, cipher, tag); });
+        Crypto::AesKey fixed_key;
+        Crypto::GcmIv fixed_iv;
+        std::copy(key.begin(), key.end(), fixed_key.begin());
+        std::vector<unsigned char> sealed_span(size + Crypto::kGcmTagSize), opened_span(size);
+        double span_enc = per_second([&] { return crypto.aes_gcm_encrypt(fixed_key, body, fixed_iv, sealed_span); });
+        double session_enc = per_second([&] { return alice.encrypt("bob", body, sealed); });
+
+        CPCDMessenger::PkeyPtr priv(crypto.load_privkey_from_pem(bob_priv));
+        double rsa_dec = per_second([&] {
+            std::vector<unsigned char> unwrapped;
+            return crypto.rsa_decrypt(priv.get(), wrapped_key, unwrapped) && crypto.aes_gcm_decrypt(unwrapped, iv, cipher, tag, plain);
+        }, 0.2);
+        double call_dec = per_second([&] { return crypto.aes_gcm_decrypt(key, iv, cipher, tag, plain); });
+        double span_dec = per_second([&] { return crypto.aes_gcm_decrypt(fixed_key, fixed_iv, sealed_span, opened_span); });
+        double session_dec = per_second([&] { return bob.decrypt("alice", sealed, opened); });
+
+        std::cout << std::setw(10) << size << std::fixed << std::setprecision(0)
+                  << std::setw(14) << rsa_enc << std::setw(12) << call_enc << std::setw(12) << span_enc << std::setw(12) << session_enc
+                  << std::setprecision(2) << std::setw(7) << session_enc / call_enc << "x" << std::setprecision(0)
+                  << std::setw(11) << rsa_dec << std::setw(12) << call_dec << std::setw(12) << span_dec << std::setw(12) << session_dec
+                  << std::setprecision(2) << std::setw(7) << session_dec / call_dec << "x\n";
+    }
+    return 0;
+}
@@ -0,0 +1,180 @@
+// End-to-end channel fan-out latency on localhost.
+// Starts an in-process relay, connects N binary-framing members to one channel and
+// measures, for every post, the delay until each member has received it.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include "Connection/connection_lib.h"
+
+using Clock = std::chrono::steady_clock;
+
+constexpr int kPosts = 50;
+constexpr std::size_t kBodySize = 64;
+
+static void write_frame(tcp::socket& s, Protocol::FrameType type, std::uint32_t peer, std::string_view payload) {
+    boost::asio::write(s, boost::asio::buffer(Protocol::make_frame(type, peer, payload)));
+}
+
+static std::pair<Protocol::FrameHeader, std::string> read_frame(tcp::socket& s, boost::asio::streambuf& buf) {
+    std::array<char, Protocol::kFrameHeaderSize> h{};
+    std::size_t have = boost::asio::buffer_copy(boost::asio::buffer(h), buf.data());
+    buf.consume(have);
+    boost::asio::read(s, boost::asio::buffer(h.data() + have, h.size() - have));
+    auto header = Protocol::FrameHeader::decode(h.data());
+    std::string payload(header.length, '\0');
+    have = boost::asio::buffer_copy(boost::asio::buffer(payload), buf.data());
+    buf.consume(have);
+    boost::asio::read(s, boost::asio::buffer(payload.data() + have, payload.size() - have));
+    return {header, payload};
+}
+
+// Login + join over a fresh binary session; returns the channel id.
+static std::uint32_t join(tcp::socket& s, const std::string& user, const std::string& channel) {
+    boost::asio::streambuf buf;
+    boost::asio::write(s, boost::asio::buffer(std::string(R"({"cmd":"hello","framing":"binary"})") + "\n"));
+    boost::asio::read_until(s, buf, '\n');
+    buf.consume(buf.size());
+    json login = { {"cmd","login"}, {"user", user} };
+    json join = { {"cmd","join"}, {"channel", channel} };
+    write_frame(s, Protocol::FrameType::Json, Protocol::kNoPeer, login.dump());
+    write_frame(s, Protocol::FrameType::Json, Protocol::kNoPeer, join.dump());
+    std::uint32_t id = Protocol::kNoPeer;
+    while (id == Protocol::kNoPeer) {
+        auto [header, payload] = read_frame(s, buf);
+        auto j = json::parse(payload);
+        if (j.value("type", "") == "joined") id = j["id"].get<std::uint32_t>();
+    }
+    return id;
+}
+
+class Member {
+public:
+    Member(boost::asio::io_context& ioc, std::vector<double>& samples, std::atomic<std::size_t>& received)
+    : socket_(ioc), samples_(samples), received_(received) {}
+
+    tcp::socket& socket() { return socket_; }
+
+    void start() { read_header(); }
+
+private:
+    void read_header() {
+        boost::asio::async_read(socket_, boost::asio::buffer(header_), [this](auto ec, std::size_t) {
+            if (ec) return;
+            auto h = Protocol::FrameHeader::decode(header_.data());
+            payload_.resize(h.length);
+            boost::asio::async_read(socket_, boost::asio::buffer(payload_), [this, h](auto ec, std::size_t) {
+                if (ec) return;
+                if (h.type == Protocol::FrameType::ChannelPost && payload_.size() >= 4 + sizeof(std::int64_t)) {
+                    std::int64_t sent;
+                    std::memcpy(&sent, payload_.data() + 4, sizeof(sent));
+                    auto now = Clock::now().time_since_epoch().count();
+                    samples_[received_.fetch_add(1)] = (now - sent) / 1e3;
+                }
+                read_header();
+            });
+        });
+    }
+
+    tcp::socket socket_;
+    std::array<char, Protocol::kFrameHeaderSize> header_{};
+    std::vector<char> payload_;
+    std::vector<double>& samples_;
+    std::atomic<std::size_t>& received_;
+};
+
+static double percentile(std::vector<double>& v, double p) {
+    auto k = static_cast<std::size_t>(p * (v.size() - 1));
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+}
+
+static void run(Server& server, std::size_t members) {
+    const std::string channel = "bench" + std::to_string(members);
+    tcp::endpoint endpoint(boost::asio::ip::address_v4::loopback(), server.port());
+
+    boost::asio::io_context client_ioc;
+    std::vector<double> samples(members * kPosts);
+    std::atomic<std::size_t> received{0};
+    std::vector<std::unique_ptr<Member>> clients;
+    for (std::size_t i = 0; i < members; ++i) {
+        auto m = std::make_unique<Member>(client_ioc, samples, received);
+        m->socket().connect(endpoint);
+        join(m->socket(), channel + "_m" + std::to_string(i), channel);
+        m->start();
+        clients.push_back(std::move(m));
+    }
+    auto guard = boost::asio::make_work_guard(client_ioc);
+    std::vector<std::thread> client_threads;
+    for (int i = 0; i < 2; ++i) client_threads.emplace_back([&] { client_ioc.run(); });
+
+    tcp::socket poster(client_ioc);
+    poster.connect(endpoint);
+    std::uint32_t channel_id = join(poster, channel + "_poster", channel);
+
+    // One untimed post first so connection warm-up does not land in the samples.
+    std::vector<double> last_arrival;
+    std::string body(kBodySize, 'x');
+    for (int p = -1; p < kPosts; ++p) {
+        std::size_t target = members * (p < 0 ? 1 : p + 1);
+        auto sent = Clock::now();
+        std::int64_t ts = sent.time_since_epoch().count();
+        std::memcpy(body.data(), &ts, sizeof(ts));
+        write_frame(poster, Protocol::FrameType::ChannelPost, channel_id, body);
+        while (received.load() < target) std::this_thread::yield();
+        if (p < 0) {
+            received = 0;
+        } else {
+            last_arrival.push_back(std::chrono::duration<double, std::micro>(Clock::now() - sent).count());
+        }
+    }
+
+    double p50 = percentile(samples, 0.50);
+    double p99 = percentile(samples, 0.99);
+    double last = percentile(last_arrival, 0.50);
+    std::cout << std::setw(8) << members << std::fixed << std::setprecision(1)
+              << std::setw(14) << p50 << std::setw(14) << p99 << std::setw(18) << last << "\n";
+
+    boost::system::error_code ec;
+    for (auto& m : clients) m->socket().close(ec);
+    poster.close(ec);
+    guard.reset();
+    client_ioc.stop();
+    for (auto& t : client_threads) t.join();
+    // Let the relay notice the disconnects and release its descriptors.
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+}
+
+// A 10k-member run needs about 20k descriptors (both ends of every connection).
+int main(int argc, char** argv) {
+    rlimit lim{};
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+
+    ServerConfig config;
+    config.data_dir = (std::filesystem::temp_directory_path() / "fanout_bench").string();
+    boost::asio::io_context ioc;
+    Server server(ioc, 0, config);
+    unsigned nthreads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < nthreads; ++i) threads.emplace_back([&ioc] { ioc.run(); });
+
+    std::cout << "members   p50 usec      p99 usec   last member usec\n";
+    std::vector<std::size_t> sizes = {10, 1000, 10000};
+    if (argc > 1) sizes = {static_cast<std::size_t>(std::stoul(argv[1]))};
+    for (std::size_t members : sizes) {
+        run(server, members);
+    }
+
+    ioc.stop();
+    for (auto& t : threads) t.join();
+    return 0;
+}
@@ -0,0 +1,107 @@
+// End-to-end /send-file throughput on localhost: a relay and two console clients in one
+// process, bob sending a file to alice. Covers the whole path: block reads, AES-GCM per
+// chunk, the relay forwarding each chunk, decryption and the write of alice's copy,
+// paced by the acknowledgement window. The received copy is compared with the original.
+//
+//   file_transfer_bench [size in MiB, default 1024]
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Connection/connection_lib.h"
+
+using Clock = std::chrono::steady_clock;
+namespace fs = std::filesystem;
+
+static void write_key(const fs::path& path) {
+    Crypto crypto;
+    std::string priv, pub;
+    if (!crypto.generate_rsa_pem(priv, pub)) std::exit(1);
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << priv;
+}
+
+static bool same_contents(const fs::path& a, const fs::path& b) {
+    std::ifstream x(a, std::ios::binary), y(b, std::ios::binary);
+    std::vector<char> bx(1 << 20), by(1 << 20);
+    while (x && y) {
+        x.read(bx.data(), static_cast<std::streamsize>(bx.size()));
+        y.read(by.data(), static_cast<std::streamsize>(by.size()));
+        if (x.gcount() != y.gcount() || !std::equal(bx.begin(), bx.begin() + x.gcount(), by.begin())) return false;
+    }
+    return !x && !y;
+}
+
+int main(int argc, char** argv) {
+    std::uint64_t mib = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1024;
+    std::uint64_t size = mib << 20;
+    fs::path dir = fs::temp_directory_path() / "file_transfer_bench";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    fs::path source = dir / "payload.bin";
+    {
+        std::ofstream out(source, std::ios::binary | std::ios::trunc);
+        std::vector<char> chunk(1 << 20);
+        for (std::uint64_t written = 0; written < size; written += chunk.size()) {
+            for (std::size_t i = 0; i < chunk.size(); ++i) chunk[i] = static_cast<char>((written >> 20) * 7 + i * 131);
+            out.write(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+        }
+    }
+    write_key(dir / "alice.pem");
+    write_key(dir / "bob.pem");
+
+    boost::asio::io_context relay_ioc(1);
+    ServerConfig config;
+    config.data_dir = (dir / "relay").string();
+    Server server(relay_ioc, 0, config);
+    std::thread relay_thread([&] { server.run_worker(0); });
+
+    boost::asio::io_context client_ioc(1);
+    auto work = boost::asio::make_work_guard(client_ioc);
+    CPCDMessenger::KeyGenService keygen;
+    auto alice = std::make_shared<ConsoleClient>(client_ioc, "127.0.0.1", server.port(), keygen,
+                                                 (dir / "alice.pem").string(), dir / "alice-downloads");
+    auto bob = std::make_shared<ConsoleClient>(client_ioc, "127.0.0.1", server.port(), keygen,
+                                               (dir / "bob.pem").string(), dir / "bob-downloads");
+    alice->start();
+    bob->start();
+    std::thread client_thread([&] { client_ioc.run(); });
+    alice->send_login("alice");
+    bob->send_login("bob");
+    // Both keys have to be published before bob asks for alice's.
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    auto start = Clock::now();
+    bob->send_file("alice", source.string());
+    fs::path received = dir / "alice-downloads" / source.filename();
+    std::error_code ec;
+    while (!fs::exists(received, ec)) {
+        if (Clock::now() - start > std::chrono::minutes(10)) {
+            std::cerr << "transfer did not finish\n";
+            return 1;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    alice->stop();
+    bob->stop();
+    work.reset();
+    client_ioc.stop();
+    client_thread.join();
+    relay_ioc.stop();
+    relay_thread.join();
+
+    bool intact = same_contents(source, received);
+    std::cout << "\n" << mib << " MiB, " << CPCDMessenger::Transfer::kBlockSize / 1024 << " KiB chunks, "
+              << CPCDMessenger::Transfer::kWindowBytes / (1024 * 1024) << " MiB window\n" << std::fixed << std::setprecision(2)
+              << "seconds    " << std::setw(10) << seconds << "\n"
+              << "MB/s       " << std::setw(10) << size / seconds / 1e6 << "\n"
+              << "copy       " << std::setw(10) << (intact ? "intact" : "CORRUPT") << "\n";
+    fs::remove_all(dir);
+    return intact ? 0 : 1;
+}
@@ -0,0 +1,145 @@
+// Relay throughput, shared io_context vs io_context-per-core.
+// Starts an in-process relay in each io model with the same thread count, connects
+// sender/receiver pairs over binary framing and relays bursts of direct messages.
+// Pairs are accepted independently, so in the per-core model most pairs straddle two
+// workers and every message crosses a mailbox.
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Connection/connection_lib.h"
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t kBodySize = 64;
+constexpr std::size_t kBurst = 64;
+
+static void write_frame(tcp::socket& s, Protocol::FrameType type, std::uint32_t peer, std::string_view payload) {
+    boost::asio::write(s, boost::asio::buffer(Protocol::make_frame(type, peer, payload)));
+}
+
+static Protocol::FrameHeader read_frame(tcp::socket& s, std::string& payload) {
+    std::array<char, Protocol::kFrameHeaderSize> h{};
+    boost::asio::read(s, boost::asio::buffer(h));
+    auto header = Protocol::FrameHeader::decode(h.data());
+    payload.resize(header.length);
+    boost::asio::read(s, boost::asio::buffer(payload));
+    return header;
+}
+
+// Switches a fresh session to binary framing and logs in; returns the user id.
+static std::uint32_t login(tcp::socket& s, const std::string& user) {
+    boost::asio::streambuf buf;
+    boost::asio::write(s, boost::asio::buffer(std::string(R"({"cmd":"hello","framing":"binary"})") + "\n"));
+    std::size_t n = boost::asio::read_until(s, buf, '\n');
+    // hello_ok is the last line the server writes before switching, nothing follows it yet.
+    buf.consume(n);
+    json j = { {"cmd","login"}, {"user", user} };
+    write_frame(s, Protocol::FrameType::Json, Protocol::kNoPeer, j.dump());
+    std::string payload;
+    while (true) {
+        read_frame(s, payload);
+        auto reply = json::parse(payload);
+        if (reply.value("type", "") == "login_ok") return reply["id"].get<std::uint32_t>();
+    }
+}
+
+struct Pair {
+    explicit Pair(boost::asio::io_context& ioc) : sender(ioc), receiver(ioc) {}
+    tcp::socket sender;
+    tcp::socket receiver;
+    std::uint32_t receiver_id = 0;
+};
+
+static double run(IoModel model, unsigned threads, std::size_t pairs, std::size_t messages, unsigned client_threads) {
+    ServerConfig config;
+    config.data_dir = (std::filesystem::temp_directory_path() / "io_model_bench").string();
+
+    std::vector<std::unique_ptr<boost::asio::io_context>> contexts;
+    std::vector<boost::asio::io_context*> workers;
+    std::size_t count = model == IoModel::PerCore ? threads : 1;
+    for (std::size_t i = 0; i < count; ++i) {
+        contexts.push_back(std::make_unique<boost::asio::io_context>(model == IoModel::PerCore ? 1 : static_cast<int>(threads)));
+        workers.push_back(contexts.back().get());
+    }
+    Server server(workers, 0, config);
+    std::vector<std::thread> server_threads;
+    for (unsigned i = 0; i < threads; ++i) {
+        std::size_t worker = model == IoModel::PerCore ? i : 0;
+        server_threads.emplace_back([&server, worker] { server.run_worker(worker); });
+    }
+
+    tcp::endpoint endpoint(boost::asio::ip::address_v4::loopback(), server.port());
+    boost::asio::io_context client_ioc;
+    std::vector<std::unique_ptr<Pair>> conns;
+    std::string tag = model == IoModel::PerCore ? "pc" : "sh";
+    for (std::size_t i = 0; i < pairs; ++i) {
+        auto p = std::make_unique<Pair>(client_ioc);
+        p->sender.connect(endpoint);
+        p->receiver.connect(endpoint);
+        p->sender.set_option(tcp::no_delay(true));
+        login(p->sender, tag + "_s" + std::to_string(i));
+        p->receiver_id = login(p->receiver, tag + "_r" + std::to_string(i));
+        conns.push_back(std::move(p));
+    }
+
+    // Each burst is written in one go and read back before the next, so write queues
+    // stay far below the watermarks and nothing spills to disk.
+    std::string body(kBodySize, 'x');
+    std::atomic<std::size_t> delivered{0};
+    auto start = Clock::now();
+    std::vector<std::thread> clients;
+    for (unsigned t = 0; t < client_threads; ++t) {
+        clients.emplace_back([&, t] {
+            std::string payload;
+            for (std::size_t sent = 0; sent < messages; sent += kBurst) {
+                for (std::size_t i = t; i < conns.size(); i += client_threads) {
+                    auto& p = *conns[i];
+                    std::string frames;
+                    for (std::size_t k = 0; k < kBurst; ++k) {
+                        frames += Protocol::make_frame(Protocol::FrameType::Msg, p.receiver_id, body);
+                    }
+                    boost::asio::write(p.sender, boost::asio::buffer(frames));
+                }
+                for (std::size_t i = t; i < conns.size(); i += client_threads) {
+                    for (std::size_t k = 0; k < kBurst; ++k) read_frame(conns[i]->receiver, payload);
+                    delivered.fetch_add(kBurst, std::memory_order_relaxed);
+                }
+            }
+        });
+    }
+    for (auto& c : clients) c.join();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    boost::system::error_code ec;
+    for (auto& p : conns) {
+        p->sender.close(ec);
+        p->receiver.close(ec);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    for (auto& ctx : contexts) ctx->stop();
+    for (auto& t : server_threads) t.join();
+    return delivered.load() / seconds;
+}
+
+// io_model_bench [threads] [pairs] [messages per pair]
+int main(int argc, char** argv) {
+    unsigned threads = argc > 1 ? std::stoul(argv[1]) : std::max(1u, std::thread::hardware_concurrency());
+    std::size_t pairs = argc > 2 ? std::stoul(argv[2]) : 64;
+    std::size_t messages = argc > 3 ? std::stoul(argv[3]) : 20000;
+    unsigned client_threads = std::max(1u, std::min<unsigned>(4, static_cast<unsigned>(pairs)));
+
+    std::cout << "threads " << threads << ", pairs " << pairs << ", " << messages
+              << " messages per pair, " << kBodySize << " byte bodies\n";
+    std::cout << "model          msgs/sec\n";
+    double shared = run(IoModel::Shared, threads, pairs, messages, client_threads);
+    std::cout << std::left << std::setw(10) << "shared" << std::right << std::fixed << std::setprecision(0)
+              << std::setw(14) << shared << "\n";
+    double per_core = run(IoModel::PerCore, threads, pairs, messages, client_threads);
+    std::cout << std::left << std::setw(10) << "per-core" << std::right << std::fixed << std::setprecision(0)
+              << std::setw(14) << per_core << std::setprecision(2) << "   x" << per_core / shared << "\n";
+    return 0;
+}
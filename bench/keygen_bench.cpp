@@ -0,0 +1,83 @@
+// Provisioning a batch of accounts, one RSA-2048 key pair each.
+// sync:    Crypto::generate_rsa_pem in a loop on the calling thread, which is blocked
+//          for the whole batch (what an io thread would suffer during onboarding).
+// service: KeyGenService::async_generate for every account at once, N workers; the
+//          calling thread only issues the requests.
+// pooled:  the same against a service whose pool was filled ahead of time; the time a
+//          request waits for its pair.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <latch>
+#include <thread>
+#include <vector>
+#include <boost/asio/use_future.hpp>
+#include "Crypto/KeyGenService.h"
+
+using Clock = std::chrono::steady_clock;
+
+static double ms_since(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// Wall time until every request of the batch completed; `issue_ms` is how long the
+// calling thread spent issuing them.
+static double provision(CPCDMessenger::KeyGenService& service, std::size_t accounts, double& issue_ms) {
+    std::latch done(static_cast<std::ptrdiff_t>(accounts));
+    std::atomic<std::size_t> failed{0};
+    auto start = Clock::now();
+    for (std::size_t i = 0; i < accounts; ++i) {
+        service.async_generate([&](boost::system::error_code ec, CPCDMessenger::RsaKeyPair pair) {
+            if (ec || pair.public_pem.empty()) ++failed;
+            done.count_down();
+        });
+    }
+    issue_ms = ms_since(start);
+    done.wait();
+    double total = ms_since(start);
+    if (failed) {
+        std::cerr << failed << " key generations failed\n";
+        std::exit(1);
+    }
+    return total;
+}
+
+int main() {
+    constexpr std::size_t kAccounts = 32;
+    std::size_t workers = std::max(1u, std::thread::hardware_concurrency());
+
+    Crypto crypto;
+    auto start = Clock::now();
+    for (std::size_t i = 0; i < kAccounts; ++i) {
+        std::string priv, pub;
+        if (!crypto.generate_rsa_pem(priv, pub)) return 1;
+    }
+    double sync_ms = ms_since(start);
+
+    double issue_ms = 0, service_ms = 0;
+    {
+        CPCDMessenger::KeyGenService service(workers);
+        service_ms = provision(service, kAccounts, issue_ms);
+    }
+
+    double pooled_ms = 0, pooled_issue_ms = 0;
+    {
+        CPCDMessenger::KeyGenService service(workers, kAccounts);
+        while (service.ready() < kAccounts) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        pooled_ms = provision(service, kAccounts, pooled_issue_ms);
+
+        // One more through use_future, as a thread without an io_context would ask.
+        auto pair = service.async_generate(boost::asio::use_future).get();
+        if (pair.private_pem.empty()) return 1;
+    }
+
+    std::cout << kAccounts << " accounts, " << workers << " worker(s)\n" << std::fixed << std::setprecision(1)
+              << "                wall ms   ms/account   caller blocked ms\n"
+              << "sync     " << std::setw(14) << sync_ms << std::setw(13) << sync_ms / kAccounts << std::setw(20) << sync_ms << "\n"
+              << "service  " << std::setw(14) << service_ms << std::setw(13) << service_ms / kAccounts << std::setw(20) << issue_ms << "\n"
+              << "pooled   " << std::setw(14) << pooled_ms << std::setw(13) << pooled_ms / kAccounts << std::setw(20) << pooled_issue_ms << "\n";
+    return 0;
+}
@@ -0,0 +1,98 @@
+// Per-line cost of splitting received bytes into JSON lines.
+// streambuf: what the relay did before, each line found by read_until's search over
+// the streambuf, then copied out through a std::istream and std::getline, one
+// read_until (one async operation on a socket) per line.
+// ReadBuffer: bytes land in place, memchr finds the delimiters and every line of a
+// read is handed out as a view before the next read.
+// Both sides get the same 64 KiB "socket reads", so partial lines at read boundaries
+// are exercised too.
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <istream>
+#include <string>
+#include <boost/asio/buffers_iterator.hpp>
+#include <boost/asio/streambuf.hpp>
+#include "Connection/ReadBuffer.h"
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t kReadSize = 64 * 1024;
+
+static std::string make_stream(std::size_t line_size, std::size_t total) {
+    std::string line = R"({"cmd":"msg","to":"user1","body":")";
+    line.append(line_size > line.size() + 3 ? line_size - line.size() - 3 : 1, 'a');
+    line += "\"}\n";
+    std::string out;
+    while (out.size() < total) out += line;
+    return out;
+}
+
+static std::size_t split_streambuf(const std::string& stream) {
+    boost::asio::streambuf buf;
+    std::size_t sink = 0;
+    std::size_t searched = 0;
+    for (std::size_t pos = 0; pos < stream.size(); pos += kReadSize) {
+        std::size_t n = std::min(kReadSize, stream.size() - pos);
+        auto space = buf.prepare(n);
+        std::memcpy(space.data(), stream.data() + pos, n);
+        buf.commit(n);
+        while (true) {
+            auto begin = boost::asio::buffers_begin(buf.data());
+            auto end = boost::asio::buffers_end(buf.data());
+            auto hit = std::find(begin + static_cast<std::ptrdiff_t>(searched), end, '\n');
+            if (hit == end) {
+                searched = buf.size();
+                break;
+            }
+            searched = 0;
+            std::istream is(&buf);
+            std::string line;
+            std::getline(is, line);
+            sink += line.size();
+        }
+    }
+    return sink;
+}
+
+static std::size_t split_read_buffer(const std::string& stream) {
+    CPCDMessenger::ReadBuffer buf;
+    std::size_t sink = 0;
+    std::size_t pos = 0;
+    while (pos < stream.size()) {
+        auto space = buf.prepare();
+        std::size_t n = std::min(space.size(), stream.size() - pos);
+        std::memcpy(space.data(), stream.data() + pos, n);
+        buf.commit(n);
+        pos += n;
+        while (auto line = buf.next_line()) sink += line->size();
+    }
+    return sink;
+}
+
+template<typename F>
+static double ns_per_line(const std::string& stream, std::size_t lines, std::size_t rounds, F&& split) {
+    std::size_t sink = split(stream);
+    auto start = Clock::now();
+    for (std::size_t r = 0; r < rounds; ++r) sink += split(stream);
+    double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    if (sink == 42) std::cout << "";
+    return ns / (lines * rounds);
+}
+
+int main() {
+    std::cout << "line bytes   streambuf ns/line   ReadBuffer ns/line   speedup\n";
+    for (std::size_t line_size : {64, 256, 1024, 16384}) {
+        std::string stream = make_stream(line_size, 8 << 20);
+        std::size_t lines = static_cast<std::size_t>(std::count(stream.begin(), stream.end(), '\n'));
+        std::size_t rounds = 8;
+        double old_path = ns_per_line(stream, lines, rounds, split_streambuf);
+        double new_path = ns_per_line(stream, lines, rounds, split_read_buffer);
+        std::cout << std::setw(10) << line_size << std::fixed << std::setprecision(1)
+                  << std::setw(20) << old_path << std::setw(21) << new_path
+                  << std::setprecision(2) << std::setw(9) << old_path / new_path << "x\n";
+    }
+    return 0;
+}
@@ -0,0 +1,90 @@
+// Bulk import of an NDJSON message archive, page cache warm.
+// getline:      std::getline over an ifstream, the line split alone, for reference.
+// records:      RecordReader on one thread.
+// records xN:   RecordReader::forEach on N threads.
+// parse xN:     the same, each record parsed with nlohmann::json.
+// import xN:    import_archive into an empty OfflineStore, durable at the end.
+// Senders and recipients are drawn from one user per ten records, so the import interns
+// as many new names as a real archive of that size.
+//
+//   record_import_bench [records, default 1000000] [threads, default all cores]
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <nlohmann/json.hpp>
+#include "Storage/ArchiveImport.h"
+
+using Clock = std::chrono::steady_clock;
+namespace fs = std::filesystem;
+
+template<typename F>
+static void report(const std::string& name, std::uint64_t bytes, std::uint64_t records, F&& run) {
+    auto start = Clock::now();
+    std::uint64_t seen = run();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    std::cout << std::left << std::setw(14) << name << std::right << std::fixed << std::setprecision(2)
+              << std::setw(8) << bytes / seconds / 1e9 << " GB/s" << std::setprecision(0)
+              << std::setw(12) << records / seconds << " records/s"
+              << (seen == records ? "" : "  (count mismatch)") << "\n";
+}
+
+int main(int argc, char** argv) {
+    std::uint64_t records = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    std::size_t threads = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : std::max(1u, std::thread::hardware_concurrency());
+    fs::path dir = fs::temp_directory_path() / "record_import_bench";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    std::uint64_t users = std::max<std::uint64_t>(1, records / 10);
+    auto path = (dir / "archive.ndjson").string();
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        for (std::uint64_t i = 0; i < records; ++i) {
+            nlohmann::json j = { {"from", "user" + std::to_string(i * 7919 % users)}, {"to", "user" + std::to_string(i * 104729 % users)},
+                                 {"body", "archived message " + std::to_string(i) + std::string(i % 64, 'x')} };
+            out << j.dump() << '\n';
+        }
+    }
+    std::uint64_t bytes = fs::file_size(path);
+    std::string xn = " x" + std::to_string(threads);
+    std::cout << records << " records, " << users << " users, " << bytes / (1024 * 1024) << " MiB\n";
+
+    report("getline", bytes, records, [&] {
+        std::ifstream in(path, std::ios::binary);
+        std::string line;
+        std::uint64_t n = 0;
+        while (std::getline(in, line)) n += !line.empty();
+        return n;
+    });
+    report("records", bytes, records, [&] {
+        FileParser::RecordReader reader(path);
+        std::uint64_t n = 0;
+        while (reader.next()) ++n;
+        return n;
+    });
+    report("records" + xn, bytes, records, [&] {
+        return FileParser::RecordReader::forEach(path, threads, [](std::string_view) {});
+    });
+    report("parse" + xn, bytes, records, [&] {
+        return FileParser::RecordReader::forEach(path, threads, [](std::string_view record) {
+            auto j = nlohmann::json::parse(record.begin(), record.end(), nullptr, false);
+            if (!j.is_object()) std::abort();
+        });
+    });
+
+    CPCDMessenger::NameDirectory names;
+    CPCDMessenger::ImportResult result;
+    {
+        CPCDMessenger::OfflineStore store(dir / "offline", names);
+        report("import" + xn, bytes, records, [&] {
+            result = CPCDMessenger::import_archive(path, store, names, threads);
+            return result.imported;
+        });
+    }
+    fs::remove_all(dir);
+    return result.imported == records && result.rejected == 0 ? 0 : 1;
+}
@@ -0,0 +1,126 @@
+// Lookup throughput of the session registry at 1..64 threads.
+// Compares the old single-mutex map with ShardedRegistry while a writer thread
+// keeps logging users in and out. Then the cost of inserting many distinct keys into an
+// empty registry, as a burst of first logins or an archive import interns new names.
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "Registry/ShardedRegistry.h"
+
+using Session = std::weak_ptr<int>;
+
+class MutexRegistry {
+public:
+    std::optional<Session> find(const std::string& key) {
+        std::lock_guard<std::mutex> lk(mutex_);
+        auto it = map_.find(key);
+        if (it == map_.end()) return std::nullopt;
+        return it->second;
+    }
+    void insert_or_assign(const std::string& key, Session value) {
+        std::lock_guard<std::mutex> lk(mutex_);
+        map_.insert_or_assign(key, std::move(value));
+    }
+    bool erase(const std::string& key) {
+        std::lock_guard<std::mutex> lk(mutex_);
+        return map_.erase(key) > 0;
+    }
+
+private:
+    std::unordered_map<std::string, Session> map_;
+    std::mutex mutex_;
+};
+
+constexpr std::size_t kUsers = 100000;
+constexpr auto kRunTime = std::chrono::milliseconds(300);
+
+using Clock = std::chrono::steady_clock;
+
+template<typename Registry>
+double run(Registry& registry, const std::vector<std::string>& names, unsigned threads) {
+    std::atomic<bool> stop{false};
+    std::atomic<std::uint64_t> total{0};
+    std::atomic<std::uint64_t> hits_sink{0};
+    auto owner = std::make_shared<int>(0);
+
+    // ~1000 logins/logouts per second, the churn of a busy relay.
+    std::thread writer([&] {
+        std::mt19937 rng(7);
+        while (!stop.load(std::memory_order_relaxed)) {
+            const auto& name = names[rng() % names.size()];
+            registry.erase(name);
+            registry.insert_or_assign(name, owner);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    std::vector<std::thread> readers;
+    for (unsigned t = 0; t < threads; ++t) {
+        readers.emplace_back([&, t] {
+            std::mt19937 rng(t + 1);
+            std::uint64_t n = 0, hits = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                for (int i = 0; i < 256; ++i) {
+                    hits += registry.find(names[rng() % names.size()]).has_value();
+                }
+                n += 256;
+            }
+            total += n;
+            hits_sink += hits;
+        });
+    }
+
+    std::this_thread::sleep_for(kRunTime);
+    stop = true;
+    for (auto& r : readers) r.join();
+    writer.join();
+    return total.load() / std::chrono::duration<double>(kRunTime).count() / 1e6;
+}
+
+template<typename Registry>
+double ns_per_insert(std::size_t keys) {
+    Registry registry;
+    auto owner = std::make_shared<int>(0);
+    auto start = Clock::now();
+    for (std::size_t i = 0; i < keys; ++i) registry.insert_or_assign("name" + std::to_string(i), owner);
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / static_cast<double>(keys);
+}
+
+int main() {
+    std::vector<std::string> names;
+    names.reserve(kUsers);
+    for (std::size_t i = 0; i < kUsers; ++i) names.push_back("user" + std::to_string(i));
+
+    auto owner = std::make_shared<int>(0);
+    MutexRegistry mutex_registry;
+    CPCDMessenger::ShardedRegistry<Session> sharded_registry;
+    for (const auto& name : names) {
+        mutex_registry.insert_or_assign(name, owner);
+        sharded_registry.insert_or_assign(name, owner);
+    }
+
+    std::cout << "threads  mutex Mlookup/s  sharded Mlookup/s\n";
+    for (unsigned threads : {1u, 2u, 4u, 8u, 16u, 32u, 64u}) {
+        double m = run(mutex_registry, names, threads);
+        double s = run(sharded_registry, names, threads);
+        std::cout << std::setw(7) << threads << std::fixed << std::setprecision(2)
+                  << std::setw(19) << m << std::setw(19) << s << "\n";
+    }
+
+    std::cout << "\n   keys  mutex ns/insert  sharded ns/insert\n";
+    for (std::size_t keys : {50000u, 200000u, 1000000u}) {
+        double m = ns_per_insert<MutexRegistry>(keys);
+        double s = ns_per_insert<CPCDMessenger::ShardedRegistry<Session>>(keys);
+        std::cout << std::setw(7) << keys << std::fixed << std::setprecision(0)
+                  << std::setw(17) << m << std::setw(19) << s << "\n";
+    }
+    return 0;
+}
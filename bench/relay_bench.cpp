@@ -0,0 +1,401 @@
+// Load generator for a running relay.
+// Opens many sessions, logs them in and sends direct messages between random pairs
+// at a fixed aggregate rate. Every body starts with the send time as 16 hex digits,
+// so the receiving session measures end-to-end delivery latency.
+//
+//   relay_bench --port=5555 --sessions=2000 --rate=50000 --size=64 --size-max=1024 --duration=10
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include "Connection/connection_lib.h"
+#include "argument_parser.h"
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+    constexpr std::size_t kStampSize = 16;
+    constexpr auto kTick = std::chrono::milliseconds(1);
+
+    struct Options {
+        std::string host = "127.0.0.1";
+        int port = 5555;
+        int sessions = 1000;
+        int rate = 10000;
+        int size = 64;
+        int size_max = 0;
+        int duration = 10;
+        int threads = 4;
+        std::string framing = "binary";
+        std::string prefix = "bench";
+    };
+
+    std::int64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+    }
+
+    std::int64_t parse_stamp(std::string_view body) {
+        if (body.size() < kStampSize) return -1;
+        std::int64_t stamp = 0;
+        for (char c : body.substr(0, kStampSize)) {
+            int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+            if (digit < 0) return -1;
+            stamp = (stamp << 4) | digit;
+        }
+        return stamp;
+    }
+
+    class BenchSession;
+
+    // One single-threaded io_context per client thread; its sessions, pacer and
+    // latency samples are only touched from that thread.
+    struct ClientThread {
+        boost::asio::io_context ioc{1};
+        std::vector<BenchSession*> sessions;
+        std::vector<float> latencies_us;
+        std::atomic<std::uint64_t> sent{0};
+        std::atomic<std::uint64_t> received{0};
+        std::uint64_t behind = 0;
+        std::mt19937 rng{std::random_device{}()};
+    };
+
+    class BenchSession {
+    public:
+        BenchSession(ClientThread& thread, std::string name, bool binary, std::atomic<int>& ready)
+        : socket_(thread.ioc), thread_(thread), name_(std::move(name)), binary_(binary), ready_(ready) {}
+
+        tcp::socket& socket() { return socket_; }
+        const std::string& name() const { return name_; }
+        std::uint32_t id() const { return id_; }
+
+        void start(const tcp::endpoint& endpoint) {
+            socket_.async_connect(endpoint, [this](boost::system::error_code ec) {
+                if (ec) {
+                    std::cerr << "connect " << name_ << ": " << ec.message() << "\n";
+                    return;
+                }
+                socket_.set_option(tcp::no_delay(true));
+                if (binary_) {
+                    queue(std::string(R"({"cmd":"hello","framing":"binary"})") + "\n");
+                    // Nothing but hello_ok arrives before the switch, so the login frame can follow.
+                    queue(Protocol::make_frame(Protocol::FrameType::Json, Protocol::kNoPeer, login_command()));
+                } else {
+                    queue(login_command() + "\n");
+                }
+                read_line();
+            });
+        }
+
+        void send(const BenchSession& to, std::string body) {
+            if (binary_) {
+                queue(Protocol::make_frame(Protocol::FrameType::Msg, to.id(), body));
+            } else {
+                json j = { {"cmd","msg"}, {"to", to.name()}, {"body", std::move(body)} };
+                queue(j.dump() + "\n");
+            }
+        }
+
+        void close() {
+            boost::system::error_code ec;
+            socket_.close(ec);
+        }
+
+    private:
+        std::string login_command() const {
+            return json{ {"cmd","login"}, {"user", name_} }.dump();
+        }
+
+        // JSON lines until hello_ok (binary) or for the whole run (JSON framing).
+        void read_line() {
+            boost::asio::async_read_until(socket_, read_buf_, '\n', [this](boost::system::error_code ec, std::size_t n) {
+                if (ec) return;
+                std::string line(boost::asio::buffers_begin(read_buf_.data()), boost::asio::buffers_begin(read_buf_.data()) + n);
+                read_buf_.consume(n);
+                bool switched = on_json(line);
+                if (switched) {
+                    read_header();
+                } else {
+                    read_line();
+                }
+            });
+        }
+
+        void read_header() {
+            std::size_t have = boost::asio::buffer_copy(boost::asio::buffer(header_), read_buf_.data());
+            read_buf_.consume(have);
+            boost::asio::async_read(socket_, boost::asio::buffer(header_.data() + have, header_.size() - have),
+                [this](boost::system::error_code ec, std::size_t) {
+                    if (ec) return;
+                    in_header_ = Protocol::FrameHeader::decode(header_.data());
+                    payload_.resize(in_header_.length);
+                    std::size_t buffered = boost::asio::buffer_copy(boost::asio::buffer(payload_), read_buf_.data());
+                    read_buf_.consume(buffered);
+                    boost::asio::async_read(socket_, boost::asio::buffer(payload_.data() + buffered, payload_.size() - buffered),
+                        [this](boost::system::error_code ec, std::size_t) {
+                            if (ec) return;
+                            if (in_header_.type == Protocol::FrameType::Msg) {
+                                on_body(payload_);
+                            } else if (in_header_.type == Protocol::FrameType::Json) {
+                                on_json(payload_);
+                            }
+                            read_header();
+                        });
+                });
+        }
+
+        // Returns true once the server confirmed the switch to binary framing.
+        bool on_json(std::string_view text) {
+            auto j = json::parse(text, nullptr, false);
+            if (j.is_discarded()) return false;
+            std::string type = j.value("type", "");
+            if (type == "msg") {
+                on_body(j.value("body", ""));
+            } else if (type == "login_ok") {
+                id_ = j["id"].get<std::uint32_t>();
+                ready_.fetch_add(1);
+            } else if (type == "hello_ok") {
+                return binary_;
+            } else if (type == "error") {
+                std::cerr << name_ << ": " << j.value("message", "") << "\n";
+            }
+            return false;
+        }
+
+        void on_body(std::string_view body) {
+            std::int64_t stamp = parse_stamp(body);
+            if (stamp < 0) return;
+            thread_.latencies_us.push_back(static_cast<float>((now_ns() - stamp) / 1e3));
+            thread_.received.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // Everything queued while a write is in flight goes out in the next write.
+        void queue(std::string bytes) {
+            pending_ += bytes;
+            if (!writing_) flush();
+        }
+
+        void flush() {
+            if (pending_.empty()) {
+                writing_ = false;
+                return;
+            }
+            writing_ = true;
+            inflight_.swap(pending_);
+            pending_.clear();
+            boost::asio::async_write(socket_, boost::asio::buffer(inflight_), [this](boost::system::error_code ec, std::size_t) {
+                if (ec) {
+                    writing_ = false;
+                    return;
+                }
+                flush();
+            });
+        }
+
+        tcp::socket socket_;
+        ClientThread& thread_;
+        std::string name_;
+        bool binary_;
+        std::atomic<int>& ready_;
+        std::uint32_t id_ = Protocol::kNoPeer;
+
+        boost::asio::streambuf read_buf_;
+        std::array<char, Protocol::kFrameHeaderSize> header_{};
+        Protocol::FrameHeader in_header_;
+        std::string payload_;
+
+        std::string pending_;
+        std::string inflight_;
+        bool writing_ = false;
+    };
+
+    std::string make_body(std::size_t size) {
+        std::string body(std::max(size, kStampSize), 'x');
+        char stamp[kStampSize + 1];
+        std::snprintf(stamp, sizeof(stamp), "%016llx", static_cast<unsigned long long>(now_ns()));
+        body.replace(0, kStampSize, stamp, kStampSize);
+        return body;
+    }
+
+    // Sends this thread's share of the rate: every tick it catches up with the schedule,
+    // a tick that cannot keep up counts as behind instead of bursting later.
+    void pace(ClientThread& thread, boost::asio::steady_timer& timer, const std::vector<BenchSession*>& all,
+              const Options& options, double rate, Clock::time_point start, Clock::time_point stop) {
+        timer.expires_at(timer.expiry() + kTick);
+        timer.async_wait([&, rate, start, stop](boost::system::error_code ec) {
+            if (ec) return;
+            auto now = Clock::now();
+            if (now >= stop) return;
+            double elapsed = std::chrono::duration<double>(now - start).count();
+            auto due = static_cast<std::uint64_t>(rate * elapsed);
+            std::uint64_t sent = thread.sent.load(std::memory_order_relaxed);
+            std::uint64_t budget = static_cast<std::uint64_t>(rate * 0.1) + 1;
+            if (due > sent + budget) {
+                thread.behind += due - sent - budget;
+                thread.sent.store(due - budget, std::memory_order_relaxed);
+                sent = due - budget;
+            }
+            std::uniform_int_distribution<std::size_t> pick_from(0, thread.sessions.size() - 1);
+            std::uniform_int_distribution<std::size_t> pick_to(0, all.size() - 2);
+            std::uniform_int_distribution<int> pick_size(options.size, std::max(options.size, options.size_max));
+            for (; sent < due; ++sent) {
+                BenchSession* from = thread.sessions[pick_from(thread.rng)];
+                BenchSession* to = all[pick_to(thread.rng)];
+                if (to == from) to = all.back();
+                from->send(*to, make_body(static_cast<std::size_t>(pick_size(thread.rng))));
+            }
+            thread.sent.store(sent, std::memory_order_relaxed);
+            pace(thread, timer, all, options, rate, start, stop);
+        });
+    }
+
+    double percentile(std::vector<float>& v, double p) {
+        if (v.empty()) return 0;
+        auto k = static_cast<std::size_t>(p * (v.size() - 1));
+        std::nth_element(v.begin(), v.begin() + k, v.end());
+        return v[k];
+    }
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    ArgumentParser::ArgParser parser("relay_bench");
+    parser.AddStringArgument('H', "host", "relay host").StoreValue(options.host).Default("127.0.0.1");
+    parser.AddIntArgument('P', "port", "relay port").StoreValue(options.port).Default(5555);
+    parser.AddIntArgument('s', "sessions", "concurrent sessions").StoreValue(options.sessions).Default(1000);
+    parser.AddIntArgument('r', "rate", "messages per second, all sessions together").StoreValue(options.rate).Default(10000);
+    parser.AddIntArgument("size", "body size in bytes").StoreValue(options.size).Default(64);
+    parser.AddIntArgument("size-max", "upper bound for uniformly random body sizes").StoreValue(options.size_max).Default(0);
+    parser.AddIntArgument('d', "duration", "seconds of sending").StoreValue(options.duration).Default(10);
+    parser.AddIntArgument('t', "threads", "client io threads").StoreValue(options.threads).Default(4);
+    parser.AddStringArgument("framing", "binary | json").StoreValue(options.framing).Default("binary");
+    parser.AddStringArgument("prefix", "username prefix").StoreValue(options.prefix).Default("bench");
+    parser.AddHelp('h', "help", "Relay load generator");
+
+    if (!parser.Parse(argc, argv)) {
+        std::cerr << "Invalid arguments\n" << parser.HelpDescription().str() << std::endl;
+        return 1;
+    }
+    if (parser.Help()) {
+        std::cout << parser.HelpDescription().str() << std::endl;
+        return 0;
+    }
+    if (options.sessions < 2 || options.rate <= 0 || options.size < 0 || options.duration <= 0 || options.threads <= 0
+        || options.port < 0 || options.port > 65535 || (options.framing != "binary" && options.framing != "json")) {
+        std::cerr << "Invalid arguments\n" << parser.HelpDescription().str() << std::endl;
+        return 1;
+    }
+
+    // Every session is one descriptor here and one on the relay.
+    rlimit lim{};
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+
+    auto nthreads = static_cast<std::size_t>(std::min(options.threads, options.sessions));
+    std::vector<std::unique_ptr<ClientThread>> threads;
+    for (std::size_t i = 0; i < nthreads; ++i) threads.push_back(std::make_unique<ClientThread>());
+
+    tcp::resolver resolver(threads.front()->ioc);
+    tcp::endpoint endpoint = *resolver.resolve(options.host, std::to_string(options.port)).begin();
+
+    std::atomic<int> ready{0};
+    std::vector<std::unique_ptr<BenchSession>> sessions;
+    std::vector<BenchSession*> all;
+    for (int i = 0; i < options.sessions; ++i) {
+        auto& thread = *threads[i % nthreads];
+        sessions.push_back(std::make_unique<BenchSession>(thread, options.prefix + "_" + std::to_string(i),
+                                                          options.framing == "binary", ready));
+        thread.sessions.push_back(sessions.back().get());
+        all.push_back(sessions.back().get());
+    }
+
+    std::vector<boost::asio::executor_work_guard<boost::asio::io_context::executor_type>> guards;
+    std::vector<std::thread> runners;
+    for (auto& thread : threads) {
+        guards.push_back(boost::asio::make_work_guard(thread->ioc));
+        runners.emplace_back([&ioc = thread->ioc] { ioc.run(); });
+    }
+
+    // Connects are posted per thread so they run on the owning io_context.
+    auto login_start = Clock::now();
+    for (auto& thread : threads) {
+        boost::asio::post(thread->ioc, [&thread, endpoint] {
+            for (auto* s : thread->sessions) s->start(endpoint);
+        });
+    }
+    while (ready.load() < options.sessions) {
+        if (Clock::now() - login_start > std::chrono::seconds(60)) {
+            std::cerr << "only " << ready.load() << " of " << options.sessions << " sessions logged in\n";
+            return 1;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    double login_seconds = std::chrono::duration<double>(Clock::now() - login_start).count();
+
+    auto start = Clock::now();
+    auto stop = start + std::chrono::seconds(options.duration);
+    std::vector<std::unique_ptr<boost::asio::steady_timer>> timers;
+    double rate_per_thread = static_cast<double>(options.rate) / nthreads;
+    for (auto& thread : threads) {
+        timers.push_back(std::make_unique<boost::asio::steady_timer>(thread->ioc, start));
+        boost::asio::post(thread->ioc, [&, &thread = *thread, &timer = *timers.back()] {
+            pace(thread, timer, all, options, rate_per_thread, start, stop);
+        });
+    }
+
+    auto totals = [&] {
+        std::uint64_t sent = 0, received = 0;
+        for (auto& t : threads) {
+            sent += t->sent.load();
+            received += t->received.load();
+        }
+        return std::pair{sent, received};
+    };
+    std::this_thread::sleep_until(stop);
+    // Give in-flight messages a moment to land before counting losses.
+    auto drain_deadline = Clock::now() + std::chrono::seconds(5);
+    while (Clock::now() < drain_deadline) {
+        auto [sent, received] = totals();
+        if (received >= sent) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    for (auto& thread : threads) {
+        boost::asio::post(thread->ioc, [&thread] {
+            for (auto* s : thread->sessions) s->close();
+        });
+    }
+    guards.clear();
+    for (auto& t : runners) t.join();
+
+    auto [sent, received] = totals();
+    std::uint64_t behind = 0;
+    std::vector<float> latencies;
+    for (auto& t : threads) {
+        behind += t->behind;
+        latencies.insert(latencies.end(), t->latencies_us.begin(), t->latencies_us.end());
+    }
+
+    std::cout << "sessions " << options.sessions << " (" << options.framing << "), logged in in "
+              << std::fixed << std::setprecision(2) << login_seconds << " s\n";
+    std::cout << "rate " << options.rate << " msgs/s, body " << options.size;
+    if (options.size_max > options.size) std::cout << ".." << options.size_max;
+    std::cout << " bytes, " << options.duration << " s\n";
+    std::cout << "sent " << sent << ", received " << received << ", lost " << (sent > received ? sent - received : 0)
+              << ", behind schedule " << behind << "\n";
+    std::cout << "throughput " << std::setprecision(0) << received / seconds << " msgs/s\n";
+    std::cout << std::setprecision(1) << "latency usec  p50 " << percentile(latencies, 0.50)
+              << "  p99 " << percentile(latencies, 0.99)
+              << "  p999 " << percentile(latencies, 0.999)
+              << "  max " << percentile(latencies, 1.0) << "\n";
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include <boost/asio.hpp>
+#include <chrono>
 #include <iostream>
 #include <thread>
 #include <string>
@@ -9,27 +10,48 @@
 using boost::asio::ip::tcp;
 using json = nlohmann::json;
 
-void run_server(unsigned short port) {
+void run_server(unsigned short port, const ServerConfig& config, IoModel model, unsigned int nthreads,
+                const std::string& import_path) {
     try {
-        boost::asio::io_context ioc{1};
-        Server server(ioc, port);
-        std::cout << "Relay server running on port " << port << "\n";
+        // Shared: one reactor run by every thread. Per-core: one single-threaded
+        // io_context per thread, each pinned and accepting on its own socket.
+        std::vector<std::unique_ptr<boost::asio::io_context>> contexts;
+        std::size_t count = model == IoModel::PerCore ? nthreads : 1;
+        int hint = model == IoModel::PerCore ? 1 : static_cast<int>(nthreads);
+        std::vector<boost::asio::io_context*> workers;
+        for (std::size_t i = 0; i < count; ++i) {
+            contexts.push_back(std::make_unique<boost::asio::io_context>(hint));
+            workers.push_back(contexts.back().get());
+        }
+        Server server(workers, port, config);
+        if (!import_path.empty()) {
+            auto start = std::chrono::steady_clock::now();
+            auto result = server.import_archive(import_path, nthreads);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "Imported " << result.imported << " messages from " << import_path << " in " << seconds << " s";
+            if (result.rejected != 0) std::cout << ", " << result.rejected << " malformed lines skipped";
+            std::cout << "\n";
+        }
+        std::cout << "Relay server running on port " << port << " ("
+                  << (model == IoModel::PerCore ? "per-core" : "shared") << ", " << nthreads << " threads)\n";
 
-        unsigned int nthreads = std::max(1u, std::thread::hardware_concurrency());
         std::vector<std::thread> threads;
-        for (unsigned int i = 0; i < nthreads - 1; ++i) {
-            threads.emplace_back([&ioc]{ ioc.run(); });
+        for (unsigned int i = 1; i < nthreads; ++i) {
+            std::size_t worker = model == IoModel::PerCore ? i : 0;
+            threads.emplace_back([&server, worker]{ server.run_worker(worker); });
         }
-        ioc.run();
+        server.run_worker(0);
         for (auto &t : threads) t.join();
     } catch (std::exception& ex) {
         std::cerr << "Server fatal: " << ex.what() << "\n";
     }
 }
 
-void run_client(const std::string& host, unsigned short port) {
+void run_client(const std::string& host, unsigned short port, const std::string& key_file, const std::string& download_dir) {
     boost::asio::io_context ioc;
-    auto client = std::make_shared<ConsoleClient>(ioc, host, port);
+    // Declared after ioc: it is destroyed first and aborts a keygen still waiting on it.
+    CPCDMessenger::KeyGenService keygen;
+    auto client = std::make_shared<ConsoleClient>(ioc, host, port, keygen, key_file, download_dir);
     client->start();
 
     // Запускаем ioc в отдельном потоке
@@ -37,7 +59,9 @@ void run_client(const std::string& host, unsigned short port) {
 
     std::cout << "Console client. Команды:\n";
     std::cout << "  /login <username>\n";
-    std::cout << "  /msg <to> <message>\n";
+    std::cout << "  /msg <to> <message>   (end-to-end encrypted)\n";
+    std::cout << "  /send-file <to> <path>   (encrypted, resumes when sent again)\n";
+    std::cout << "  /attach <to> <path>      (encrypted, kept on the relay, only new chunks are uploaded)\n";
     std::cout << "  /quit\n";
     std::cout << "Чтобы отправить сообщение без команды, используйте: /msg <to> <message>\n";
 
@@ -66,10 +90,24 @@ void run_client(const std::string& host, unsigned short port) {
             std::getline(iss, body);
             if (!body.empty() && body[0] == ' ') body.erase(0,1);
             client->send_message(to, body);
+        } else if (line.rfind("/send-file ", 0) == 0 || line.rfind("/attach ", 0) == 0) {
+            bool attach = line[1] == 'a';
+            std::istringstream iss(line.substr(line.find(' ') + 1));
+            std::string to;
+            std::string path;
+            iss >> to;
+            std::getline(iss, path);
+            size_t start = path.find_first_not_of(" \t");
+            if (to.empty() || start == std::string::npos) {
+                std::cout << (attach ? "Usage: /attach <to> <path>\n" : "Usage: /send-file <to> <path>\n");
+                continue;
+            }
+            if (attach) client->send_attachment(to, path.substr(start));
+            else client->send_file(to, path.substr(start));
         } else if (line == "/quit") {
             break;
         } else if (line == "/help") {
-            std::cout << "Команды: /login /msg /quit /help\n";
+            std::cout << "Команды: /login /msg /send-file /attach /quit /help\n";
         } else {
             std::cout << "Неизвестная команда. Введите /help.\n";
         }
@@ -82,17 +120,35 @@ void run_client(const std::string& host, unsigned short port) {
 
 int main(int argc, char** argv) {
     std::ios::sync_with_stdio(false);
+#ifdef _WIN32
     SetConsoleOutputCP(CP_UTF8);
     SetConsoleCP(CP_UTF8);
+#endif
 
     std::string mode = "server";
     std::string host = "127.0.0.1";
     int port_int = 5555;
+    ServerConfig config;
+    int write_batch = 64 * 1024;
+    std::string io_model = "shared";
+    int threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    int metrics_port = 0;
+    std::string key_file = "client-key.pem";
+    std::string download_dir = "downloads";
+    std::string import_path;
 
     ArgumentParser::ArgParser parser("MessengerRelay");
     parser.AddStringArgument('m', "mode", "server | client").StoreValue(mode).Default("server");
     parser.AddStringArgument('H', "host", "relay host").StoreValue(host).Default("127.0.0.1");
     parser.AddIntArgument('P', "port", "relay port").StoreValue(port_int).Default(5555);
+    parser.AddStringArgument('d', "data-dir", "relay storage directory").StoreValue(config.data_dir).Default("relay-data");
+    parser.AddIntArgument("write-batch", "max bytes per gathered socket write").StoreValue(write_batch).Default(64 * 1024);
+    parser.AddStringArgument("io-model", "shared | per-core").StoreValue(io_model).Default("shared");
+    parser.AddIntArgument("threads", "server io threads").StoreValue(threads).Default(threads);
+    parser.AddIntArgument("metrics-port", "loopback port for HTTP /metrics, 0 disables").StoreValue(metrics_port).Default(0);
+    parser.AddStringArgument("key-file", "client private key (PEM), created if missing").StoreValue(key_file).Default("client-key.pem");
+    parser.AddStringArgument("download-dir", "where the client saves received files").StoreValue(download_dir).Default("downloads");
+    parser.AddStringArgument("import", "NDJSON archive of messages to queue for their recipients on start").StoreValue(import_path).Default("");
     parser.AddHelp('h', "help", "Messenger with relay server");
 
     if (!parser.Parse(argc, argv)) {
@@ -109,12 +165,31 @@ int main(int argc, char** argv) {
         return 1;
     }
     unsigned short port = static_cast<unsigned short>(port_int);
+    if (write_batch <= 0) {
+        std::cerr << "Invalid write batch size: " << write_batch << std::endl;
+        return 1;
+    }
+    config.max_write_batch_bytes = static_cast<std::size_t>(write_batch);
+    if (io_model != "shared" && io_model != "per-core") {
+        std::cerr << "Unknown io model: " << io_model << std::endl;
+        return 1;
+    }
+    if (threads <= 0) {
+        std::cerr << "Invalid thread count: " << threads << std::endl;
+        return 1;
+    }
+    if (metrics_port < 0 || metrics_port > 65535) {
+        std::cerr << "Invalid metrics port: " << metrics_port << std::endl;
+        return 1;
+    }
+    config.metrics_port = static_cast<unsigned short>(metrics_port);
+    IoModel model = io_model == "per-core" ? IoModel::PerCore : IoModel::Shared;
 
     try {
         if (mode == "server" || mode == "relay") {
-            run_server(port);
+            run_server(port, config, model, static_cast<unsigned int>(threads), import_path);
         } else if (mode == "client") {
-            run_client(host, port);
+            run_client(host, port, key_file, download_dir);
         } else {
             std::cerr << "Unknown mode: " << mode << "\n";
             std::cerr << parser.HelpDescription() << std::endl;
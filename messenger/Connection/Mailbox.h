@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <new>
+#include <utility>
+#include "../Memory/SlabPool.h"
+
+namespace CPCDMessenger {
+    // Lock-free multi-producer single-consumer queue (Vyukov's node-based design).
+    // Producers on any thread push; only the owning worker thread drains. push()
+    // reports when the mailbox goes from idle to armed, so the producer that sees it
+    // schedules exactly one drain on the owner's io_context.
+    template<typename T>
+    class Mailbox {
+    public:
+        Mailbox() : head_(make_node()), tail_(head_.load(std::memory_order_relaxed)) {}
+
+        Mailbox(const Mailbox&) = delete;
+        Mailbox& operator=(const Mailbox&) = delete;
+
+        ~Mailbox() {
+            T ignored;
+            while (pop(ignored)) {}
+            free_node(tail_);
+        }
+
+        // Returns true when the caller must schedule a drain.
+        bool push(T value) {
+            Node* node = make_node();
+            node->value = std::move(value);
+            Node* prev = head_.exchange(node, std::memory_order_acq_rel);
+            prev->next.store(node, std::memory_order_release);
+            return !armed_.exchange(true, std::memory_order_acq_rel);
+        }
+
+        // Consumer side. Disarming first means a push that lands after the last pop
+        // re-arms the mailbox and schedules another drain instead of being stranded.
+        template<typename F>
+        void drain(F&& consume) {
+            armed_.exchange(false, std::memory_order_acq_rel);
+            T value;
+            while (pop(value)) consume(std::move(value));
+        }
+
+    private:
+        struct Node {
+            std::atomic<Node*> next{nullptr};
+            T value{};
+        };
+
+        // Nodes come from the slab pool; the consumer frees what producers allocated and
+        // the pool's depot carries the blocks back.
+        static Node* make_node() {
+            return new (Memory::SlabPool::allocate(sizeof(Node))) Node;
+        }
+
+        static void free_node(Node* node) {
+            node->~Node();
+            Memory::SlabPool::deallocate(node, sizeof(Node));
+        }
+
+        bool pop(T& out) {
+            Node* next = tail_->next.load(std::memory_order_acquire);
+            if (!next) return false;
+            out = std::move(next->value);
+            free_node(tail_);
+            tail_ = next;
+            return true;
+        }
+
+        alignas(64) std::atomic<Node*> head_;
+        alignas(64) Node* tail_;
+        std::atomic<bool> armed_{false};
+    };
+} // CPCDMessenger
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string_view>
+
+namespace CPCDMessenger {
+    // Receive buffer that hands out frames as views into itself. Socket reads land in
+    // the free space behind the unread bytes; once that falls below half the buffer the
+    // unread tail is moved back to the front, so a frame is always contiguous and is
+    // never copied out. The capacity stays fixed unless a single frame needs more; it
+    // then doubles up to `max_capacity` and drops back once the buffer is drained.
+    class ReadBuffer {
+    public:
+        static constexpr std::size_t kDefaultCapacity = 64 * 1024;
+
+        explicit ReadBuffer(std::size_t capacity = kDefaultCapacity, std::size_t max_capacity = kDefaultCapacity)
+        : base_capacity_(capacity),
+          max_capacity_(std::max(capacity, max_capacity)),
+          capacity_(capacity),
+          data_(std::make_unique_for_overwrite<char[]>(capacity))
+        {}
+
+        ReadBuffer(const ReadBuffer&) = delete;
+        ReadBuffer& operator=(const ReadBuffer&) = delete;
+
+        // Space for the next read, empty when an unfinished frame already fills
+        // max_capacity. Invalidates views handed out earlier.
+        std::span<char> prepare() {
+            if (begin_ == end_) {
+                begin_ = end_ = scanned_ = 0;
+                if (capacity_ != base_capacity_) resize(base_capacity_);
+            } else if (begin_ > 0 && capacity_ - end_ < capacity_ / 2) {
+                compact();
+            }
+            if (end_ == capacity_ && capacity_ < max_capacity_) {
+                resize(std::min(capacity_ * 2, max_capacity_));
+            }
+            return {data_.get() + end_, capacity_ - end_};
+        }
+
+        void commit(std::size_t bytes) { end_ += bytes; }
+
+        const char* data() const { return data_.get() + begin_; }
+        std::size_t size() const { return end_ - begin_; }
+
+        void consume(std::size_t bytes) {
+            begin_ += bytes;
+            scanned_ = std::max(scanned_, begin_);
+        }
+
+        // Next `delim`-terminated frame, without the delimiter, consumed from the buffer;
+        // nullopt until one is complete. Bytes already searched are not searched again.
+        std::optional<std::string_view> next_line(char delim = '\n') {
+            const char* base = data_.get();
+            auto* hit = static_cast<const char*>(std::memchr(base + scanned_, delim, end_ - scanned_));
+            if (!hit) {
+                scanned_ = end_;
+                return std::nullopt;
+            }
+            std::string_view line(base + begin_, static_cast<std::size_t>(hit - base) - begin_);
+            begin_ = scanned_ = static_cast<std::size_t>(hit - base) + 1;
+            return line;
+        }
+
+    private:
+        void compact() {
+            std::memmove(data_.get(), data_.get() + begin_, end_ - begin_);
+            end_ -= begin_;
+            scanned_ -= begin_;
+            begin_ = 0;
+        }
+
+        void resize(std::size_t capacity) {
+            auto grown = std::make_unique_for_overwrite<char[]>(capacity);
+            std::memcpy(grown.get(), data_.get() + begin_, end_ - begin_);
+            end_ -= begin_;
+            scanned_ -= begin_;
+            begin_ = 0;
+            data_ = std::move(grown);
+            capacity_ = capacity;
+        }
+
+        std::size_t base_capacity_;
+        std::size_t max_capacity_;
+        std::size_t capacity_;
+        std::unique_ptr<char[]> data_;
+        std::size_t begin_ = 0;
+        std::size_t end_ = 0;
+        std::size_t scanned_ = 0;
+    };
+} // CPCDMessenger
@@ -4,6 +4,10 @@
 #include <boost/asio/ssl.hpp>
 #include <iostream>
 #include <unordered_map>
+#include <unordered_set>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
 #include <memory>
 #include <mutex>
 #include <deque>
@@ -12,200 +16,1008 @@
 #include <atomic>
 #include <optional>
 #include <thread>
+#include <array>
+#include <string_view>
+#include <span>
 #include <nlohmann/json.hpp>
+#include "../Protocol/Frame.h"
+#include "../Protocol/CommandScanner.h"
+#include "../Protocol/RoutedMessage.h"
+#include "../Registry/StableArray.h"
+#include "../Registry/Reclaimer.h"
+#include "../Registry/NameDirectory.h"
+#include "../Registry/Channel.h"
+#include "../Registry/KeyDirectory.h"
+#include "../Storage/OfflineStore.h"
+#include "../Storage/ArchiveImport.h"
+#include "../Metrics/RelayMetrics.h"
+#include "../Metrics/MetricsEndpoint.h"
+#include "../Crypto/SessionKeys.h"
+#include "../Crypto/KeyGenService.h"
+#include "../Transfer/FileTransfer.h"
+#include "../Transfer/Attachment.h"
+#include "../Memory/PooledHandler.h"
+#include "Mailbox.h"
+#include "ReadBuffer.h"
+
+#ifdef __linux__
+    #include <pthread.h>
+    #include <sched.h>
+#endif
 
 using boost::asio::ip::tcp;
 using json = nlohmann::json;
+namespace Protocol = CPCDMessenger::Protocol;
+using CPCDMessenger::UserId;
+using CPCDMessenger::ChannelId;
 
 class Server;
 
+// Sessions use the io_context's concrete executor: the type-erased any_io_executor
+// allocates when handlers are dispatched through it. Session handlers are wrapped with
+// Memory::pooled, so the operations asio builds around them come from the slab pool, and
+// the session strand is an io_context::strand, which schedules itself without allocating
+// (strand<> allocates an invoker whenever it has to requeue).
+using SessionSocket = boost::asio::basic_stream_socket<tcp, boost::asio::io_context::executor_type>;
+
+enum class RouteResult { Delivered, Stored, Deferred, UnknownRecipient };
+
 class ClientSession : public std::enable_shared_from_this<ClientSession> {
 public:
-    ClientSession(tcp::socket socket, Server& server)
+    ClientSession(SessionSocket socket, Server& server, std::size_t worker = 0)
     : socket_(std::move(socket)),
       server_(server),
-      strand_(socket_.get_executor()),
+      strand_(socket_.get_executor().context()),
+      worker_(worker),
       closed_(false)
     {}
 
     void start();
     void deliver_json(const json& j);
-    std::string username() const {
-        std::lock_guard<std::mutex> lk(mutex_);
-        return username_;
-    }
+    void deliver_message(const Protocol::SharedMessage& message);
+    void deliver(Protocol::SharedFrame frame);
+    // Queues an already accounted frame on the strand; deliver() calls it directly on
+    // the session's own worker and through the worker's mailbox from anywhere else.
+    void enqueue(Protocol::SharedFrame frame);
+    UserId user_id() const { return user_id_; }
+    std::size_t worker() const { return worker_; }
+    Protocol::Framing framing() const { return framing_; }
     void close();
 
+    // A stalled session has crossed its high watermark; messages for it are spilled to
+    // the offline store until it drains below the low watermark and the backlog is replayed.
+    bool stalled() const { return stalled_; }
+    bool over_high_water() const;
+    void set_stalled(bool stalled);
+    void replay_started() { resume_scheduled_ = false; }
+    void chunk_put_done(std::size_t bytes) { pending_put_bytes_ -= bytes; }
+    void notify_channel_routed(ChannelId channel, std::size_t deferred);
+
 private:
     void do_read();
     void on_read(const boost::system::error_code& ec, std::size_t bytes_transferred);
+    bool process_input();
+    bool handle_fast_command(std::string_view text);
+    void handle_command_text(std::string_view text);
+    void handle_command(const json& j);
+    void send_direct(const std::string& to, std::string_view body);
+    void post_to_channel(const std::string& channel, std::string_view body);
+    void handle_frame(const Protocol::FrameHeader& header, std::string_view payload);
+    void notify_routed(UserId to, RouteResult result);
     void do_write();
     void on_write(const boost::system::error_code& ec, std::size_t bytes_transferred);
+    void handle_disconnect();
 
-    tcp::socket socket_;
+    SessionSocket socket_;
     Server& server_;
-    boost::asio::strand<boost::asio::any_io_executor> strand_;
-    boost::asio::streambuf read_buf_;
+    boost::asio::io_context::strand strand_;
+    std::size_t worker_;
+    CPCDMessenger::ReadBuffer in_{CPCDMessenger::ReadBuffer::kDefaultCapacity,
+                                  Protocol::kFrameHeaderSize + Protocol::kMaxFramePayload};
 
-    std::deque<std::string> write_msgs_;
-    mutable std::mutex mutex_;
-    std::string username_;
+    std::deque<Protocol::SharedFrame, CPCDMessenger::Memory::SlabAllocator<Protocol::SharedFrame>> write_msgs_;
+    std::vector<boost::asio::const_buffer> write_bufs_;
+    std::atomic<std::size_t> queued_bytes_{0};
+    std::atomic<std::size_t> queued_msgs_{0};
+    std::atomic<bool> stalled_{false};
+    std::atomic<bool> resume_scheduled_{false};
+    // ChunkPut payloads queued for the disk worker and not yet answered.
+    std::atomic<std::size_t> pending_put_bytes_{0};
+    UserId deferred_to_ = CPCDMessenger::kInvalidUser;
+    std::unordered_set<ChannelId> deferred_channels_;
+
+    std::atomic<UserId> user_id_{CPCDMessenger::kInvalidUser};
+    std::atomic<Protocol::Framing> framing_{Protocol::Framing::JsonLines};
     std::atomic<bool> writing_{false};
     std::atomic<bool> closed_;
 };
 
+struct ServerConfig {
+    std::string data_dir = "relay-data";
+    // Upper bound for one gathered async_write; a single larger frame still goes alone.
+    std::size_t max_write_batch_bytes = 64 * 1024;
+    // Per-session write queue watermarks.
+    std::size_t high_water_bytes = 8 * 1024 * 1024;
+    std::size_t low_water_bytes = 2 * 1024 * 1024;
+    std::size_t high_water_messages = 16384;
+    std::size_t low_water_messages = 4096;
+    // Loopback port for the HTTP /metrics listener, 0 disables it.
+    unsigned short metrics_port = 0;
+    // Attachment chunks: size of the store, bytes of new chunks one user may store per
+    // day, how long an unused chunk is kept, and unanswered upload bytes per session.
+    std::uint64_t chunk_store_bytes = 64ull << 30;
+    std::uint64_t chunk_user_bytes_per_day = 4ull << 30;
+    std::chrono::seconds chunk_ttl = std::chrono::hours(24 * 30);
+    std::size_t max_pending_chunk_bytes = 8 * 1024 * 1024;
+};
+
+enum class IoModel { Shared, PerCore };
+
+// Shared model: one io_context run by every thread, sessions hop between threads on
+// their strands. Per-core model: one single-threaded io_context per pinned thread, each
+// with its own SO_REUSEPORT acceptor, so a session lives on one core for its lifetime.
+// Frames for a session owned by another worker go through that worker's mailbox.
 class Server {
 public:
-    Server(boost::asio::io_context& ioc, unsigned short port)
-    : acceptor_(ioc, tcp::endpoint(tcp::v4(), port)),
-      ioc_(ioc)
+    Server(boost::asio::io_context& ioc, unsigned short port, const ServerConfig& config = {})
+    : Server(std::vector<boost::asio::io_context*>{&ioc}, port, config)
+    {}
+
+    Server(const std::vector<boost::asio::io_context*>& workers, unsigned short port, const ServerConfig& config = {})
+    : config_(config),
+      offline_(std::filesystem::path(config.data_dir) / "offline", users_),
+      keys_(std::filesystem::path(config.data_dir) / "keys"),
+      chunks_(std::filesystem::path(config.data_dir) / "chunks",
+              CPCDMessenger::ChunkStore::Limits{config.chunk_store_bytes, config.chunk_ttl})
     {
-        do_accept();
+        users_.open_journal(std::filesystem::path(config.data_dir) / "users.journal");
+        for (auto* ioc : workers) workers_.push_back(std::make_unique<Worker>(*ioc));
+        open_acceptors(port);
+        if (config.metrics_port != 0) {
+            metrics_endpoint_ = std::make_unique<CPCDMessenger::MetricsEndpoint>(
+                workers_.front()->ioc, tcp::endpoint(boost::asio::ip::address_v4::loopback(), config.metrics_port), metrics_);
+        }
+        expiry_timer_ = std::make_unique<boost::asio::steady_timer>(workers_.front()->ioc);
+        boost::asio::post(disk_pool_, [this] { expire_chunks(); });
+        schedule_chunk_expiry();
     }
 
-    void register_username(const std::string& user, std::shared_ptr<ClientSession> session) {
-        std::lock_guard<std::mutex> lk(clients_mutex_);
-        clients_[user] = session;
+    const ServerConfig& config() const { return config_; }
+    CPCDMessenger::RelayMetrics& metrics() { return metrics_; }
+    CPCDMessenger::UserDirectory& users() { return users_; }
+    CPCDMessenger::ChannelDirectory& channel_names() { return channel_names_; }
+    unsigned short port() const { return workers_.front()->acceptor.local_endpoint().port(); }
+    std::size_t worker_count() const { return workers_.size(); }
 
-        auto it = offline_messages_.find(user);
-        if (it != offline_messages_.end()) {
-            for (auto &m : it->second) {
-                session->deliver_json(json::parse(m));
-            }
-            offline_messages_.erase(it);
+    // Queues the messages of an NDJSON archive for their recipients, see
+    // Storage/ArchiveImport.h. Safe while serving; recipients online at the time get
+    // them on their next login.
+    CPCDMessenger::ImportResult import_archive(const std::string& path, std::size_t threads) {
+        return CPCDMessenger::import_archive(path, offline_, users_, threads);
+    }
+
+    // Runs one worker's io_context on the calling thread. In the per-core model the
+    // thread is pinned to a core and marked as the worker's owner.
+    void run_worker(std::size_t index) {
+        if (workers_.size() > 1) {
+            current_server_ = this;
+            current_worker_ = index;
+            pin_current_thread(index);
         }
+        workers_[index]->ioc.run();
     }
 
-    void unregister_username(const std::string& user) {
-        std::lock_guard<std::mutex> lk(clients_mutex_);
-        auto it = clients_.find(user);
-        if (it != clients_.end()) {
-            clients_.erase(it);
+    bool on_worker(std::size_t index) const {
+        return workers_.size() == 1 || (current_server_ == this && current_worker_ == index);
+    }
+
+    void post_to_worker(std::size_t index, std::shared_ptr<ClientSession> session, Protocol::SharedFrame frame) {
+        auto& worker = *workers_[index];
+        if (worker.mailbox.push(Delivery{std::move(session), std::move(frame)})) {
+            boost::asio::post(worker.ioc, CPCDMessenger::Memory::pooled([&worker] {
+                worker.mailbox.drain([](Delivery&& d) { d.session->enqueue(std::move(d.frame)); });
+            }));
         }
     }
 
-    void route_message(const std::string& to, const json& message) {
-        std::shared_ptr<ClientSession> dest;
-        {
-            std::lock_guard<std::mutex> lk(clients_mutex_);
-            auto it = clients_.find(to);
-            if (it != clients_.end()) dest = it->second.lock();
+    // Usernames only exist at the protocol boundary; from here on sessions,
+    // the registry and the offline queues are all indexed by UserId.
+    void register_user(UserId user, std::shared_ptr<ClientSession> session) {
+        auto* entry = new SessionSlot::Entry{std::move(session)};
+        CPCDMessenger::EpochReclaimer::instance().retire(
+            sessions_.ensure(user).entry.exchange(entry, std::memory_order_acq_rel));
+        schedule_replay(user);
+    }
+
+    // Only clears the slot if it still belongs to this session, a newer login
+    // under the same name keeps its registration.
+    void unregister_user(UserId user, const ClientSession* session) {
+        auto* slot = sessions_.get(user);
+        if (!slot) return;
+        CPCDMessenger::EpochReclaimer::Guard guard;
+        SessionSlot::Entry* current = slot->entry.load(std::memory_order_acquire);
+        if (!current) return;
+        auto locked = current->session.lock();
+        if (locked && locked.get() != session) return;
+        if (slot->entry.compare_exchange_strong(current, nullptr, std::memory_order_acq_rel)) {
+            CPCDMessenger::EpochReclaimer::instance().retire(current);
         }
+    }
+
+    std::shared_ptr<ClientSession> find_session(UserId user) const {
+        auto* slot = sessions_.get(user);
+        if (!slot) return nullptr;
+        CPCDMessenger::EpochReclaimer::Guard guard;
+        const SessionSlot::Entry* entry = slot->entry.load(std::memory_order_acquire);
+        return entry ? entry->session.lock() : nullptr;
+    }
 
+    Protocol::SharedMessage make_message(UserId from, std::string_view body, ChannelId channel = Protocol::kNoPeer,
+                                         Protocol::FrameType type = Protocol::FrameType::Msg) const {
+        const std::string* from_name = users_.name(from);
+        const std::string* channel_name = channel_names_.name(channel);
+        return Protocol::make_routed_message(
+            from, from_name ? std::string_view(*from_name) : std::string_view(), body,
+            channel, channel_name ? std::string_view(*channel_name) : std::string_view(), type);
+    }
+
+    RouteResult route_message(UserId to, const Protocol::SharedMessage& message) {
+        auto dest = find_session(to);
+        if (dest && !dest->stalled()) {
+            dest->deliver_message(message);
+            metrics_.add(CPCDMessenger::Counter::MessagesRouted);
+            return RouteResult::Delivered;
+        }
+        offline_.append(to, message->from(), message->type(), message->body());
+        metrics_.add(CPCDMessenger::Counter::MessagesStored);
         if (dest) {
-            dest->deliver_json(message);
-        } else {
-            std::lock_guard<std::mutex> lk(offline_mutex_);
-            offline_messages_[to].push_back(message.dump());
+            metrics_.add(CPCDMessenger::Counter::MessagesDeferred);
+            return RouteResult::Deferred;
         }
+        // The recipient may have logged in after the lookup, and its replay may already
+        // have read the index; one more pass picks this record up.
+        if (find_session(to)) schedule_replay(to);
+        return RouteResult::Stored;
+    }
+
+    // Binary fast path: the payload is never parsed, a binary recipient gets it back
+    // behind a header naming the sender instead of the recipient. KeyExchange, Cipher and
+    // Attachment frames take the same path and keep their type, the relay cannot read
+    // them anyway.
+    RouteResult route_frame(UserId to, UserId from, std::string_view payload,
+                            Protocol::FrameType type = Protocol::FrameType::Msg) {
+        if (!users_.name(to)) return RouteResult::UnknownRecipient;
+        return route_message(to, make_message(from, payload, Protocol::kNoPeer, type));
+    }
+
+    // File transfer frames are forwarded to an online, binary recipient that is not
+    // stalled, or not at all: they are never spilled to the offline store. A client runs
+    // one transfer per recipient, so one sender's window stays under the high watermark;
+    // if several senders together stall the recipient, their frames are refused here
+    // and each transfer is resumed later from the receiver's partial file.
+    bool route_transfer(UserId to, UserId from, std::string_view payload, Protocol::FrameType type) {
+        auto dest = find_session(to);
+        if (!dest || dest->stalled() || dest->framing() != Protocol::Framing::Binary) return false;
+        dest->deliver_message(make_message(from, payload, Protocol::kNoPeer, type));
+        metrics_.add(CPCDMessenger::Counter::MessagesRouted);
+        return true;
+    }
+
+    // The key is served from memory at once; the copy on disk is written off the io threads.
+    void publish_key(UserId user, std::string pem) {
+        keys_.publish(user, std::move(pem));
+        boost::asio::post(disk_pool_, [this, user] {
+            if (!keys_.save(user)) std::cerr << "Failed to save public key of user " << user << "\n";
+        });
+    }
+
+    std::shared_ptr<const std::string> find_key(UserId user) const { return keys_.find(user); }
+
+    // Attachment chunks. Queries are answered from the store's in-memory index; chunk
+    // writes and reads go through the disk worker like replays, and the worker answers
+    // the session. Answers go back in request order. A chunk a query finds counts as
+    // used, so re-sending an attachment keeps its chunks from expiring.
+    std::string missing_chunks(std::string_view ids) {
+        std::string missing;
+        for (std::size_t i = 0; i + CPCDMessenger::Attachment::kIdSize <= ids.size(); i += CPCDMessenger::Attachment::kIdSize) {
+            if (!chunks_.touch(CPCDMessenger::Attachment::id_at(ids.data() + i))) {
+                missing.append(ids.substr(i, CPCDMessenger::Attachment::kIdSize));
+            }
+        }
+        return missing;
+    }
+
+    // The session has counted the payload against its pending puts; the answer is sent
+    // and the count released once the disk worker is done with it.
+    void store_chunk(std::shared_ptr<ClientSession> session, std::string payload) {
+        boost::asio::post(disk_pool_, [this, session = std::move(session), payload = std::move(payload)] {
+            auto id = CPCDMessenger::Attachment::id_at(payload.data());
+            std::string_view data = std::string_view(payload).substr(CPCDMessenger::Attachment::kIdSize);
+            bool stored = false;
+            if (charge_chunk_upload(session->user_id(), data.size())) {
+                auto result = chunks_.put(id, data);
+                stored = result == CPCDMessenger::ChunkStore::PutResult::Stored ||
+                         result == CPCDMessenger::ChunkStore::PutResult::Present;
+                // Only new chunks count against the uploader's quota.
+                if (result != CPCDMessenger::ChunkStore::PutResult::Stored) {
+                    refund_chunk_upload(session->user_id(), data.size());
+                }
+            }
+            session->chunk_put_done(payload.size());
+            session->deliver(make_chunk_put_answer(id, stored));
+        });
+    }
+
+    static Protocol::SharedFrame make_chunk_put_answer(const CPCDMessenger::ChunkId& id, bool stored) {
+        std::string answer(CPCDMessenger::Attachment::id_view(id));
+        answer.push_back(stored ? 1 : 0);
+        return Protocol::make_shared_frame(Protocol::make_frame(Protocol::FrameType::ChunkPut, Protocol::kNoPeer, answer));
+    }
+
+    void fetch_chunk(std::shared_ptr<ClientSession> session, CPCDMessenger::ChunkId id) {
+        boost::asio::post(disk_pool_, [this, session = std::move(session), id] {
+            Protocol::FrameBytes frame;
+            auto data = chunks_.get(id);
+            std::size_t length = CPCDMessenger::Attachment::kIdSize + (data ? data->size() : 0);
+            frame.reserve(Protocol::kFrameHeaderSize + length);
+            Protocol::append_frame_header(frame, Protocol::FrameType::ChunkGet, Protocol::kNoPeer, length);
+            frame.append(CPCDMessenger::Attachment::id_view(id));
+            if (data) frame.append(*data);
+            session->deliver(Protocol::make_shared_frame(std::move(frame)));
+        });
+    }
+
+    bool join_channel(ChannelId channel, UserId user) {
+        return channels_.ensure(channel).join(user);
+    }
+
+    bool leave_channel(ChannelId channel, UserId user) {
+        auto* ch = channels_.get(channel);
+        return ch && ch->leave(user);
+    }
+
+    // Fan-out never runs on the sender's strand: the member snapshot is cut into
+    // slices and the slices are dealt out across the workers, so a post to a large
+    // channel is delivered by all io threads in parallel. Only online members receive
+    // posts. A stalled member's copy is spilled to the offline store like a deferred
+    // direct message and replayed in order once it drains; the record is a ChannelPost
+    // whose body starts with the u32 channel id. When the last slice is done the poster
+    // is told whether any member was deferred.
+    bool post_channel(const Protocol::SharedMessage& message) {
+        auto* ch = channels_.get(message->channel());
+        auto members = ch ? ch->members() : nullptr;
+        if (!members || !CPCDMessenger::Channel::contains(*members, message->from())) return false;
+        metrics_.add(CPCDMessenger::Counter::ChannelPosts);
+
+        auto slices = std::make_shared<std::atomic<std::size_t>>((members->size() + kFanoutSlice - 1) / kFanoutSlice);
+        auto deferred = std::make_shared<std::atomic<std::size_t>>(0);
+        for (std::size_t begin = 0; begin < members->size(); begin += kFanoutSlice) {
+            std::size_t end = std::min(begin + kFanoutSlice, members->size());
+            boost::asio::post(workers_[next_worker()]->ioc, [this, members, message, begin, end, slices, deferred] {
+                std::uint64_t delivered = 0, spilled = 0;
+                std::string stored;
+                for (std::size_t i = begin; i < end; ++i) {
+                    UserId member = (*members)[i];
+                    if (member == message->from()) continue;
+                    auto dest = find_session(member);
+                    if (!dest) continue;
+                    if (dest->stalled()) {
+                        if (stored.empty()) {
+                            stored.resize(4);
+                            Protocol::put_u32(stored.data(), message->channel());
+                            stored += message->body();
+                        }
+                        offline_.append(member, message->from(), Protocol::FrameType::ChannelPost, stored);
+                        ++spilled;
+                    } else {
+                        dest->deliver_message(message);
+                        ++delivered;
+                    }
+                }
+                metrics_.add(CPCDMessenger::Counter::MessagesRouted, delivered);
+                if (spilled) {
+                    metrics_.add(CPCDMessenger::Counter::MessagesStored, spilled);
+                    metrics_.add(CPCDMessenger::Counter::ChannelPostsDeferred, spilled);
+                    deferred->fetch_add(spilled, std::memory_order_relaxed);
+                }
+                if (slices->fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+                if (auto poster = find_session(message->from())) {
+                    poster->notify_channel_routed(message->channel(), deferred->load(std::memory_order_relaxed));
+                }
+            });
+        }
+        return true;
+    }
+
+    // Offline records keep their frame type; a ChannelPost carries its channel id in
+    // front of the body, see post_channel.
+    Protocol::SharedMessage make_stored_message(const CPCDMessenger::OfflineStore::StoredMessage& m) const {
+        if (m.type == Protocol::FrameType::ChannelPost && m.body.size() >= 4) {
+            return make_message(m.from, std::string_view(m.body).substr(4), Protocol::get_u32(m.body.data()));
+        }
+        return make_message(m.from, m.body, Protocol::kNoPeer, m.type);
+    }
+
+    // Disk reads stay off the io threads; the single worker also keeps replays of one
+    // user from overlapping. Replay stops at the session's high watermark and leaves it
+    // stalled, the drain below the low watermark schedules the next pass. A pass the
+    // store could not finish also leaves the session stalled, so new messages queue
+    // behind the backlog, and is tried again after kReplayRetry.
+    void schedule_replay(UserId user) {
+        boost::asio::post(disk_pool_, [this, user] {
+            auto session = find_session(user);
+            if (!session) return;
+            session->replay_started();
+            auto replay = [&] {
+                bool stopped = false;
+                auto result = offline_.replay(user, [&](CPCDMessenger::OfflineStore::StoredMessage&& m) {
+                    if (session->over_high_water()) {
+                        stopped = true;
+                        return false;
+                    }
+                    session->deliver_message(make_stored_message(m));
+                    return true;
+                });
+                if (!result.complete && !stopped) retry_replay(user);
+                return result.complete;
+            };
+            if (!replay()) {
+                session->set_stalled(true);
+                return;
+            }
+            if (session->stalled()) {
+                session->set_stalled(false);
+                // Messages spilled between the last pass and the flag flip.
+                if (!replay()) session->set_stalled(true);
+            }
+        });
     }
 
 private:
-    void do_accept() {
-        acceptor_.async_accept([this](boost::system::error_code ec, tcp::socket socket) {
-            if (!ec) {
-                auto session = std::make_shared<ClientSession>(std::move(socket), *this);
-                session->start();
-            } else {
-                std::cerr << "Accept error: " << ec.message() << "\n";
+    static constexpr std::size_t kFanoutSlice = 256;
+    static constexpr auto kReplayRetry = std::chrono::seconds(5);
+
+    struct Delivery {
+        std::shared_ptr<ClientSession> session;
+        Protocol::SharedFrame frame;
+    };
+
+    struct Worker {
+        explicit Worker(boost::asio::io_context& ctx) : ioc(ctx), acceptor(ctx) {}
+
+        boost::asio::io_context& ioc;
+        tcp::acceptor acceptor;
+        CPCDMessenger::Mailbox<Delivery> mailbox;
+    };
+
+    // With SO_REUSEPORT every worker listens on the same port and the kernel spreads
+    // connections; without it the first acceptor deals sockets out round-robin.
+    void open_acceptors(unsigned short port) {
+#ifdef SO_REUSEPORT
+        bool reuse_port = workers_.size() > 1;
+#else
+        bool reuse_port = false;
+#endif
+        std::size_t listeners = reuse_port ? workers_.size() : 1;
+        for (std::size_t i = 0; i < listeners; ++i) {
+            auto& acceptor = workers_[i]->acceptor;
+            tcp::endpoint endpoint(tcp::v4(), port);
+            acceptor.open(endpoint.protocol());
+            acceptor.set_option(tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+            if (reuse_port) {
+                acceptor.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
             }
-            do_accept();
+#endif
+            acceptor.bind(endpoint);
+            acceptor.listen();
+            // Port 0 picks an ephemeral port once; the other listeners join it.
+            port = acceptor.local_endpoint().port();
+        }
+        for (std::size_t i = 0; i < listeners; ++i) do_accept(i, reuse_port);
+    }
+
+    void do_accept(std::size_t index, bool reuse_port) {
+        std::size_t target = reuse_port ? index : next_worker();
+        auto socket = std::make_shared<SessionSocket>(workers_[target]->ioc.get_executor());
+        workers_[index]->acceptor.async_accept(*socket,
+            [this, index, target, reuse_port, socket](boost::system::error_code ec) {
+                if (!ec) {
+                    metrics_.add(CPCDMessenger::Counter::SessionsAccepted);
+                    metrics_.adjust(CPCDMessenger::Gauge::OpenSessions, 1);
+                    auto session = std::make_shared<ClientSession>(std::move(*socket), *this, target);
+                    session->start();
+                } else {
+                    std::cerr << "Accept error: " << ec.message() << "\n";
+                }
+                do_accept(index, reuse_port);
+            });
+    }
+
+    std::size_t next_worker() {
+        return next_worker_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+    }
+
+    // Per-user daily upload quota; only the disk worker touches it.
+    bool charge_chunk_upload(UserId user, std::size_t bytes) {
+        auto now = std::chrono::steady_clock::now();
+        if (now - chunk_day_started_ >= std::chrono::hours(24)) {
+            chunk_uploads_.clear();
+            chunk_day_started_ = now;
+        }
+        auto& used = chunk_uploads_[user];
+        if (used + bytes > config_.chunk_user_bytes_per_day) return false;
+        used += bytes;
+        return true;
+    }
+
+    void refund_chunk_upload(UserId user, std::size_t bytes) {
+        auto it = chunk_uploads_.find(user);
+        if (it != chunk_uploads_.end()) it->second -= std::min<std::uint64_t>(it->second, bytes);
+    }
+
+    void expire_chunks() {
+        std::size_t removed = chunks_.expire();
+        if (removed != 0) std::cout << "Expired " << removed << " unused attachment chunks\n";
+    }
+
+    void retry_replay(UserId user) {
+        auto timer = std::make_shared<boost::asio::steady_timer>(workers_.front()->ioc, kReplayRetry);
+        timer->async_wait([this, timer, user](const boost::system::error_code& ec) {
+            if (!ec) schedule_replay(user);
+        });
+    }
+
+    void schedule_chunk_expiry() {
+        expiry_timer_->expires_after(std::chrono::hours(1));
+        expiry_timer_->async_wait([this](const boost::system::error_code& ec) {
+            if (ec) return;
+            boost::asio::post(disk_pool_, [this] { expire_chunks(); });
+            schedule_chunk_expiry();
         });
     }
 
-    tcp::acceptor acceptor_;
-    boost::asio::io_context& ioc_;
+    static void pin_current_thread(std::size_t index) {
+#ifdef __linux__
+        unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(index % cores, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+        (void)index;
+#endif
+    }
+
+    static inline thread_local const Server* current_server_ = nullptr;
+    static inline thread_local std::size_t current_worker_ = 0;
 
-    std::unordered_map<std::string, std::weak_ptr<ClientSession>> clients_;
-    std::mutex clients_mutex_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::atomic<std::size_t> next_worker_{0};
+    ServerConfig config_;
+    CPCDMessenger::RelayMetrics metrics_;
+    std::unique_ptr<CPCDMessenger::MetricsEndpoint> metrics_endpoint_;
 
-    std::unordered_map<std::string, std::vector<std::string>> offline_messages_;
-    std::mutex offline_mutex_;
+    CPCDMessenger::UserDirectory users_;
+    // A login publishes a fresh entry rather than storing into a shared weak_ptr, so a
+    // lookup is a guard, a pointer load and lock(); replaced entries go to the reclaimer.
+    struct SessionSlot {
+        struct Entry {
+            std::weak_ptr<ClientSession> session;
+        };
+
+        ~SessionSlot() { delete entry.load(std::memory_order_relaxed); }
+
+        std::atomic<Entry*> entry{nullptr};
+    };
+
+    CPCDMessenger::StableArray<SessionSlot> sessions_;
+    CPCDMessenger::OfflineStore offline_;
+    CPCDMessenger::KeyDirectory keys_;
+    CPCDMessenger::ChunkStore chunks_;
+    std::unordered_map<UserId, std::uint64_t> chunk_uploads_;
+    std::chrono::steady_clock::time_point chunk_day_started_ = std::chrono::steady_clock::now();
+    std::unique_ptr<boost::asio::steady_timer> expiry_timer_;
+
+    CPCDMessenger::ChannelDirectory channel_names_;
+    CPCDMessenger::StableArray<CPCDMessenger::Channel> channels_;
+
+    boost::asio::thread_pool disk_pool_{1};
 };
 
 void ClientSession::start() {
+    // Writes are already batched per session; Nagle would hold the second of two
+    // back-to-back writes until the peer's delayed ACK.
+    boost::system::error_code ec;
+    socket_.set_option(tcp::no_delay(true), ec);
     do_read();
 }
 
+// One read_some fills the buffer with whatever the socket has, and every complete
+// frame in it is handled in place before the next read is started.
 void ClientSession::do_read() {
+    auto space = in_.prepare();
     auto self = shared_from_this();
-    boost::asio::async_read_until(socket_, read_buf_, '\n',
-        boost::asio::bind_executor(strand_,
+    socket_.async_read_some(boost::asio::buffer(space.data(), space.size()),
+        boost::asio::bind_executor(strand_, CPCDMessenger::Memory::pooled(
             [this, self](const boost::system::error_code& ec, std::size_t bytes_transferred) {
                 on_read(ec, bytes_transferred);
             }
-        ));
+        )));
 }
 
 void ClientSession::on_read(const boost::system::error_code& ec, std::size_t bytes_transferred) {
     if (ec) {
-        std::string usr;
-        {
-            std::lock_guard<std::mutex> lk(mutex_);
-            usr = username_;
-        }
-        if (!usr.empty()) server_.unregister_username(usr);
-        close();
+        handle_disconnect();
         return;
     }
+    in_.commit(bytes_transferred);
+    server_.metrics().add(CPCDMessenger::Counter::BytesIn, bytes_transferred);
+    if (process_input()) do_read();
+}
 
-    std::istream is(&read_buf_);
-    std::string line;
-    std::getline(is, line);
-    if (!line.empty() && line.back() == '\r') line.pop_back();
+// Framing is checked per frame: a hello line switches to binary and the bytes behind
+// it in the same read are already taken as binary frames. Returns false once the
+// session has been dropped.
+bool ClientSession::process_input() {
+    while (!closed_) {
+        if (framing_ == Protocol::Framing::Binary) {
+            if (in_.size() < Protocol::kFrameHeaderSize) return true;
+            auto header = Protocol::FrameHeader::decode(in_.data());
+            if (header.length > Protocol::kMaxFramePayload) {
+                server_.metrics().add(CPCDMessenger::Counter::ParseErrors);
+                json resp = { {"type","error"}, {"message","frame too large"} };
+                deliver_json(resp);
+                handle_disconnect();
+                return false;
+            }
+            std::size_t frame_size = Protocol::kFrameHeaderSize + header.length;
+            if (in_.size() < frame_size) return true;
+            handle_frame(header, std::string_view(in_.data() + Protocol::kFrameHeaderSize, header.length));
+            in_.consume(frame_size);
+            continue;
+        }
+        auto line = in_.next_line();
+        if (!line) {
+            if (!in_.prepare().empty()) return true;
+            server_.metrics().add(CPCDMessenger::Counter::ParseErrors);
+            json resp = { {"type","error"}, {"message","line too long"} };
+            deliver_json(resp);
+            handle_disconnect();
+            return false;
+        }
+        if (!line->empty() && line->back() == '\r') line->remove_suffix(1);
+        handle_command_text(*line);
+    }
+    return !closed_;
+}
 
-    try {
-        auto j = json::parse(line);
-        if (j.contains("cmd")) {
-            std::string cmd = j["cmd"].get<std::string>();
-            if (cmd == "login" && j.contains("user")) {
-                std::string user = j["user"].get<std::string>();
-                {
-                    std::lock_guard<std::mutex> lk(mutex_);
-                    username_ = user;
-                }
-                server_.register_username(user, shared_from_this());
-                json resp = { {"type","login_ok"}, {"user", user} };
+void ClientSession::handle_frame(const Protocol::FrameHeader& header, std::string_view payload) {
+    switch (header.type) {
+        case Protocol::FrameType::Json:
+            handle_command_text(payload);
+            break;
+        case Protocol::FrameType::Msg:
+        case Protocol::FrameType::KeyExchange:
+        case Protocol::FrameType::Cipher:
+        case Protocol::FrameType::Attachment: {
+            UserId from = user_id_;
+            if (from == CPCDMessenger::kInvalidUser) {
+                json resp = { {"type","error"}, {"message","login required"} };
+                deliver_json(resp);
+                break;
+            }
+            RouteResult result = server_.route_frame(header.peer, from, payload, header.type);
+            if (result == RouteResult::UnknownRecipient) {
+                json resp = { {"type","error"}, {"message","unknown recipient id"} };
+                deliver_json(resp);
+            } else {
+                notify_routed(header.peer, result);
+            }
+            break;
+        }
+        case Protocol::FrameType::FileOffer:
+        case Protocol::FrameType::FileChunk:
+        case Protocol::FrameType::FileAck: {
+            if (user_id_ == CPCDMessenger::kInvalidUser) {
+                json resp = { {"type","error"}, {"message","login required"} };
+                deliver_json(resp);
+                break;
+            }
+            if (!server_.route_transfer(header.peer, user_id_, payload, header.type)) {
+                json resp = { {"type","transfer_failed"}, {"id", header.peer},
+                              {"transfer", CPCDMessenger::Transfer::transfer_id(payload)} };
+                deliver_json(resp);
+            }
+            break;
+        }
+        case Protocol::FrameType::ChunkQuery:
+        case Protocol::FrameType::ChunkPut:
+        case Protocol::FrameType::ChunkGet: {
+            namespace Attachment = CPCDMessenger::Attachment;
+            if (user_id_ == CPCDMessenger::kInvalidUser) {
+                json resp = { {"type","error"}, {"message","login required"} };
                 deliver_json(resp);
-            } else if (cmd == "msg") {
-                if (j.contains("to") && j.contains("body")) {
-                    std::string to = j["to"].get<std::string>();
-                    std::string body = j["body"].get<std::string>();
-                    std::string from = username();
-                    json out = { {"type","msg"}, {"from", from}, {"body", body} };
-                    server_.route_message(to, out);
+                break;
+            }
+            bool valid = header.type == Protocol::FrameType::ChunkQuery
+                             ? payload.size() % Attachment::kIdSize == 0 && payload.size() <= Attachment::kQueryBatch * Attachment::kIdSize
+                       : header.type == Protocol::FrameType::ChunkPut
+                             ? payload.size() > Attachment::kIdSize && payload.size() <= Attachment::kIdSize + CPCDMessenger::ChunkStore::kMaxChunkBytes
+                             : payload.size() == Attachment::kIdSize;
+            if (!valid) {
+                json resp = { {"type","error"}, {"message","malformed chunk frame"} };
+                deliver_json(resp);
+            } else if (header.type == Protocol::FrameType::ChunkQuery) {
+                deliver(Protocol::make_shared_frame(Protocol::make_frame(
+                    Protocol::FrameType::ChunkQuery, Protocol::kNoPeer, server_.missing_chunks(payload))));
+            } else if (header.type == Protocol::FrameType::ChunkPut) {
+                // A client keeps at most Attachment::kWindowBytes unanswered; past the
+                // limit a put is refused here instead of queued for the disk worker.
+                if (pending_put_bytes_ + payload.size() > server_.config().max_pending_chunk_bytes) {
+                    deliver(Server::make_chunk_put_answer(Attachment::id_at(payload.data()), false));
                 } else {
-                    json resp = { {"type","error"}, {"message","invalid msg format"} };
-                    deliver_json(resp);
+                    pending_put_bytes_ += payload.size();
+                    server_.store_chunk(shared_from_this(), std::string(payload));
                 }
             } else {
-                json resp = { {"type","error"}, {"message","unknown cmd"} };
+                server_.fetch_chunk(shared_from_this(), Attachment::id_at(payload.data()));
+            }
+            break;
+        }
+        case Protocol::FrameType::ChannelPost: {
+            bool known = header.peer < server_.channel_names().size();
+            if (!known || !server_.post_channel(server_.make_message(user_id_, payload, header.peer))) {
+                json resp = { {"type","error"}, {"message","not a channel member"} };
                 deliver_json(resp);
             }
-        } else {
-            json resp = { {"type","error"}, {"message","no cmd field"} };
+            break;
+        }
+        default: {
+            server_.metrics().add(CPCDMessenger::Counter::ParseErrors);
+            json resp = { {"type","error"}, {"message","unknown frame type"} };
             deliver_json(resp);
         }
+    }
+}
+
+// msg and post are scanned for their string fields without building a DOM; the body
+// is copied once into the routed message, whose JSON encoding splices it back in.
+// Everything else, and anything the scanner is unsure about, takes the full parser.
+bool ClientSession::handle_fast_command(std::string_view text) {
+    auto scanned = Protocol::scan_command(text);
+    if (!scanned || !scanned->cmd || !scanned->body) return false;
+    if (*scanned->cmd == "msg" && scanned->to) {
+        send_direct(std::string(*scanned->to), *scanned->body);
+        return true;
+    }
+    if (*scanned->cmd == "post" && scanned->channel) {
+        post_to_channel(std::string(*scanned->channel), *scanned->body);
+        return true;
+    }
+    return false;
+}
+
+void ClientSession::handle_command_text(std::string_view text) {
+    if (handle_fast_command(text)) return;
+    try {
+        handle_command(json::parse(text));
     } catch (std::exception& ex) {
+        server_.metrics().add(CPCDMessenger::Counter::ParseErrors);
         json resp = { {"type","error"}, {"message", std::string("json parse error: ") + ex.what()} };
         deliver_json(resp);
     }
+}
 
-    do_read();
+// Only a login or the archive import creates a user; a message to a name that never
+// logged in is refused rather than queued for it.
+void ClientSession::send_direct(const std::string& to, std::string_view body) {
+    auto id = server_.users().find(to);
+    if (!id) {
+        json resp = { {"type","unknown_user"}, {"user", to} };
+        deliver_json(resp);
+        return;
+    }
+    notify_routed(*id, server_.route_message(*id, server_.make_message(user_id_, body)));
+}
+
+void ClientSession::post_to_channel(const std::string& channel, std::string_view body) {
+    auto id = server_.channel_names().find(channel);
+    if (!id || !server_.post_channel(server_.make_message(user_id_, body, *id))) {
+        json resp = { {"type","error"}, {"message","not a channel member"} };
+        deliver_json(resp);
+    }
+}
+
+void ClientSession::handle_command(const json& j) {
+    if (j.contains("cmd")) {
+        std::string cmd = j["cmd"].get<std::string>();
+        if (cmd == "login" && j.contains("user")) {
+            std::string user = j["user"].get<std::string>();
+            UserId previous = user_id_.exchange(server_.users().intern(user));
+            if (previous != CPCDMessenger::kInvalidUser && previous != user_id_) {
+                server_.unregister_user(previous, this);
+            }
+            server_.register_user(user_id_, shared_from_this());
+            server_.metrics().add(CPCDMessenger::Counter::Logins);
+            json resp = { {"type","login_ok"}, {"user", user}, {"id", user_id_.load()} };
+            deliver_json(resp);
+        } else if (cmd == "msg") {
+            if (j.contains("to") && j.contains("body")) {
+                send_direct(j["to"].get<std::string>(), j["body"].get<std::string>());
+            } else {
+                json resp = { {"type","error"}, {"message","invalid msg format"} };
+                deliver_json(resp);
+            }
+        } else if ((cmd == "join" || cmd == "leave") && j.contains("channel")) {
+            if (user_id_ == CPCDMessenger::kInvalidUser) {
+                json resp = { {"type","error"}, {"message","login required"} };
+                deliver_json(resp);
+                return;
+            }
+            std::string channel = j["channel"].get<std::string>();
+            if (cmd == "join") {
+                ChannelId id = server_.channel_names().intern(channel);
+                server_.join_channel(id, user_id_);
+                json resp = { {"type","joined"}, {"channel", channel}, {"id", id} };
+                deliver_json(resp);
+            } else {
+                // Only a join names a channel; leaving one that was never joined is a no-op.
+                if (auto id = server_.channel_names().find(channel)) server_.leave_channel(*id, user_id_);
+                json resp = { {"type","left"}, {"channel", channel} };
+                deliver_json(resp);
+            }
+        } else if (cmd == "post" && j.contains("channel") && j.contains("body")) {
+            post_to_channel(j["channel"].get<std::string>(), j["body"].get<std::string>());
+        } else if (cmd == "stats") {
+            auto& m = server_.metrics();
+            json resp = { {"type","stats"},
+                          {"write_batches", m.total(CPCDMessenger::Counter::WriteBatches)},
+                          {"avg_write_batch", m.average_write_batch()},
+                          {"stalled_sessions", m.value(CPCDMessenger::Gauge::StalledSessions)},
+                          {"deferred_messages", m.total(CPCDMessenger::Counter::MessagesDeferred)} };
+            deliver_json(resp);
+        } else if (cmd == "publish_key" && j.contains("key")) {
+            if (user_id_ == CPCDMessenger::kInvalidUser) {
+                json resp = { {"type","error"}, {"message","login required"} };
+                deliver_json(resp);
+                return;
+            }
+            std::string key = j["key"].get<std::string>();
+            if (key.size() > CPCDMessenger::KeyDirectory::kMaxKeyBytes || key.rfind("-----BEGIN PUBLIC KEY-----", 0) != 0) {
+                json resp = { {"type","error"}, {"message","invalid public key"} };
+                deliver_json(resp);
+                return;
+            }
+            server_.publish_key(user_id_, std::move(key));
+            json resp = { {"type","key_published"} };
+            deliver_json(resp);
+        } else if (cmd == "get_key" && (j.contains("user") || j.contains("id"))) {
+            // By name when sending, by id to put a name on a key exchange from a stranger.
+            std::string user;
+            UserId id;
+            if (j.contains("user")) {
+                user = j["user"].get<std::string>();
+                auto found = server_.users().find(user);
+                if (!found) {
+                    json resp = { {"type","unknown_user"}, {"user", user} };
+                    deliver_json(resp);
+                    return;
+                }
+                id = *found;
+            } else {
+                id = j["id"].get<UserId>();
+                const std::string* name = server_.users().name(id);
+                if (!name) {
+                    json resp = { {"type","error"}, {"message","unknown user id"} };
+                    deliver_json(resp);
+                    return;
+                }
+                user = *name;
+            }
+            auto key = server_.find_key(id);
+            json resp = { {"type", key ? "key" : "no_key"}, {"user", user}, {"id", id} };
+            if (key) resp["key"] = *key;
+            deliver_json(resp);
+        } else if (cmd == "resolve" && j.contains("user")) {
+            std::string user = j["user"].get<std::string>();
+            auto id = server_.users().find(user);
+            json resp = id ? json{ {"type","resolved"}, {"user", user}, {"id", *id} }
+                           : json{ {"type","unknown_user"}, {"user", user} };
+            deliver_json(resp);
+        } else if (cmd == "hello") {
+            // The reply still goes out as a JSON line, the switch applies to what follows.
+            bool binary = j.value("framing", "") == "binary";
+            json resp = { {"type","hello_ok"}, {"framing", binary ? "binary" : "json"} };
+            deliver_json(resp);
+            if (binary) framing_ = Protocol::Framing::Binary;
+        } else {
+            json resp = { {"type","error"}, {"message","unknown cmd"} };
+            deliver_json(resp);
+        }
+    } else {
+        json resp = { {"type","error"}, {"message","no cmd field"} };
+        deliver_json(resp);
+    }
+}
+
+// Tells the sender once when its messages to `to` start being deferred; the notice
+// repeats only after a message to that recipient went through directly again.
+void ClientSession::notify_routed(UserId to, RouteResult result) {
+    if (result != RouteResult::Deferred) {
+        if (deferred_to_ == to) deferred_to_ = CPCDMessenger::kInvalidUser;
+        return;
+    }
+    if (deferred_to_ == to) return;
+    deferred_to_ = to;
+    const std::string* name = server_.users().name(to);
+    json resp = { {"type","deferred"}, {"to", name ? *name : ""}, {"id", to} };
+    deliver_json(resp);
+}
+
+// The same for a channel post, with the number of members it was deferred for. Called
+// from the fan-out workers, so the bookkeeping moves to the strand.
+void ClientSession::notify_channel_routed(ChannelId channel, std::size_t deferred) {
+    auto self = shared_from_this();
+    boost::asio::post(strand_, [this, self, channel, deferred] {
+        if (deferred == 0) {
+            deferred_channels_.erase(channel);
+            return;
+        }
+        if (!deferred_channels_.insert(channel).second) return;
+        const std::string* name = server_.channel_names().name(channel);
+        json resp = { {"type","deferred"}, {"channel", name ? *name : ""}, {"members", deferred} };
+        deliver_json(resp);
+    });
+}
+
+bool ClientSession::over_high_water() const {
+    const auto& config = server_.config();
+    return queued_bytes_ >= config.high_water_bytes || queued_msgs_ >= config.high_water_messages;
+}
+
+void ClientSession::set_stalled(bool stalled) {
+    if (stalled_.exchange(stalled) == stalled) return;
+    auto& metrics = server_.metrics();
+    metrics.adjust(CPCDMessenger::Gauge::StalledSessions, stalled ? 1 : -1);
+    if (stalled) metrics.add(CPCDMessenger::Counter::StallEvents);
 }
 
 void ClientSession::deliver_json(const json& j) {
-    std::string s = j.dump();
-    s.push_back('\n');
+    std::string s = j.dump(-1, ' ', false, json::error_handler_t::replace);
+    if (framing_ == Protocol::Framing::Binary) {
+        s = Protocol::make_frame(Protocol::FrameType::Json, Protocol::kNoPeer, s);
+    } else {
+        s.push_back('\n');
+    }
+    deliver(Protocol::make_shared_frame(std::move(s)));
+}
+
+void ClientSession::deliver_message(const Protocol::SharedMessage& message) {
+    deliver(message->encoded(framing_));
+}
+
+void ClientSession::deliver(Protocol::SharedFrame frame) {
+    queued_bytes_ += frame->size();
+    ++queued_msgs_;
+    if (!stalled_ && over_high_water()) set_stalled(true);
 
+    if (server_.on_worker(worker_)) {
+        enqueue(std::move(frame));
+    } else {
+        server_.post_to_worker(worker_, shared_from_this(), std::move(frame));
+    }
+}
+
+void ClientSession::enqueue(Protocol::SharedFrame frame) {
     auto self = shared_from_this();
-    boost::asio::post(strand_, [this, self, s = std::move(s)]() mutable {
+    boost::asio::post(strand_, CPCDMessenger::Memory::pooled([this, self, frame = std::move(frame)]() mutable {
         bool start_write = write_msgs_.empty();
-        write_msgs_.push_back(std::move(s));
+        write_msgs_.push_back(std::move(frame));
         if (start_write && !writing_) {
             do_write();
         }
-    });
+    }));
 }
 
 void ClientSession::do_write() {
@@ -215,28 +1027,48 @@ void ClientSession::do_write() {
         return;
     }
     writing_ = true;
+    server_.metrics().observe(CPCDMessenger::Histogram::WriteQueueDepth, write_msgs_.size());
+
+    // Everything queued goes out in one gathered write (writev), capped in bytes.
+    std::size_t batch_bytes = 0;
+    std::size_t limit = server_.config().max_write_batch_bytes;
+    write_bufs_.clear();
+    for (const auto& frame : write_msgs_) {
+        if (!write_bufs_.empty() && batch_bytes + frame->size() > limit) break;
+        write_bufs_.push_back(boost::asio::buffer(*frame));
+        batch_bytes += frame->size();
+    }
+    server_.metrics().record_write_batch(write_bufs_.size(), batch_bytes);
+
+    // The span keeps async_write from copying the buffer vector into its operation.
     auto self = shared_from_this();
     boost::asio::async_write(socket_,
-        boost::asio::buffer(write_msgs_.front().data(), write_msgs_.front().size()),
-        boost::asio::bind_executor(strand_,
+        std::span<const boost::asio::const_buffer>(write_bufs_),
+        boost::asio::bind_executor(strand_, CPCDMessenger::Memory::pooled(
             [this, self](const boost::system::error_code& ec, std::size_t bytes_transferred) {
                 on_write(ec, bytes_transferred);
             }
-        ));
+        )));
 }
 
 void ClientSession::on_write(const boost::system::error_code& ec, std::size_t /*bytes_transferred*/) {
     if (ec) {
-        std::string usr;
-        {
-            std::lock_guard<std::mutex> lk(mutex_);
-            usr = username_;
-        }
-        if (!usr.empty()) server_.unregister_username(usr);
-        close();
+        handle_disconnect();
         return;
     }
-    write_msgs_.pop_front();
+    std::size_t written_bytes = 0;
+    for (const auto& buf : write_bufs_) written_bytes += buf.size();
+    server_.metrics().add(CPCDMessenger::Counter::BytesOut, written_bytes);
+    queued_bytes_ -= written_bytes;
+    queued_msgs_ -= write_bufs_.size();
+    write_msgs_.erase(write_msgs_.begin(), write_msgs_.begin() + static_cast<std::ptrdiff_t>(write_bufs_.size()));
+
+    const auto& config = server_.config();
+    if (stalled_ && queued_bytes_ <= config.low_water_bytes && queued_msgs_ <= config.low_water_messages &&
+        !resume_scheduled_.exchange(true)) {
+        server_.schedule_replay(user_id_);
+    }
+
     if (!write_msgs_.empty()) {
         do_write();
     } else {
@@ -244,25 +1076,74 @@ void ClientSession::on_write(const boost::system::error_code& ec, std::size_t /*
     }
 }
 
+void ClientSession::handle_disconnect() {
+    set_stalled(false);
+    UserId user = user_id_;
+    if (user != CPCDMessenger::kInvalidUser) server_.unregister_user(user, this);
+    close();
+}
+
 void ClientSession::close() {
     if (closed_.exchange(true)) return;
+    server_.metrics().add(CPCDMessenger::Counter::SessionsClosed);
+    server_.metrics().adjust(CPCDMessenger::Gauge::OpenSessions, -1);
     boost::system::error_code ec;
     socket_.shutdown(tcp::socket::shutdown_both, ec);
     socket_.close(ec);
 }
 
+// Console client. It negotiates binary framing and encrypts direct messages end to end:
+// the private key lives in `key_file` (created on first start), the public key is
+// published to the relay on login and peers' keys are fetched with get_key. A session
+// key goes to each peer once in a KeyExchange frame, then bodies travel as Cipher
+// frames of raw sealed bytes that the relay forwards untouched. Files are offered under
+// the same session and streamed in their own encrypted chunks, see Transfer/FileTransfer.h;
+// received files land in `download_dir`.
 class ConsoleClient : public std::enable_shared_from_this<ConsoleClient> {
 public:
-    ConsoleClient(boost::asio::io_context& ioc, const std::string& host, unsigned short port)
+    ConsoleClient(boost::asio::io_context& ioc, const std::string& host, unsigned short port,
+                  CPCDMessenger::KeyGenService& keygen, std::string key_file = "client-key.pem",
+                  std::filesystem::path download_dir = "downloads")
             : socket_(ioc),
               resolver_(ioc),
               strand_(ioc.get_executor()),
               host_(host),
               port_(port),
+              keygen_(keygen),
+              key_file_(std::move(key_file)),
+              download_dir_(std::move(download_dir)),
               stopped_(false)
-    {}
+    {
+        // Transfer ids only have to differ between this client's transfers to one peer;
+        // a random start keeps a restarted client from reusing the ids of the last run.
+        RAND_bytes(reinterpret_cast<unsigned char*>(&next_transfer_), sizeof(next_transfer_));
+    }
 
+    // Without a key file a new key pair is generated while the client connects; it is
+    // published once both the key and the login are there.
     void start() {
+        if (!load_identity()) {
+            std::cout << "[system] generating a key pair...\n";
+            keygen_.async_generate(boost::asio::bind_executor(strand_,
+                [this, self=shared_from_this()](const boost::system::error_code& ec, CPCDMessenger::RsaKeyPair pair) {
+                    if (ec) {
+                        std::cerr << "RSA key generation failed: " << ec.message() << "\n";
+                        stop();
+                        return;
+                    }
+                    // An exception here would escape io_context::run; without a key the
+                    // client is as unusable as after a failed generation.
+                    try {
+                        save_identity(pair.private_pem);
+                        install_identity(pair.private_pem);
+                    } catch (const std::exception& ex) {
+                        std::cerr << "Cannot use the new key pair: " << ex.what() << "\n";
+                        stop();
+                        return;
+                    }
+                    if (logged_in_) send_json({ {"cmd","publish_key"}, {"key", public_pem_} });
+                }));
+        }
         auto endpoints = resolver_.resolve(host_, std::to_string(port_));
         boost::asio::async_connect(socket_, endpoints,
                                    boost::asio::bind_executor(strand_, [self=shared_from_this()](const boost::system::error_code& ec, const tcp::endpoint&) {
@@ -271,6 +1152,11 @@ public:
                                            self->stop();
                                            return;
                                        }
+                                       // Frames queued meanwhile may follow the hello line at
+                                       // once, the relay switches as soon as it reads it.
+                                       self->write_msgs_.push_front(std::string(R"({"cmd":"hello","framing":"binary"})") + "\n");
+                                       self->connected_ = true;
+                                       self->do_write();
                                        self->do_read();
                                    })
         );
@@ -288,38 +1174,202 @@ public:
         send_json(j);
     }
 
+    // Encrypted as soon as a session with `to` exists; until then the message waits for
+    // the peer's public key. Nothing is sent in clear to a peer without a key.
     void send_message(const std::string& to, const std::string& body) {
-        json j = { {"cmd","msg"}, {"to", to}, {"body", body} };
-        send_json(j);
+        boost::asio::post(strand_, [this, self=shared_from_this(), to, body]() {
+            auto& peer = peers_[to];
+            if (peer.id != CPCDMessenger::kInvalidUser && peer.exchanged && keys_.can_encrypt(key_name(peer.id))) {
+                send_cipher(peer.id, body);
+                return;
+            }
+            peer.pending.push_back(body);
+            if (!peer.key_requested) {
+                peer.key_requested = true;
+                send_json({ {"cmd","get_key"}, {"user", to} });
+            }
+        });
+    }
+
+    // Offers the file once a session with `to` exists and streams it when the peer
+    // answers; sending the same file again after a failure resumes where it stopped.
+    void send_file(const std::string& to, const std::string& path) {
+        queue_file(to, {path, false});
+    }
+
+    // Uploads the chunks of the file the relay does not have yet and sends `to` the
+    // manifest; the recipient fetches the chunks from the relay, now or after logging in.
+    // Attachments are uploaded one at a time.
+    void send_attachment(const std::string& to, const std::string& path) {
+        queue_file(to, {path, true});
     }
 
 private:
+    struct PendingFile {
+        std::string path;
+        bool attachment;
+    };
+
+    struct Peer {
+        UserId id = CPCDMessenger::kInvalidUser;
+        bool key_requested = false;
+        bool exchanged = false;
+        std::vector<std::string> pending;
+        std::vector<PendingFile> pending_files;
+    };
+
+    // Incoming transfers are keyed by sender and the sender's transfer id.
+    static std::uint64_t incoming_key(UserId from, std::uint32_t id) { return (std::uint64_t(from) << 32) | id; }
+
+    // Sessions are keyed by user id, which is what binary frames carry.
+    static std::string key_name(UserId id) { return std::to_string(id); }
+
+    static std::span<const unsigned char> as_bytes(std::string_view s) {
+        return {reinterpret_cast<const unsigned char*>(s.data()), s.size()};
+    }
+
+    // False if there is no key file yet.
+    bool load_identity() {
+        if (!std::filesystem::exists(key_file_)) return false;
+        std::ifstream in(key_file_, std::ios::binary);
+        std::string priv_pem(std::istreambuf_iterator<char>(in), (std::istreambuf_iterator<char>()));
+        install_identity(priv_pem);
+        return true;
+    }
+
+    void save_identity(const std::string& priv_pem) {
+        {
+            std::ofstream out(key_file_, std::ios::binary | std::ios::trunc);
+            out << priv_pem;
+            if (!out) throw std::runtime_error("Failed to write key file: " + key_file_);
+        }
+        std::filesystem::permissions(key_file_, std::filesystem::perms::owner_read | std::filesystem::perms::owner_write);
+        std::cout << "\n[system] new key pair written to " << key_file_ << "\n> " << std::flush;
+    }
+
+    void install_identity(const std::string& priv_pem) {
+        CPCDMessenger::PkeyPtr key(crypto_.load_privkey_from_pem(priv_pem));
+        if (!key || !crypto_.pubkey_pem(key.get(), public_pem_) || !keys_.load_private_key(priv_pem)) {
+            throw std::runtime_error("Invalid private key in " + key_file_);
+        }
+    }
+
     void do_read() {
+        auto space = read_buf_.prepare();
+        if (space.empty()) {
+            std::cerr << "Received frame too long\n";
+            stop();
+            return;
+        }
         auto self = shared_from_this();
-        boost::asio::async_read_until(socket_, read_buf_, '\n',
-                                      boost::asio::bind_executor(strand_, [this, self](const boost::system::error_code& ec, std::size_t bytes_transferred){
-                                          if (ec) {
-                                              if (!stopped_) std::cerr << "Connection closed: " << ec.message() << "\n";
-                                              stop();
-                                              return;
-                                          }
-                                          std::istream is(&read_buf_);
-                                          std::string line;
-                                          std::getline(is, line);
-                                          if (!line.empty() && line.back() == '\r') line.pop_back();
-
-                                          try {
-                                              auto j = json::parse(line);
-                                              handle_server_json(j);
-                                          } catch (std::exception& ex) {
-                                              std::cerr << "Received invalid json: " << ex.what() << "\n";
-                                          }
-
-                                          do_read();
-                                      })
+        socket_.async_read_some(boost::asio::buffer(space.data(), space.size()),
+                                boost::asio::bind_executor(strand_, [this, self](const boost::system::error_code& ec, std::size_t bytes_transferred){
+                                    if (ec) {
+                                        if (!stopped_) std::cerr << "Connection closed: " << ec.message() << "\n";
+                                        stop();
+                                        return;
+                                    }
+                                    read_buf_.commit(bytes_transferred);
+                                    process_input();
+                                    if (!stopped_) do_read();
+                                })
         );
     }
 
+    // The relay answers hello with a JSON line and sends frames after it.
+    void process_input() {
+        while (!stopped_) {
+            if (!binary_) {
+                auto line = read_buf_.next_line();
+                if (!line) return;
+                if (!line->empty() && line->back() == '\r') line->remove_suffix(1);
+                handle_server_text(*line);
+                continue;
+            }
+            if (read_buf_.size() < Protocol::kFrameHeaderSize) return;
+            auto header = Protocol::FrameHeader::decode(read_buf_.data());
+            if (header.length > Protocol::kMaxFramePayload) {
+                std::cerr << "Received frame too long\n";
+                stop();
+                return;
+            }
+            std::size_t frame_size = Protocol::kFrameHeaderSize + header.length;
+            if (read_buf_.size() < frame_size) return;
+            handle_frame(header, std::string_view(read_buf_.data() + Protocol::kFrameHeaderSize, header.length));
+            read_buf_.consume(frame_size);
+        }
+    }
+
+    void handle_server_text(std::string_view text) {
+        try {
+            auto j = json::parse(text);
+            handle_server_json(j);
+        } catch (std::exception& ex) {
+            std::cerr << "Received invalid json: " << ex.what() << "\n";
+        }
+    }
+
+    void handle_frame(const Protocol::FrameHeader& header, std::string_view payload) {
+        auto bytes = [&] { return std::vector<unsigned char>(payload.begin(), payload.end()); };
+        switch (header.type) {
+            case Protocol::FrameType::Json:
+                handle_server_text(payload);
+                break;
+            case Protocol::FrameType::Msg:
+                std::cout << "\n[" << name_of(header.peer) << ", unencrypted] " << payload << "\n> " << std::flush;
+                break;
+            case Protocol::FrameType::ChannelPost:
+                if (payload.size() >= 4) {
+                    std::cout << "\n[channel " << header.peer << "] [" << name_of(Protocol::get_u32(payload.data())) << "] "
+                              << payload.substr(4) << "\n> " << std::flush;
+                }
+                break;
+            case Protocol::FrameType::KeyExchange:
+                if (payload.empty()) {
+                    // The peer lost our key (e.g. it restarted); wrap a fresh one for it.
+                    resend_key(header.peer);
+                } else if (keys_.accept_session(key_name(header.peer), bytes())) {
+                    rekey_requested_.erase(header.peer);
+                    name_of(header.peer);
+                } else {
+                    std::cout << "\n[system] bad key exchange from " << name_of(header.peer) << "\n> " << std::flush;
+                }
+                break;
+            case Protocol::FrameType::FileOffer:
+                on_file_offer(header.peer, payload);
+                break;
+            case Protocol::FrameType::FileChunk:
+                on_file_chunk(header.peer, payload);
+                break;
+            case Protocol::FrameType::FileAck:
+                on_file_ack(header.peer, payload);
+                break;
+            case Protocol::FrameType::ChunkQuery:
+            case Protocol::FrameType::ChunkPut:
+            case Protocol::FrameType::ChunkGet:
+                on_chunk_answer(header.type, payload);
+                break;
+            case Protocol::FrameType::Attachment:
+                on_attachment(header.peer, payload);
+                break;
+            case Protocol::FrameType::Cipher: {
+                std::string plain(payload.size() >= CPCDMessenger::kSealOverhead ? payload.size() - CPCDMessenger::kSealOverhead : 0, '\0');
+                auto out = std::span<unsigned char>(reinterpret_cast<unsigned char*>(plain.data()), plain.size());
+                if (keys_.decrypt(key_name(header.peer), as_bytes(payload), out)) {
+                    std::cout << "\n[" << name_of(header.peer) << "] " << plain << "\n> " << std::flush;
+                    break;
+                }
+                std::cout << "\n[system] could not decrypt a message from " << name_of(header.peer) << "\n> " << std::flush;
+                if (!keys_.can_decrypt(key_name(header.peer)) && rekey_requested_.insert(header.peer).second) {
+                    send_frame(Protocol::FrameType::KeyExchange, header.peer, {});
+                }
+                break;
+            }
+            default:
+                std::cerr << "Received unknown frame type " << static_cast<unsigned>(header.type) << "\n";
+        }
+    }
+
     void handle_server_json(const json& j) {
         if (j.contains("type")) {
             std::string t = j["type"].get<std::string>();
@@ -327,9 +1377,20 @@ private:
                 std::string from = j.value("from", "");
                 std::string body = j.value("body", "");
                 std::cout << "\n[" << from << "] " << body << "\n> " << std::flush;
+            } else if (t == "hello_ok") {
+                binary_ = j.value("framing", "") == "binary";
             } else if (t == "login_ok") {
                 std::string user = j.value("user", "");
                 std::cout << "\n[system] logged in as " << user << "\n> " << std::flush;
+                logged_in_ = true;
+                if (!public_pem_.empty()) send_json({ {"cmd","publish_key"}, {"key", public_pem_} });
+            } else if (t == "key_published") {
+            } else if (t == "key" || t == "no_key") {
+                on_key(j);
+            } else if (t == "unknown_user") {
+                on_unknown_user(j.value("user", ""));
+            } else if (t == "transfer_failed") {
+                on_transfer_failed(j.value("id", CPCDMessenger::kInvalidUser), j.value("transfer", std::uint32_t(0)));
             } else if (t == "error") {
                 std::string msg = j.value("message", "");
                 std::cout << "\n[server error] " << msg << "\n> " << std::flush;
@@ -341,27 +1402,461 @@ private:
         }
     }
 
+    // Answer to get_key: for a recipient with pending messages, for a peer that asked
+    // for a fresh key, or to name a sender. Any answer may show the peer's key changed.
+    void on_key(const json& j) {
+        std::string user = j.value("user", "");
+        UserId id = j.value("id", CPCDMessenger::kInvalidUser);
+        names_[id] = user;
+        auto it = peers_.find(user);
+        if (j.contains("key") && keys_.public_key_changed(key_name(id), j["key"].get<std::string>())) {
+            // A new key pair: the old session keys are useless to the peer, make new ones.
+            if (it != peers_.end()) it->second.exchanged = false;
+        }
+        if (rekey_pending_.erase(id) != 0 && j.contains("key") && rewrap_key(id, j["key"].get<std::string>())) {
+            if (it != peers_.end()) it->second.exchanged = true;
+        }
+        if (it == peers_.end() || !it->second.key_requested) return;
+        auto& peer = it->second;
+        peer.id = id;
+        peer.key_requested = false;
+        std::vector<unsigned char> wrapped;
+        if (!j.contains("key") || !keys_.begin_session(key_name(id), j["key"].get<std::string>(), wrapped)) {
+            std::cout << "\n[system] " << user << " has no usable public key, "
+                      << peer.pending.size() << " message(s) and " << peer.pending_files.size() << " file(s) not sent\n> " << std::flush;
+            peer.pending.clear();
+            peer.pending_files.clear();
+            return;
+        }
+        if (!peer.exchanged) {
+            send_frame(Protocol::FrameType::KeyExchange, id, wrapped);
+            peer.exchanged = true;
+        }
+        for (const auto& body : peer.pending) send_cipher(id, body);
+        peer.pending.clear();
+        for (const auto& file : peer.pending_files) start_file(id, file);
+        peer.pending_files.clear();
+    }
+
+    // The relay has never seen the name: whatever was waiting for its key is dropped.
+    void on_unknown_user(const std::string& user) {
+        std::cout << "\n[system] no such user " << user;
+        auto it = peers_.find(user);
+        if (it != peers_.end() && it->second.id == CPCDMessenger::kInvalidUser) {
+            std::cout << ", " << it->second.pending.size() << " message(s) and "
+                      << it->second.pending_files.size() << " file(s) not sent";
+            peers_.erase(it);
+        }
+        std::cout << "\n> " << std::flush;
+    }
+
+    // The peer lost our sending key. Its public key is fetched again first: it may have
+    // restarted with a new key pair, and a key wrapped for the old one would be lost too.
+    void resend_key(UserId id) {
+        keys_.end_sending(key_name(id));
+        if (rekey_pending_.insert(id).second) send_json({ {"cmd","get_key"}, {"id", id} });
+    }
+
+    // Offers the peer could not open yet are sent again under the new key.
+    bool rewrap_key(UserId id, const std::string& pem) {
+        std::vector<unsigned char> wrapped;
+        if (!keys_.begin_session(key_name(id), pem, wrapped)) return false;
+        send_frame(Protocol::FrameType::KeyExchange, id, wrapped);
+        for (const auto& [transfer_id, transfer] : outgoing_) {
+            if (transfer.to() == id && !transfer.answered()) send_offer(transfer);
+        }
+        return true;
+    }
+
+    // Ids of senders we have not looked up yet are shown as #id until get_key answers.
+    std::string name_of(UserId id) {
+        auto it = names_.find(id);
+        if (it != names_.end()) return it->second;
+        names_[id] = "#" + std::to_string(id);
+        send_json({ {"cmd","get_key"}, {"id", id} });
+        return names_[id];
+    }
+
+    // Seals the body straight into the payload of the frame that is queued for writing.
+    void send_cipher(UserId to, const std::string& body, Protocol::FrameType type = Protocol::FrameType::Cipher) {
+        std::size_t sealed_size = body.size() + CPCDMessenger::kSealOverhead;
+        bool ok = false;
+        std::string frame;
+        frame.resize_and_overwrite(Protocol::kFrameHeaderSize + sealed_size, [&](char* p, std::size_t n) {
+            Protocol::FrameHeader h;
+            h.length = static_cast<std::uint32_t>(sealed_size);
+            h.type = type;
+            h.peer = to;
+            h.encode(p);
+            auto sealed = std::span<unsigned char>(reinterpret_cast<unsigned char*>(p + Protocol::kFrameHeaderSize), sealed_size);
+            ok = keys_.encrypt(key_name(to), as_bytes(body), sealed);
+            return n;
+        });
+        if (!ok) {
+            std::cout << "\n[system] encryption failed, message not sent\n> " << std::flush;
+            return;
+        }
+        queue_write(std::move(frame));
+    }
+
+    void queue_file(const std::string& to, PendingFile file) {
+        boost::asio::post(strand_, [this, self=shared_from_this(), to, file = std::move(file)]() mutable {
+            auto& peer = peers_[to];
+            if (peer.id != CPCDMessenger::kInvalidUser && peer.exchanged && keys_.can_encrypt(key_name(peer.id))) {
+                start_file(peer.id, file);
+                return;
+            }
+            peer.pending_files.push_back(std::move(file));
+            if (!peer.key_requested) {
+                peer.key_requested = true;
+                send_json({ {"cmd","get_key"}, {"user", to} });
+            }
+        });
+    }
+
+    void start_file(UserId to, const PendingFile& file) {
+        if (!file.attachment) {
+            offer_file(to, file.path);
+            return;
+        }
+        auto upload = CPCDMessenger::Attachment::Upload::open(file.path, to);
+        if (!upload) {
+            std::cout << "\n[system] cannot read " << file.path << "\n> " << std::flush;
+            return;
+        }
+        uploads_.push_back(std::move(*upload));
+        if (uploads_.size() == 1) pump_upload();
+    }
+
+    // One transfer per peer is in flight at a time. A window stays under half the relay's
+    // high watermark, but several at once to the same recipient would stall its session;
+    // later files wait here and are offered as each transfer ends. Sending the file in
+    // flight again restarts it, which resumes a transfer to a peer that went away.
+    void offer_file(UserId to, const std::string& path) {
+        if (auto active = sending_to(to); active != outgoing_.end()) {
+            std::error_code ec;
+            if (std::filesystem::equivalent(active->second.path(), path, ec)) {
+                queue_write(CPCDMessenger::Transfer::make_ack_frame(to, active->first, CPCDMessenger::Transfer::kAbort));
+                outgoing_.erase(active);
+            } else {
+                queued_offers_[to].push_back(path);
+                std::cout << "\n[system] " << path << " queued after the transfer in progress to " << name_of(to) << "\n> " << std::flush;
+                return;
+            }
+        }
+        std::uint32_t id = next_transfer_++;
+        auto transfer = CPCDMessenger::Transfer::Outgoing::open(path, id, to);
+        if (!transfer) {
+            std::cout << "\n[system] cannot read " << path << "\n> " << std::flush;
+            return;
+        }
+        if (!send_offer(*transfer)) {
+            std::cout << "\n[system] encryption failed, file not sent\n> " << std::flush;
+            return;
+        }
+        std::cout << "\n[system] offering " << transfer->offer().name << " (" << transfer->offer().size
+                  << " bytes) to " << name_of(to) << "\n> " << std::flush;
+        outgoing_.emplace(id, std::move(*transfer));
+    }
+
+    std::unordered_map<std::uint32_t, CPCDMessenger::Transfer::Outgoing>::iterator sending_to(UserId to) {
+        return std::ranges::find_if(outgoing_, [to](const auto& entry) { return entry.second.to() == to; });
+    }
+
+    void end_outgoing(std::unordered_map<std::uint32_t, CPCDMessenger::Transfer::Outgoing>::iterator it) {
+        UserId to = it->second.to();
+        outgoing_.erase(it);
+        for (auto queued = queued_offers_.find(to); queued != queued_offers_.end() && sending_to(to) == outgoing_.end();
+             queued = queued_offers_.find(to)) {
+            std::string path = std::move(queued->second.front());
+            queued->second.pop_front();
+            if (queued->second.empty()) queued_offers_.erase(queued);
+            offer_file(to, path);
+        }
+    }
+
+    // The offer carries the file key, so it is sealed under the session like a message;
+    // the transfer id stays in clear in front for the relay's transfer_failed notice.
+    bool send_offer(const CPCDMessenger::Transfer::Outgoing& transfer) {
+        UserId to = transfer.to();
+        std::uint32_t id = transfer.offer().id;
+        std::string plain = transfer.offer().encode();
+        std::size_t payload_size = 4 + plain.size() + CPCDMessenger::kSealOverhead;
+        bool ok = false;
+        std::string frame;
+        frame.resize_and_overwrite(Protocol::kFrameHeaderSize + payload_size, [&](char* p, std::size_t n) {
+            Protocol::FrameHeader h;
+            h.length = static_cast<std::uint32_t>(payload_size);
+            h.type = Protocol::FrameType::FileOffer;
+            h.peer = to;
+            h.encode(p);
+            Protocol::put_u32(p + Protocol::kFrameHeaderSize, id);
+            auto sealed = std::span<unsigned char>(reinterpret_cast<unsigned char*>(p + Protocol::kFrameHeaderSize + 4), payload_size - 4);
+            ok = keys_.encrypt(key_name(to), as_bytes(plain), sealed);
+            return n;
+        });
+        OPENSSL_cleanse(plain.data(), plain.size());
+        if (ok) queue_write(std::move(frame));
+        return ok;
+    }
+
+    void on_file_offer(UserId from, std::string_view payload) {
+        std::uint32_t id = CPCDMessenger::Transfer::transfer_id(payload);
+        if (payload.size() < 4 + CPCDMessenger::kSealOverhead) return;
+        auto sealed = payload.substr(4);
+        std::string plain(sealed.size() - CPCDMessenger::kSealOverhead, '\0');
+        auto out = std::span<unsigned char>(reinterpret_cast<unsigned char*>(plain.data()), plain.size());
+        std::optional<CPCDMessenger::Transfer::Offer> offer;
+        if (keys_.decrypt(key_name(from), as_bytes(sealed), out)) {
+            offer = CPCDMessenger::Transfer::Offer::decode(plain);
+        } else if (!keys_.can_decrypt(key_name(from))) {
+            // We lost the sender's key; it offers the file again along with a new one.
+            if (rekey_requested_.insert(from).second) send_frame(Protocol::FrameType::KeyExchange, from, {});
+            return;
+        }
+        OPENSSL_cleanse(plain.data(), plain.size());
+        std::optional<CPCDMessenger::Transfer::Incoming> transfer;
+        if (offer && offer->id == id) transfer = CPCDMessenger::Transfer::Incoming::open(*offer, download_dir_, from);
+        if (!transfer) {
+            std::cout << "\n[system] rejected a file offer from " << name_of(from) << "\n> " << std::flush;
+            queue_write(CPCDMessenger::Transfer::make_ack_frame(from, id, CPCDMessenger::Transfer::kAbort));
+            return;
+        }
+        std::cout << "\n[system] receiving " << offer->name << " (" << offer->size << " bytes) from " << name_of(from);
+        if (transfer->received()) std::cout << ", resuming at " << transfer->received();
+        std::cout << "\n> " << std::flush;
+        queue_write(CPCDMessenger::Transfer::make_ack_frame(from, id, transfer->received()));
+        if (transfer->done()) {
+            finish_incoming(*transfer);
+            return;
+        }
+        incoming_.insert_or_assign(incoming_key(from, id), std::move(*transfer));
+    }
+
+    // Every chunk is acknowledged as soon as it is written; the ack is what lets the
+    // sender's window move on.
+    void on_file_chunk(UserId from, std::string_view payload) {
+        std::uint32_t id = CPCDMessenger::Transfer::transfer_id(payload);
+        auto it = incoming_.find(incoming_key(from, id));
+        if (it == incoming_.end()) {
+            queue_write(CPCDMessenger::Transfer::make_ack_frame(from, id, CPCDMessenger::Transfer::kAbort));
+            return;
+        }
+        auto& transfer = it->second;
+        if (!transfer.write(payload)) {
+            std::cout << "\n[system] bad chunk of " << transfer.offer().name << " from " << name_of(from)
+                      << ", transfer stopped at " << transfer.received() << "\n> " << std::flush;
+            queue_write(CPCDMessenger::Transfer::make_ack_frame(from, id, CPCDMessenger::Transfer::kAbort));
+            incoming_.erase(it);
+            return;
+        }
+        queue_write(CPCDMessenger::Transfer::make_ack_frame(from, id, transfer.received()));
+        if (transfer.done()) {
+            finish_incoming(transfer);
+            incoming_.erase(it);
+        }
+    }
+
+    void finish_incoming(CPCDMessenger::Transfer::Incoming& transfer) {
+        auto path = transfer.finish();
+        if (path.empty()) {
+            std::cout << "\n[system] could not save " << transfer.offer().name << "\n> " << std::flush;
+            return;
+        }
+        std::cout << "\n[system] received " << path.string() << " from " << name_of(transfer.from()) << "\n> " << std::flush;
+    }
+
+    // An abort may come from either end, so it ends our transfer to the peer as well as
+    // the peer's transfer to us under that id.
+    void on_file_ack(UserId from, std::string_view payload) {
+        std::uint32_t id = 0;
+        std::uint64_t received = 0;
+        if (!CPCDMessenger::Transfer::parse_ack(payload, id, received)) return;
+        if (received == CPCDMessenger::Transfer::kAbort) {
+            incoming_.erase(incoming_key(from, id));
+            auto it = outgoing_.find(id);
+            if (it != outgoing_.end() && it->second.to() == from) {
+                std::cout << "\n[system] " << name_of(from) << " stopped the transfer of " << it->second.offer().name << "\n> " << std::flush;
+                end_outgoing(it);
+            }
+            return;
+        }
+        auto it = outgoing_.find(id);
+        if (it == outgoing_.end() || it->second.to() != from) return;
+        auto& transfer = it->second;
+        if (!transfer.answered()) {
+            if (!transfer.start(received)) {
+                fail_outgoing(it, "the file changed or cannot resume at " + std::to_string(received));
+                return;
+            }
+            if (received) {
+                std::cout << "\n[system] resuming " << transfer.offer().name << " at " << received << "\n> " << std::flush;
+            }
+        } else {
+            transfer.acknowledge(received);
+        }
+        if (transfer.done()) {
+            double seconds = transfer.seconds();
+            std::cout << "\n[system] sent " << transfer.offer().name << " to " << name_of(from) << ", "
+                      << transfer.transferred() << " bytes in " << seconds << " s ("
+                      << (seconds > 0 ? transfer.transferred() / seconds / 1e6 : 0.0) << " MB/s)\n> " << std::flush;
+            end_outgoing(it);
+            return;
+        }
+        if (!transfer.pump([this](std::string frame) { queue_write(std::move(frame)); })) {
+            fail_outgoing(it, "the file changed or could not be read");
+        }
+    }
+
+    void fail_outgoing(std::unordered_map<std::uint32_t, CPCDMessenger::Transfer::Outgoing>::iterator it, const std::string& why) {
+        std::cout << "\n[system] transfer of " << it->second.offer().name << " stopped: " << why << "\n> " << std::flush;
+        queue_write(CPCDMessenger::Transfer::make_ack_frame(it->second.to(), it->first, CPCDMessenger::Transfer::kAbort));
+        end_outgoing(it);
+    }
+
+    // The relay could not forward one of our transfer frames to `peer`: the peer went
+    // offline or is backed up. Whatever the peer already wrote stays in its .part file;
+    // files queued behind the transfer are dropped too.
+    void on_transfer_failed(UserId peer, std::uint32_t id) {
+        incoming_.erase(incoming_key(peer, id));
+        auto it = outgoing_.find(id);
+        if (it == outgoing_.end() || it->second.to() != peer) return;
+        std::cout << "\n[system] " << name_of(peer) << " is not reachable, transfer of " << it->second.offer().name
+                  << " stopped; send it again to resume\n> " << std::flush;
+        if (auto queued = queued_offers_.find(peer); queued != queued_offers_.end()) {
+            std::cout << "\n[system] " << queued->second.size() << " queued file(s) to " << name_of(peer) << " not sent\n> " << std::flush;
+            queued_offers_.erase(queued);
+        }
+        outgoing_.erase(it);
+    }
+
+    // Moves the front upload on; once the relay holds all of its chunks the manifest goes
+    // to the recipient and the next queued upload starts.
+    void pump_upload() {
+        while (!uploads_.empty()) {
+            auto& upload = uploads_.front();
+            if (!upload.pump([this](std::string frame) { queue_write(std::move(frame)); })) {
+                std::cout << "\n[system] could not read " << upload.manifest().name << ", attachment not sent\n> " << std::flush;
+                uploads_.pop_front();
+                continue;
+            }
+            if (!upload.done()) return;
+            const auto& manifest = upload.manifest();
+            if (manifest.chunks.size() > (Protocol::kMaxFramePayload - CPCDMessenger::kSealOverhead - 14 - manifest.name.size())
+                                         / CPCDMessenger::Attachment::kRefSize) {
+                std::cout << "\n[system] " << manifest.name << " is too large for one attachment\n> " << std::flush;
+            } else {
+                std::string plain = manifest.encode();
+                send_cipher(upload.to(), plain, Protocol::FrameType::Attachment);
+                OPENSSL_cleanse(plain.data(), plain.size());
+                std::cout << "\n[system] attached " << manifest.name << " for " << name_of(upload.to()) << ": "
+                          << manifest.chunks.size() << " chunks, " << upload.uploaded() << " bytes uploaded, "
+                          << upload.deduplicated() << " already on the relay\n> " << std::flush;
+            }
+            uploads_.pop_front();
+        }
+    }
+
+    void on_chunk_answer(Protocol::FrameType type, std::string_view payload) {
+        if (type == Protocol::FrameType::ChunkGet) {
+            if (downloads_.empty()) return;
+            auto& download = downloads_.front();
+            if (!download.on_chunk(payload) && !download.failed()) {
+                std::cout << "\n[system] could not fetch " << download.manifest().name << " from the relay\n> " << std::flush;
+                download.abandon();
+            }
+            pump_download();
+            return;
+        }
+        if (uploads_.empty()) return;
+        bool ok = type == Protocol::FrameType::ChunkQuery
+                      ? uploads_.front().on_missing(payload, [this](std::string frame) { queue_write(std::move(frame)); })
+                      : uploads_.front().on_stored(payload);
+        if (!ok) {
+            std::cout << "\n[system] the relay did not take " << uploads_.front().manifest().name << ", attachment not sent\n> " << std::flush;
+            // Answers still due for it would be taken for the next upload's.
+            uploads_.clear();
+            return;
+        }
+        pump_upload();
+    }
+
+    void on_attachment(UserId from, std::string_view payload) {
+        std::string plain(payload.size() >= CPCDMessenger::kSealOverhead ? payload.size() - CPCDMessenger::kSealOverhead : 0, '\0');
+        auto out = std::span<unsigned char>(reinterpret_cast<unsigned char*>(plain.data()), plain.size());
+        std::optional<CPCDMessenger::Attachment::Manifest> manifest;
+        if (keys_.decrypt(key_name(from), as_bytes(payload), out)) manifest = CPCDMessenger::Attachment::Manifest::decode(plain);
+        OPENSSL_cleanse(plain.data(), plain.size());
+        std::optional<CPCDMessenger::Attachment::Download> download;
+        if (manifest) download = CPCDMessenger::Attachment::Download::open(std::move(*manifest), download_dir_, from);
+        if (!download) {
+            std::cout << "\n[system] could not open an attachment from " << name_of(from) << "\n> " << std::flush;
+            return;
+        }
+        std::cout << "\n[system] fetching " << download->manifest().name << " (" << download->manifest().size
+                  << " bytes) from " << name_of(from) << "\n> " << std::flush;
+        downloads_.push_back(std::move(*download));
+        if (downloads_.size() == 1) pump_download();
+    }
+
+    // Moves the front download on: starts it, finishes it once every chunk is written,
+    // and drops it once failed and settled; then the next one starts.
+    void pump_download() {
+        while (!downloads_.empty()) {
+            auto& download = downloads_.front();
+            if (download.failed()) {
+                // Answers still due for it would be taken for the next download's.
+                if (!download.settled()) return;
+            } else if (!download.started() && !download.start()) {
+                std::cout << "\n[system] could not save " << download.manifest().name << "\n> " << std::flush;
+            } else if (download.done()) {
+                auto path = download.finish();
+                if (path.empty()) std::cout << "\n[system] could not save " << download.manifest().name << "\n> " << std::flush;
+                else std::cout << "\n[system] received " << path.string() << " from " << name_of(download.from()) << "\n> " << std::flush;
+            } else {
+                download.pump([this](std::string frame) { queue_write(std::move(frame)); });
+                return;
+            }
+            downloads_.pop_front();
+        }
+    }
+
+    void send_frame(Protocol::FrameType type, UserId peer, const std::vector<unsigned char>& payload) {
+        queue_write(Protocol::make_frame(type, peer,
+            std::string_view(reinterpret_cast<const char*>(payload.data()), payload.size())));
+    }
+
     void send_json(const json& j) {
-        std::string s = j.dump();
-        s.push_back('\n');
+        queue_write(Protocol::make_frame(Protocol::FrameType::Json, Protocol::kNoPeer, j.dump()));
+    }
 
+    void queue_write(std::string s) {
         boost::asio::post(strand_, [this, self=shared_from_this(), s = std::move(s)]() mutable {
             bool write_in_progress = !write_msgs_.empty();
             write_msgs_.push_back(std::move(s));
-            if (!write_in_progress) do_write();
+            // Before the connection is up, writes wait for the connect handler to start them.
+            if (connected_ && !write_in_progress) do_write();
         });
     }
 
     void do_write() {
+        write_bufs_.clear();
+        std::size_t batch_bytes = 0;
+        for (const auto& m : write_msgs_) {
+            if (!write_bufs_.empty() && batch_bytes + m.size() > kMaxWriteBatchBytes) break;
+            write_bufs_.push_back(boost::asio::buffer(m));
+            batch_bytes += m.size();
+        }
+
         auto self = shared_from_this();
-        boost::asio::async_write(socket_, boost::asio::buffer(write_msgs_.front()),
+        boost::asio::async_write(socket_, write_bufs_,
                                  boost::asio::bind_executor(strand_, [this, self](const boost::system::error_code& ec, std::size_t /*bytes_transferred*/){
                                      if (ec) {
                                          std::cerr << "Write error: " << ec.message() << "\n";
                                          stop();
                                          return;
                                      }
-                                     write_msgs_.pop_front();
+                                     write_msgs_.erase(write_msgs_.begin(), write_msgs_.begin() + static_cast<std::ptrdiff_t>(write_bufs_.size()));
                                      if (!write_msgs_.empty()) do_write();
                                  })
         );
@@ -370,9 +1865,35 @@ private:
     tcp::socket socket_;
     tcp::resolver resolver_;
     boost::asio::strand<boost::asio::any_io_executor> strand_;
-    boost::asio::streambuf read_buf_;
+    CPCDMessenger::ReadBuffer read_buf_{CPCDMessenger::ReadBuffer::kDefaultCapacity,
+                                        Protocol::kFrameHeaderSize + Protocol::kMaxFramePayload};
+    bool binary_ = false;
+    bool connected_ = false;
+    static constexpr std::size_t kMaxWriteBatchBytes = 64 * 1024;
+
     std::deque<std::string> write_msgs_;
+    std::vector<boost::asio::const_buffer> write_bufs_;
     std::string host_;
     unsigned short port_;
+    CPCDMessenger::KeyGenService& keygen_;
+    std::string key_file_;
+    std::filesystem::path download_dir_;
     std::atomic<bool> stopped_;
+
+    // Touched on the strand only.
+    bool logged_in_ = false;
+    Crypto crypto_;
+    CPCDMessenger::SessionKeyCache keys_;
+    std::string public_pem_;
+    std::unordered_map<std::string, Peer> peers_;
+    std::unordered_map<UserId, std::string> names_;
+    std::unordered_set<UserId> rekey_requested_;
+    // Peers that asked for a fresh key, waiting for their public key to be fetched.
+    std::unordered_set<UserId> rekey_pending_;
+    std::uint32_t next_transfer_ = 0;
+    std::unordered_map<std::uint32_t, CPCDMessenger::Transfer::Outgoing> outgoing_;
+    std::unordered_map<UserId, std::deque<std::string>> queued_offers_;
+    std::unordered_map<std::uint64_t, CPCDMessenger::Transfer::Incoming> incoming_;
+    std::deque<CPCDMessenger::Attachment::Upload> uploads_;
+    std::deque<CPCDMessenger::Attachment::Download> downloads_;
 };
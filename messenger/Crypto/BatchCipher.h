@@ -0,0 +1,148 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <latch>
+#include <memory>
+#include <optional>
+#include <span>
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+#include "SessionKeys.h"
+
+namespace CPCDMessenger {
+    // One message of a batch. `out` is preallocated by the caller: in.size() + kSealOverhead
+    // bytes when sealing, in.size() - kSealOverhead when opening. `ok` is set per message.
+    struct CryptoJob {
+        std::span<const unsigned char> in;
+        std::span<unsigned char> out;
+        bool ok = false;
+    };
+
+    namespace detail {
+        // The calling thread's GCM context for one direction. It stays keyed with the last
+        // key used, so consecutive batches under one key skip the key schedule too.
+        inline GcmKey* thread_gcm(const SessionKey& key, bool encrypt) {
+            struct Slot {
+                std::optional<GcmKey> gcm;
+                SessionKey key{};
+                ~Slot() { OPENSSL_cleanse(key.data(), key.size()); }
+            };
+            thread_local Slot slots[2];
+            Slot& slot = slots[encrypt ? 1 : 0];
+            if (!slot.gcm) {
+                slot.gcm = GcmKey::create(key.data(), encrypt);
+                if (!slot.gcm) return nullptr;
+                slot.key = key;
+            } else if (CRYPTO_memcmp(slot.key.data(), key.data(), key.size()) != 0) {
+                if (!slot.gcm->rekey(key.data())) return nullptr;
+                slot.key = key;
+            }
+            return &*slot.gcm;
+        }
+    }
+
+    // Seals or opens many messages under one key into caller-provided buffers, in the
+    // SessionKeys layout (nonce | ciphertext | tag). Each thread works through its own
+    // cached context, so a batch costs no context allocation and, for a key seen before,
+    // no key schedule. With worker threads a large batch is cut into shares of roughly
+    // equal bytes and the calling thread takes one of them; small batches stay inline.
+    // Must not be called from one of its own workers.
+    class BatchCipher {
+    public:
+        // Below this many bytes a share is not worth a hand-off to another thread.
+        static constexpr std::size_t kMinShareBytes = 32 * 1024;
+
+        BatchCipher() = default;
+        explicit BatchCipher(std::size_t workers)
+        : workers_(workers), pool_(workers ? std::make_unique<boost::asio::thread_pool>(workers) : nullptr)
+        {}
+
+        ~BatchCipher() {
+            if (pool_) pool_->join();
+        }
+
+        // Nonces are prefix | (first_counter + i) for jobs[i]; the caller guarantees that
+        // the range is unused, e.g. through SessionKeyCache::reserve_send_batch.
+        // Returns the number of messages sealed.
+        std::size_t seal(const SessionKey& key, const NoncePrefix& prefix, std::uint64_t first_counter, std::span<CryptoJob> jobs) {
+            return run(jobs, [&](std::span<CryptoJob> share, std::size_t first) {
+                GcmKey* gcm = detail::thread_gcm(key, true);
+                std::size_t sealed = 0;
+                std::array<unsigned char, kNonceSize> nonce;
+                for (std::size_t i = 0; i < share.size(); ++i) {
+                    CryptoJob& job = share[i];
+                    make_nonce(prefix, first_counter + first + i, nonce.data());
+                    job.ok = gcm && job.out.size() == job.in.size() + kSealOverhead
+                             && gcm->seal(nonce.data(), job.in.data(), job.in.size(), job.out.data());
+                    sealed += job.ok;
+                }
+                return sealed;
+            });
+        }
+
+        // For a key without a counter of its own: one RAND_bytes call per batch draws the
+        // prefix and a starting counter, instead of a random IV per message.
+        std::size_t seal(const SessionKey& key, std::span<CryptoJob> jobs) {
+            unsigned char seed[sizeof(NoncePrefix) + sizeof(std::uint64_t)];
+            if (RAND_bytes(seed, sizeof(seed)) != 1) {
+                for (auto& job : jobs) job.ok = false;
+                return 0;
+            }
+            NoncePrefix prefix;
+            std::memcpy(prefix.data(), seed, prefix.size());
+            std::uint64_t counter = 0;
+            std::memcpy(&counter, seed + prefix.size(), sizeof(counter));
+            return seal(key, prefix, counter, jobs);
+        }
+
+        // Returns the number of messages that opened and authenticated.
+        std::size_t open(const SessionKey& key, std::span<CryptoJob> jobs) {
+            return run(jobs, [&](std::span<CryptoJob> share, std::size_t) {
+                GcmKey* gcm = detail::thread_gcm(key, false);
+                std::size_t opened = 0;
+                for (CryptoJob& job : share) {
+                    job.ok = gcm && job.in.size() >= kSealOverhead && job.out.size() == job.in.size() - kSealOverhead
+                             && gcm->open(job.in.data(), job.in.size(), job.out.data());
+                    opened += job.ok;
+                }
+                return opened;
+            });
+        }
+
+    private:
+        // work(share, index of its first job) -> messages that succeeded.
+        template<typename Work>
+        std::size_t run(std::span<CryptoJob> jobs, Work&& work) {
+            std::size_t total = 0;
+            for (const auto& job : jobs) total += job.in.size() + kSealOverhead;
+            std::size_t shares = pool_ ? std::min({workers_ + 1, jobs.size(), total / kMinShareBytes}) : 1;
+            if (shares <= 1) return work(jobs, 0);
+
+            std::latch done(static_cast<std::ptrdiff_t>(shares - 1));
+            std::atomic<std::size_t> succeeded{0};
+            std::size_t target = total / shares, begin = 0, bytes = 0, posted = 0;
+            for (std::size_t i = 0; i < jobs.size() && posted < shares - 1; ++i) {
+                bytes += jobs[i].in.size() + kSealOverhead;
+                if (bytes < target) continue;
+                boost::asio::post(*pool_, [&, share = jobs.subspan(begin, i + 1 - begin), first = begin] {
+                    succeeded.fetch_add(work(share, first), std::memory_order_relaxed);
+                    done.count_down();
+                });
+                begin = i + 1;
+                bytes = 0;
+                ++posted;
+            }
+            if (posted < shares - 1) done.count_down(static_cast<std::ptrdiff_t>(shares - 1 - posted));
+            std::size_t own = work(jobs.subspan(begin), begin);
+            done.wait();
+            return own + succeeded.load(std::memory_order_relaxed);
+        }
+
+        std::size_t workers_ = 0;
+        std::unique_ptr<boost::asio::thread_pool> pool_;
+    };
+} // CPCDMessenger
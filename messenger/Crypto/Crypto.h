@@ -1,7 +1,9 @@
-#pragma "once"
+#pragma once
 
-#include "string"
-#include "vector"
+#include <array>
+#include <span>
+#include <string>
+#include <vector>
 #include <openssl/evp.h>
 #include <openssl/pem.h>
 #include <openssl/rand.h>
@@ -10,6 +12,12 @@
 
 class Crypto {
 public:
+    static constexpr std::size_t kAesKeySize = 32;
+    static constexpr std::size_t kGcmIvSize = 12;
+    static constexpr std::size_t kGcmTagSize = 16;
+    using AesKey = std::array<unsigned char, kAesKeySize>;
+    using GcmIv = std::array<unsigned char, kGcmIvSize>;
+
     Crypto() { OpenSSL_add_all_algorithms(); ERR_load_crypto_strings(); }
     ~Crypto() { /*cleanup handled by OS*/ }
 
@@ -36,6 +44,20 @@ public:
         return true;
     }
 
+    // Public half of a key pair as PEM, e.g. to publish the key of a loaded private key
+    bool pubkey_pem(EVP_PKEY* key, std::string &pub_pem) {
+        BIO *bpub = BIO_new(BIO_s_mem());
+        if (!bpub) return false;
+        bool ok = PEM_write_bio_PUBKEY(bpub, key) == 1;
+        if (ok) {
+            char *p;
+            long n = BIO_get_mem_data(bpub, &p);
+            pub_pem.assign(p, n);
+        }
+        BIO_free(bpub);
+        return ok;
+    }
+
     // Загрузка EVP_PKEY из PEM
     EVP_PKEY* load_pubkey_from_pem(const std::string &pem) {
         BIO* bio = BIO_new_mem_buf(pem.data(), (int)pem.size());
@@ -122,10 +144,66 @@ public:
         return true;
     }
 
+    // AES-256-GCM encrypt into a caller buffer, e.g. straight into an outgoing frame:
+    // out gets the ciphertext followed by the tag, plaintext.size() + kGcmTagSize bytes,
+    // iv a fresh random IV. `aad` is authenticated but not encrypted, e.g. a position the
+    // receiver checks. Uses this thread's context, so nothing is allocated per call.
+    bool aes_gcm_encrypt(const AesKey& key, std::span<const unsigned char> plaintext, GcmIv& iv, std::span<unsigned char> out,
+                         std::span<const unsigned char> aad = {}) {
+        if (out.size() != plaintext.size() + kGcmTagSize) return false;
+        if (RAND_bytes(iv.data(), (int)iv.size()) != 1) return false;
+        EVP_CIPHER_CTX* ctx = thread_gcm_ctx(true);
+        if (!ctx || !EVP_EncryptInit_ex(ctx, NULL, NULL, key.data(), iv.data())) return false;
+        int len = 0, tail = 0;
+        if (!aad.empty() && !EVP_EncryptUpdate(ctx, NULL, &len, aad.data(), (int)aad.size())) return false;
+        if (!plaintext.empty() && !EVP_EncryptUpdate(ctx, out.data(), &len, plaintext.data(), (int)plaintext.size())) return false;
+        if (!EVP_EncryptFinal_ex(ctx, out.data() + len, &tail)) return false;
+        return EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, kGcmTagSize, out.data() + plaintext.size()) == 1;
+    }
+    // AES-256-GCM decrypt of ciphertext followed by tag, with the same aad as the
+    // encrypt; plaintext must hold sealed.size() - kGcmTagSize bytes and is only
+    // meaningful if this returns true.
+    bool aes_gcm_decrypt(const AesKey& key, const GcmIv& iv, std::span<const unsigned char> sealed, std::span<unsigned char> plaintext,
+                         std::span<const unsigned char> aad = {}) {
+        if (sealed.size() < kGcmTagSize || plaintext.size() != sealed.size() - kGcmTagSize) return false;
+        EVP_CIPHER_CTX* ctx = thread_gcm_ctx(false);
+        if (!ctx || !EVP_DecryptInit_ex(ctx, NULL, NULL, key.data(), iv.data())) return false;
+        int len = 0, tail = 0;
+        if (!aad.empty() && !EVP_DecryptUpdate(ctx, NULL, &len, aad.data(), (int)aad.size())) return false;
+        if (!plaintext.empty() && !EVP_DecryptUpdate(ctx, plaintext.data(), &len, sealed.data(), (int)plaintext.size())) return false;
+        auto* tag = const_cast<unsigned char*>(sealed.data() + plaintext.size());
+        if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, kGcmTagSize, tag)) return false;
+        return EVP_DecryptFinal_ex(ctx, plaintext.data() + len, &tail) > 0;
+    }
+
     // Генерация случайного AES ключа 32 байта
     static std::vector<unsigned char> gen_aes_key() {
         std::vector<unsigned char> k(32);
         RAND_bytes(k.data(), (int)k.size());
         return k;
     }
+    static bool gen_aes_key(AesKey& key) {
+        return RAND_bytes(key.data(), (int)key.size()) == 1;
+    }
+
+private:
+    // One AES-256-GCM context per thread and direction, set up once; each call only
+    // passes the key and IV.
+    static EVP_CIPHER_CTX* thread_gcm_ctx(bool encrypt) {
+        struct Ctx {
+            EVP_CIPHER_CTX* ctx = nullptr;
+            ~Ctx() { EVP_CIPHER_CTX_free(ctx); }
+        };
+        thread_local Ctx slots[2];
+        Ctx& slot = slots[encrypt ? 1 : 0];
+        if (!slot.ctx) {
+            EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+            if (!ctx) return nullptr;
+            int ok = encrypt ? EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL)
+                             : EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL);
+            if (!ok) { EVP_CIPHER_CTX_free(ctx); return nullptr; }
+            slot.ctx = ctx;
+        }
+        return slot.ctx;
+    }
 };
\ No newline at end of file
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/execution.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/system_executor.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/system/error_code.hpp>
+#include "Crypto.h"
+
+namespace CPCDMessenger {
+    struct RsaKeyPair {
+        std::string private_pem;
+        std::string public_pem;
+    };
+
+    // RSA-2048 key generation off the calling thread. A keygen takes tens to hundreds of
+    // milliseconds, so it runs on the service's own workers and completes through an asio
+    // completion token: a handler, use_future, or whatever else the caller's asio
+    // supports. With a non-zero `pool_target` the workers keep that many pairs generated
+    // ahead of time, and a request that finds one is answered without waiting for a
+    // keygen. Handlers run on their associated executor, or on asio's system executor if
+    // they have none, never on the keygen workers.
+    // Signature: void(boost::system::error_code, RsaKeyPair); the error is io_error if
+    // OpenSSL fails and operation_aborted once the service is being destroyed.
+    class KeyGenService {
+    public:
+        explicit KeyGenService(std::size_t workers = 1, std::size_t pool_target = 0)
+        : pool_(workers ? workers : 1), pool_target_(pool_target)
+        {
+            std::lock_guard<std::mutex> lk(mutex_);
+            refill_locked();
+        }
+
+        KeyGenService(const KeyGenService&) = delete;
+        KeyGenService& operator=(const KeyGenService&) = delete;
+
+        // Requests still waiting complete with operation_aborted; a keygen already running
+        // is waited for.
+        ~KeyGenService() {
+            std::deque<Waiter> waiters;
+            {
+                std::lock_guard<std::mutex> lk(mutex_);
+                stopped_ = true;
+                waiters.swap(waiters_);
+            }
+            for (auto& waiter : waiters) waiter(boost::asio::error::operation_aborted, {});
+            pool_.join();
+        }
+
+        template<typename CompletionToken>
+        auto async_generate(CompletionToken&& token) {
+            return boost::asio::async_initiate<CompletionToken, void(boost::system::error_code, RsaKeyPair)>(
+                [this](auto handler) { start(std::move(handler)); }, token);
+        }
+
+        // Pairs generated ahead and not handed out yet.
+        std::size_t ready() const {
+            std::lock_guard<std::mutex> lk(mutex_);
+            return ready_.size();
+        }
+
+    private:
+        using Waiter = std::move_only_function<void(boost::system::error_code, RsaKeyPair)>;
+
+        template<typename Handler>
+        void start(Handler handler) {
+            auto ex = boost::asio::get_associated_executor(handler, boost::asio::system_executor());
+            Waiter waiter = [handler = std::move(handler), ex, work = track_work(ex)]
+                            (boost::system::error_code ec, RsaKeyPair pair) mutable {
+                boost::asio::post(ex, [handler = std::move(handler), work = std::move(work), ec, pair = std::move(pair)]() mutable {
+                    std::move(handler)(ec, std::move(pair));
+                });
+            };
+            std::unique_lock<std::mutex> lk(mutex_);
+            if (ready_.empty()) {
+                waiters_.push_back(std::move(waiter));
+                refill_locked();
+                return;
+            }
+            RsaKeyPair pair = std::move(ready_.front());
+            ready_.pop_front();
+            waiter({}, std::move(pair));
+            refill_locked();
+        }
+
+        // Keeps the handler's executor from running out of work while a keygen is pending;
+        // asio 1.74 has both executor models, and the work guard only fits the old one.
+        template<typename Executor>
+        static auto track_work(const Executor& ex) {
+            if constexpr (boost::asio::execution::is_executor<Executor>::value) {
+                return boost::asio::prefer(ex, boost::asio::execution::outstanding_work.tracked);
+            } else {
+                return boost::asio::make_work_guard(ex);
+            }
+        }
+
+        // Keeps a keygen queued for every waiter plus pool_target_ pairs ready or being
+        // made. A finished pair goes to the oldest waiter, so a request never queues
+        // behind refills started before it. Called with mutex_ held.
+        void refill_locked() {
+            while (!stopped_ && ready_.size() + generating_ < pool_target_ + waiters_.size()) {
+                ++generating_;
+                boost::asio::post(pool_, [this] {
+                    RsaKeyPair pair;
+                    bool ok = !stopping() && generate(pair);
+                    std::unique_lock<std::mutex> lk(mutex_);
+                    --generating_;
+                    if (stopped_) return;
+                    if (waiters_.empty()) {
+                        if (ok) ready_.push_back(std::move(pair));
+                        return;
+                    }
+                    Waiter waiter = std::move(waiters_.front());
+                    waiters_.pop_front();
+                    lk.unlock();
+                    if (ok) waiter({}, std::move(pair));
+                    else waiter(boost::system::errc::make_error_code(boost::system::errc::io_error), {});
+                });
+            }
+        }
+
+        bool stopping() const {
+            std::lock_guard<std::mutex> lk(mutex_);
+            return stopped_;
+        }
+
+        static bool generate(RsaKeyPair& pair) {
+            Crypto crypto;
+            return crypto.generate_rsa_pem(pair.private_pem, pair.public_pem);
+        }
+
+        boost::asio::thread_pool pool_;
+        std::size_t pool_target_;
+        mutable std::mutex mutex_;
+        std::deque<RsaKeyPair> ready_;
+        std::deque<Waiter> waiters_;
+        std::size_t generating_ = 0;
+        bool stopped_ = false;
+    };
+} // CPCDMessenger
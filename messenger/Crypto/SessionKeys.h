@@ -0,0 +1,260 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include "Crypto.h"
+
+namespace CPCDMessenger {
+    struct CipherCtxDeleter {
+        void operator()(EVP_CIPHER_CTX* ctx) const { EVP_CIPHER_CTX_free(ctx); }
+    };
+    struct PkeyDeleter {
+        void operator()(EVP_PKEY* key) const { EVP_PKEY_free(key); }
+    };
+    using CipherCtxPtr = std::unique_ptr<EVP_CIPHER_CTX, CipherCtxDeleter>;
+    using PkeyPtr = std::unique_ptr<EVP_PKEY, PkeyDeleter>;
+
+    // Sealed message layout: 12-byte nonce, ciphertext, 16-byte GCM tag.
+    constexpr std::size_t kSessionKeySize = 32;
+    constexpr std::size_t kNonceSize = 12;
+    constexpr std::size_t kTagSize = 16;
+    constexpr std::size_t kSealOverhead = kNonceSize + kTagSize;
+
+    using SessionKey = std::array<unsigned char, kSessionKeySize>;
+    using NoncePrefix = std::array<unsigned char, 4>;
+
+    // Nonce for message `counter` of a sending key: the prefix, then the counter big-endian.
+    inline void make_nonce(const NoncePrefix& prefix, std::uint64_t counter, unsigned char* nonce) {
+        std::memcpy(nonce, prefix.data(), prefix.size());
+        for (int i = 0; i < 8; ++i) nonce[4 + i] = static_cast<unsigned char>(counter >> (56 - 8 * i));
+    }
+
+    // One direction of AES-256-GCM under a fixed key. The cipher and key are set on the
+    // context once; each message only re-initialises the nonce, so there is no context
+    // allocation or key schedule per message.
+    class GcmKey {
+    public:
+        static std::optional<GcmKey> create(const unsigned char* key, bool encrypt) {
+            CipherCtxPtr ctx(EVP_CIPHER_CTX_new());
+            if (!ctx) return std::nullopt;
+            int ok = encrypt ? EVP_EncryptInit_ex(ctx.get(), EVP_aes_256_gcm(), nullptr, key, nullptr)
+                             : EVP_DecryptInit_ex(ctx.get(), EVP_aes_256_gcm(), nullptr, key, nullptr);
+            if (!ok) return std::nullopt;
+            return GcmKey(std::move(ctx));
+        }
+
+        // Swaps the key but keeps the context and its direction.
+        bool rekey(const unsigned char* key) {
+            return EVP_CipherInit_ex(ctx_.get(), nullptr, nullptr, key, nullptr, -1) == 1;
+        }
+
+        // Writes the sealed message into `out`, which must hold size + kSealOverhead bytes.
+        bool seal(const unsigned char* nonce, const unsigned char* in, std::size_t size, unsigned char* out) {
+            EVP_CIPHER_CTX* ctx = ctx_.get();
+            int len = 0, tail = 0;
+            std::memcpy(out, nonce, kNonceSize);
+            unsigned char* cipher = out + kNonceSize;
+            if (!EVP_EncryptInit_ex(ctx, nullptr, nullptr, nullptr, nonce)) return false;
+            if (size && !EVP_EncryptUpdate(ctx, cipher, &len, in, static_cast<int>(size))) return false;
+            if (!EVP_EncryptFinal_ex(ctx, cipher + len, &tail)) return false;
+            return EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, kTagSize, cipher + size) == 1;
+        }
+
+        // Writes sealed_size - kSealOverhead bytes of plaintext into `out`; false if the
+        // message is short or fails authentication.
+        bool open(const unsigned char* sealed, std::size_t sealed_size, unsigned char* out) {
+            if (sealed_size < kSealOverhead) return false;
+            EVP_CIPHER_CTX* ctx = ctx_.get();
+            std::size_t size = sealed_size - kSealOverhead;
+            const unsigned char* cipher = sealed + kNonceSize;
+            int len = 0, tail = 0;
+            if (!EVP_DecryptInit_ex(ctx, nullptr, nullptr, nullptr, sealed)) return false;
+            if (size && !EVP_DecryptUpdate(ctx, out, &len, cipher, static_cast<int>(size))) return false;
+            if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, kTagSize, const_cast<unsigned char*>(cipher + size))) return false;
+            return EVP_DecryptFinal_ex(ctx, out + len, &tail) > 0;
+        }
+
+    private:
+        explicit GcmKey(CipherCtxPtr ctx) : ctx_(std::move(ctx)) {}
+
+        CipherCtxPtr ctx_;
+    };
+
+    // Hybrid encryption with one RSA exchange per peer and direction. Each side makes its
+    // own random sending key, wraps it once with the peer's RSA-OAEP public key and seals
+    // every later message with AES-256-GCM under it. Nonces are a random 4-byte prefix
+    // and a 64-bit message counter, unique because only the owner of a sending key
+    // seals with it. Peer public keys and our private key are parsed from PEM once.
+    // Not thread-safe: one cache per client, used from its own thread or strand.
+    class SessionKeyCache {
+    public:
+        // False if the PEM does not parse.
+        bool load_private_key(const std::string& priv_pem) {
+            private_key_.reset(crypto_.load_privkey_from_pem(priv_pem));
+            return private_key_ != nullptr;
+        }
+
+        // Starts our sending direction to `peer`: generates the key, sets up its context
+        // and returns it wrapped for the peer, to be sent once. Later calls for the same
+        // peer return the same wrapped key.
+        bool begin_session(const std::string& peer, const std::string& peer_pub_pem, std::vector<unsigned char>& wrapped_key) {
+            auto& entry = peers_[peer];
+            if (entry.send) {
+                wrapped_key = entry.wrapped_send_key;
+                return true;
+            }
+            if (!entry.public_key) {
+                entry.public_key.reset(crypto_.load_pubkey_from_pem(peer_pub_pem));
+                if (!entry.public_key) return false;
+                entry.public_pem = peer_pub_pem;
+            }
+
+            std::vector<unsigned char> key(kSessionKeySize);
+            if (RAND_bytes(key.data(), static_cast<int>(key.size())) != 1) return false;
+            if (RAND_bytes(entry.nonce_prefix.data(), static_cast<int>(entry.nonce_prefix.size())) != 1) return false;
+            if (!crypto_.rsa_encrypt(entry.public_key.get(), key, entry.wrapped_send_key)) return false;
+            entry.send = GcmKey::create(key.data(), true);
+            std::memcpy(entry.send_key.data(), key.data(), kSessionKeySize);
+            OPENSSL_cleanse(key.data(), key.size());
+            if (!entry.send) return false;
+            entry.counter = 0;
+            wrapped_key = entry.wrapped_send_key;
+            return true;
+        }
+
+        // Installs the peer's sending key from its wrapped form; replaces an earlier one.
+        bool accept_session(const std::string& peer, const std::vector<unsigned char>& wrapped_key) {
+            if (!private_key_) return false;
+            std::vector<unsigned char> key;
+            if (!crypto_.rsa_decrypt(private_key_.get(), wrapped_key, key)) return false;
+            bool ok = key.size() == kSessionKeySize;
+            std::optional<GcmKey> receive;
+            if (ok) receive = GcmKey::create(key.data(), false);
+            if (!receive) {
+                OPENSSL_cleanse(key.data(), key.size());
+                return false;
+            }
+            auto& entry = peers_[peer];
+            entry.receive = std::move(receive);
+            std::memcpy(entry.receive_key.data(), key.data(), kSessionKeySize);
+            OPENSSL_cleanse(key.data(), key.size());
+            return true;
+        }
+
+        bool can_encrypt(const std::string& peer) const {
+            auto it = peers_.find(peer);
+            return it != peers_.end() && it->second.send.has_value();
+        }
+        bool can_decrypt(const std::string& peer) const {
+            auto it = peers_.find(peer);
+            return it != peers_.end() && it->second.receive.has_value();
+        }
+
+        // Seals into `sealed`, which must hold plaintext.size() + kSealOverhead bytes, so
+        // the caller can point it into the payload of an outgoing frame.
+        bool encrypt(const std::string& peer, std::span<const unsigned char> plaintext, std::span<unsigned char> sealed) {
+            auto it = peers_.find(peer);
+            if (it == peers_.end() || !it->second.send) return false;
+            if (sealed.size() != plaintext.size() + kSealOverhead) return false;
+            auto& entry = it->second;
+            if (entry.counter == UINT64_MAX) return false;       // never reuse a nonce
+            std::array<unsigned char, kNonceSize> nonce;
+            make_nonce(entry.nonce_prefix, entry.counter++, nonce.data());
+            return entry.send->seal(nonce.data(), plaintext.data(), plaintext.size(), sealed.data());
+        }
+        bool encrypt(const std::string& peer, const std::vector<unsigned char>& plaintext, std::vector<unsigned char>& sealed) {
+            sealed.resize(plaintext.size() + kSealOverhead);
+            return encrypt(peer, std::span<const unsigned char>(plaintext), std::span<unsigned char>(sealed));
+        }
+
+        // Opens into `plaintext`, which must hold sealed.size() - kSealOverhead bytes.
+        bool decrypt(const std::string& peer, std::span<const unsigned char> sealed, std::span<unsigned char> plaintext) {
+            auto it = peers_.find(peer);
+            if (it == peers_.end() || !it->second.receive || sealed.size() < kSealOverhead) return false;
+            if (plaintext.size() != sealed.size() - kSealOverhead) return false;
+            return it->second.receive->open(sealed.data(), sealed.size(), plaintext.data());
+        }
+        bool decrypt(const std::string& peer, const std::vector<unsigned char>& sealed, std::vector<unsigned char>& plaintext) {
+            if (sealed.size() < kSealOverhead) return false;
+            plaintext.resize(sealed.size() - kSealOverhead);
+            return decrypt(peer, std::span<const unsigned char>(sealed), std::span<unsigned char>(plaintext));
+        }
+
+        // What a BatchCipher needs to seal `count` messages to `peer` off this thread. The
+        // counters are reserved here, so they never overlap those of encrypt().
+        struct SendBatch {
+            SessionKey key;
+            NoncePrefix nonce_prefix;
+            std::uint64_t first_counter;
+        };
+        std::optional<SendBatch> reserve_send_batch(const std::string& peer, std::size_t count) {
+            auto it = peers_.find(peer);
+            if (it == peers_.end() || !it->second.send) return std::nullopt;
+            auto& entry = it->second;
+            if (count > UINT64_MAX - entry.counter) return std::nullopt;
+            SendBatch batch{entry.send_key, entry.nonce_prefix, entry.counter};
+            entry.counter += count;
+            return batch;
+        }
+
+        // The peer's sending key, for opening a backlog from it with a BatchCipher.
+        std::optional<SessionKey> receive_key(const std::string& peer) const {
+            auto it = peers_.find(peer);
+            if (it == peers_.end() || !it->second.receive) return std::nullopt;
+            return it->second.receive_key;
+        }
+
+        // Drops our sending key but keeps the peer's public key, so the next begin_session
+        // makes and wraps a fresh one without the PEM; for a peer that lost our key.
+        void end_sending(const std::string& peer) {
+            auto it = peers_.find(peer);
+            if (it == peers_.end()) return;
+            it->second.send.reset();
+            OPENSSL_cleanse(it->second.send_key.data(), it->second.send_key.size());
+        }
+
+        // Drops both directions, e.g. when the peer publishes a new public key.
+        void forget(const std::string& peer) { peers_.erase(peer); }
+
+        // Call with every public key fetched for the peer. If it is not the one our
+        // sending key was wrapped for, the peer has a new key pair and cannot open
+        // anything of the old session: both directions are forgotten and true returned.
+        bool public_key_changed(const std::string& peer, const std::string& peer_pub_pem) {
+            auto it = peers_.find(peer);
+            if (it == peers_.end() || !it->second.public_key || it->second.public_pem == peer_pub_pem) return false;
+            forget(peer);
+            return true;
+        }
+
+    private:
+        struct Peer {
+            PkeyPtr public_key;
+            std::string public_pem;
+            std::optional<GcmKey> send;
+            std::optional<GcmKey> receive;
+            std::vector<unsigned char> wrapped_send_key;
+            NoncePrefix nonce_prefix{};
+            std::uint64_t counter = 0;
+            SessionKey send_key{};
+            SessionKey receive_key{};
+
+            ~Peer() {
+                OPENSSL_cleanse(send_key.data(), send_key.size());
+                OPENSSL_cleanse(receive_key.data(), receive_key.size());
+            }
+        };
+
+        Crypto crypto_;
+        PkeyPtr private_key_;
+        std::unordered_map<std::string, Peer> peers_;
+    };
+} // CPCDMessenger
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <type_traits>
+#include <utility>
+#include "SlabPool.h"
+
+namespace CPCDMessenger::Memory {
+    // Gives a completion handler the slab pool as its associated allocator, so asio
+    // takes the memory for the operation that carries it (reactor ops, posted functions)
+    // from the pool instead of the heap. Asio's own per-thread cache only keeps a couple
+    // of blocks and misses once reads, writes and posts of different sizes interleave.
+    template<typename Handler>
+    class PooledHandler {
+    public:
+        using allocator_type = SlabAllocator<void>;
+
+        explicit PooledHandler(Handler handler) : handler_(std::move(handler)) {}
+
+        allocator_type get_allocator() const noexcept { return {}; }
+
+        template<typename... Args>
+        void operator()(Args&&... args) {
+            handler_(std::forward<Args>(args)...);
+        }
+
+    private:
+        Handler handler_;
+    };
+
+    template<typename Handler>
+    PooledHandler<std::decay_t<Handler>> pooled(Handler&& handler) {
+        return PooledHandler<std::decay_t<Handler>>(std::forward<Handler>(handler));
+    }
+} // CPCDMessenger::Memory
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace CPCDMessenger::Memory {
+    // Size-class allocator for per-message objects. Blocks of 64 B .. 64 KiB are carved
+    // out of slabs and recycled through a per-thread cache, so steady-state routing does
+    // not touch the heap. A thread whose cache overflows (it frees more than it allocates,
+    // like a mailbox consumer) hands a batch to a shared depot; a thread that runs dry
+    // takes a batch back. Slabs are kept for the life of the process. Larger requests go
+    // straight to operator new.
+    class SlabPool {
+    public:
+        static constexpr std::size_t kMinBlock = 64;
+        static constexpr std::size_t kClasses = 11;          // 64 B << 0..10
+        static constexpr std::size_t kMaxBlock = kMinBlock << (kClasses - 1);
+        static constexpr std::size_t kBatch = 32;            // blocks moved to/from the depot at once
+        static constexpr std::size_t kSlabBytes = 256 * 1024;
+
+        static void* allocate(std::size_t bytes) {
+            if (bytes > kMaxBlock) return ::operator new(bytes);
+            std::size_t c = size_class(bytes);
+            auto& cache = local();
+            auto& list = cache.lists[c];
+            if (!list.head) refill(list, c);
+            FreeBlock* block = list.head;
+            list.head = block->next;
+            --list.count;
+            return block;
+        }
+
+        static void deallocate(void* p, std::size_t bytes) noexcept {
+            if (bytes > kMaxBlock) {
+                ::operator delete(p);
+                return;
+            }
+            std::size_t c = size_class(bytes);
+            auto& list = local().lists[c];
+            auto* block = static_cast<FreeBlock*>(p);
+            block->next = list.head;
+            list.head = block;
+            if (++list.count >= 2 * kBatch) spill(list, c);
+        }
+
+    private:
+        struct FreeBlock {
+            FreeBlock* next;
+        };
+
+        struct FreeList {
+            FreeBlock* head = nullptr;
+            std::size_t count = 0;
+        };
+
+        struct Depot {
+            std::mutex mutex;
+            std::vector<FreeBlock*> batches;                 // each a kBatch-long chain
+        };
+
+        struct ThreadCache {
+            std::array<FreeList, kClasses> lists{};
+
+            // A dying thread returns what it holds, in whole batches plus one short chain.
+            ~ThreadCache() {
+                for (std::size_t c = 0; c < kClasses; ++c) {
+                    auto& list = lists[c];
+                    if (!list.head) continue;
+                    std::lock_guard<std::mutex> lk(depots()[c].mutex);
+                    depots()[c].batches.push_back(list.head);
+                }
+            }
+        };
+
+        static std::size_t size_class(std::size_t bytes) {
+            return bytes <= kMinBlock ? 0 : static_cast<std::size_t>(std::bit_width((bytes - 1) / kMinBlock));
+        }
+
+        static ThreadCache& local() {
+            thread_local ThreadCache cache;
+            return cache;
+        }
+
+        // Never destroyed: thread caches may still return blocks during shutdown.
+        static std::array<Depot, kClasses>& depots() {
+            static auto* d = new std::array<Depot, kClasses>();
+            return *d;
+        }
+
+        static void refill(FreeList& list, std::size_t c) {
+            {
+                auto& depot = depots()[c];
+                std::lock_guard<std::mutex> lk(depot.mutex);
+                if (!depot.batches.empty()) {
+                    list.head = depot.batches.back();
+                    depot.batches.pop_back();
+                    list.count = 0;
+                    for (auto* b = list.head; b; b = b->next) ++list.count;
+                    return;
+                }
+            }
+            std::size_t block = kMinBlock << c;
+            std::size_t blocks = std::max<std::size_t>(1, kSlabBytes / block);
+            auto* slab = static_cast<char*>(::operator new(block * blocks));
+            for (std::size_t i = blocks; i-- > 0;) {
+                auto* b = reinterpret_cast<FreeBlock*>(slab + i * block);
+                b->next = list.head;
+                list.head = b;
+            }
+            list.count = blocks;
+        }
+
+        static void spill(FreeList& list, std::size_t c) {
+            FreeBlock* batch = list.head;
+            FreeBlock* tail = batch;
+            for (std::size_t i = 1; i < kBatch; ++i) tail = tail->next;
+            list.head = tail->next;
+            tail->next = nullptr;
+            list.count -= kBatch;
+            auto& depot = depots()[c];
+            std::lock_guard<std::mutex> lk(depot.mutex);
+            depot.batches.push_back(batch);
+        }
+    };
+
+    template<typename T>
+    class SlabAllocator {
+    public:
+        using value_type = T;
+
+        SlabAllocator() noexcept = default;
+        template<typename U>
+        SlabAllocator(const SlabAllocator<U>&) noexcept {}
+
+        T* allocate(std::size_t n) {
+            static_assert(alignof(T) <= alignof(std::max_align_t), "slab blocks are max_align_t aligned");
+            return static_cast<T*>(SlabPool::allocate(n * sizeof(T)));
+        }
+
+        void deallocate(T* p, std::size_t n) noexcept {
+            SlabPool::deallocate(p, n * sizeof(T));
+        }
+
+        template<typename U>
+        bool operator==(const SlabAllocator<U>&) const noexcept { return true; }
+    };
+
+    using PooledString = std::basic_string<char, std::char_traits<char>, SlabAllocator<char>>;
+} // CPCDMessenger::Memory
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <iostream>
+#include <memory>
+#include <string>
+#include "RelayMetrics.h"
+
+namespace CPCDMessenger {
+    // Minimal HTTP/1.0 listener serving GET /metrics for scrapers. It lives on one of the
+    // relay's io_contexts; a scrape only merges the per-thread slots and never touches
+    // session state, so it does not contend with message handling.
+    class MetricsEndpoint {
+    public:
+        MetricsEndpoint(boost::asio::io_context& ioc, const boost::asio::ip::tcp::endpoint& endpoint, const RelayMetrics& metrics)
+        : acceptor_(ioc, endpoint),
+          metrics_(metrics)
+        {
+            do_accept();
+        }
+
+        unsigned short port() const { return acceptor_.local_endpoint().port(); }
+
+    private:
+        static constexpr std::size_t kMaxRequestBytes = 8 * 1024;
+
+        struct Connection {
+            explicit Connection(boost::asio::ip::tcp::socket s) : socket(std::move(s)) {}
+            boost::asio::ip::tcp::socket socket;
+            boost::asio::streambuf request{kMaxRequestBytes};
+            std::string response;
+        };
+
+        void do_accept() {
+            acceptor_.async_accept([this](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
+                if (!ec) {
+                    serve(std::make_shared<Connection>(std::move(socket)));
+                } else {
+                    std::cerr << "Metrics accept error: " << ec.message() << "\n";
+                }
+                do_accept();
+            });
+        }
+
+        void serve(std::shared_ptr<Connection> conn) {
+            boost::asio::async_read_until(conn->socket, conn->request, "\r\n\r\n",
+                [this, conn](boost::system::error_code ec, std::size_t) {
+                    if (ec) return;
+                    std::istream is(&conn->request);
+                    std::string method, target;
+                    is >> method >> target;
+                    if (method == "GET" && (target == "/metrics" || target.rfind("/metrics?", 0) == 0)) {
+                        conn->response = reply("200 OK", "text/plain; version=0.0.4", metrics_.render());
+                    } else {
+                        conn->response = reply("404 Not Found", "text/plain", "not found\n");
+                    }
+                    boost::asio::async_write(conn->socket, boost::asio::buffer(conn->response),
+                        [conn](boost::system::error_code, std::size_t) {
+                            boost::system::error_code ignored;
+                            conn->socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+                        });
+                });
+        }
+
+        static std::string reply(const char* status, const char* content_type, const std::string& body) {
+            return std::string("HTTP/1.0 ") + status + "\r\n"
+                   "Content-Type: " + content_type + "\r\n"
+                   "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                   "Connection: close\r\n\r\n" + body;
+        }
+
+        boost::asio::ip::tcp::acceptor acceptor_;
+        const RelayMetrics& metrics_;
+    };
+} // CPCDMessenger
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string>
+
+namespace CPCDMessenger {
+    enum class Counter : std::size_t {
+        SessionsAccepted,
+        SessionsClosed,
+        Logins,
+        MessagesRouted,        // handed to an online session, channel fan-out included
+        MessagesStored,        // queued in the offline store
+        MessagesDeferred,      // stored because the recipient was stalled
+        ChannelPosts,
+        ChannelPostsDeferred,  // member copies stored because the member was stalled
+        BytesIn,
+        BytesOut,
+        ParseErrors,
+        WriteBatches,
+        WriteBatchMessages,
+        StallEvents,
+        Count
+    };
+
+    // Up/down values; every slot keeps its own delta and the sum is the gauge.
+    enum class Gauge : std::size_t {
+        OpenSessions,
+        StalledSessions,       // currently over their high watermark
+        Count
+    };
+
+    enum class Histogram : std::size_t {
+        WriteQueueDepth,       // frames queued when a write starts
+        WriteBatchBytes,       // bytes per gathered write
+        Count
+    };
+
+    // Relay counters sharded per thread. Each thread picks a cache-line aligned slot on
+    // first use and only ever bumps that slot, so the hot path is an uncontended relaxed
+    // add; readers merge all slots when they scrape.
+    class RelayMetrics {
+    public:
+        static constexpr std::size_t kSlots = 64;
+        // Power-of-two buckets: le 1, 2, 4 ... 2^(kBuckets-2), then +Inf.
+        static constexpr std::size_t kBuckets = 24;
+
+        void add(Counter counter, std::uint64_t n = 1) {
+            local().counters[index(counter)].fetch_add(n, std::memory_order_relaxed);
+        }
+
+        void adjust(Gauge gauge, std::int64_t delta) {
+            local().gauges[index(gauge)].fetch_add(delta, std::memory_order_relaxed);
+        }
+
+        void observe(Histogram histogram, std::uint64_t value) {
+            auto& h = local().histograms[index(histogram)];
+            h.buckets[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+            h.sum.fetch_add(value, std::memory_order_relaxed);
+        }
+
+        void record_write_batch(std::size_t messages, std::size_t bytes) {
+            add(Counter::WriteBatches);
+            add(Counter::WriteBatchMessages, messages);
+            observe(Histogram::WriteBatchBytes, bytes);
+        }
+
+        std::uint64_t total(Counter counter) const {
+            std::uint64_t sum = 0;
+            for (const auto& slot : slots_) sum += slot.counters[index(counter)].load(std::memory_order_relaxed);
+            return sum;
+        }
+
+        std::int64_t value(Gauge gauge) const {
+            std::int64_t sum = 0;
+            for (const auto& slot : slots_) sum += slot.gauges[index(gauge)].load(std::memory_order_relaxed);
+            return sum;
+        }
+
+        // Messages per async_write, i.e. how much each syscall coalesces.
+        double average_write_batch() const {
+            auto batches = total(Counter::WriteBatches);
+            return batches ? double(total(Counter::WriteBatchMessages)) / batches : 0.0;
+        }
+
+        // Prometheus text exposition format, version 0.0.4.
+        std::string render() const {
+            std::string out;
+            for (std::size_t i = 0; i < kCounters; ++i) {
+                auto counter = static_cast<Counter>(i);
+                append_header(out, counter_name(counter), "counter");
+                append_sample(out, counter_name(counter), "", std::to_string(total(counter)));
+            }
+            for (std::size_t i = 0; i < kGauges; ++i) {
+                auto gauge = static_cast<Gauge>(i);
+                append_header(out, gauge_name(gauge), "gauge");
+                append_sample(out, gauge_name(gauge), "", std::to_string(value(gauge)));
+            }
+            for (std::size_t i = 0; i < kHistograms; ++i) {
+                std::string name = histogram_name(static_cast<Histogram>(i));
+                std::array<std::uint64_t, kBuckets> buckets{};
+                std::uint64_t sum = 0;
+                for (const auto& slot : slots_) {
+                    const auto& h = slot.histograms[i];
+                    for (std::size_t b = 0; b < kBuckets; ++b) buckets[b] += h.buckets[b].load(std::memory_order_relaxed);
+                    sum += h.sum.load(std::memory_order_relaxed);
+                }
+                append_header(out, name, "histogram");
+                std::uint64_t cumulative = 0;
+                for (std::size_t b = 0; b < kBuckets; ++b) {
+                    cumulative += buckets[b];
+                    std::string le = b + 1 == kBuckets ? "+Inf" : std::to_string(std::uint64_t{1} << b);
+                    append_sample(out, name + "_bucket", "{le=\"" + le + "\"}", std::to_string(cumulative));
+                }
+                append_sample(out, name + "_sum", "", std::to_string(sum));
+                append_sample(out, name + "_count", "", std::to_string(cumulative));
+            }
+            return out;
+        }
+
+    private:
+        static constexpr std::size_t kCounters = static_cast<std::size_t>(Counter::Count);
+        static constexpr std::size_t kGauges = static_cast<std::size_t>(Gauge::Count);
+        static constexpr std::size_t kHistograms = static_cast<std::size_t>(Histogram::Count);
+
+        struct HistogramCells {
+            std::array<std::atomic<std::uint64_t>, kBuckets> buckets{};
+            std::atomic<std::uint64_t> sum{0};
+        };
+
+        struct alignas(64) Slot {
+            std::array<std::atomic<std::uint64_t>, kCounters> counters{};
+            std::array<std::atomic<std::int64_t>, kGauges> gauges{};
+            std::array<HistogramCells, kHistograms> histograms{};
+        };
+
+        template<typename E>
+        static constexpr std::size_t index(E e) { return static_cast<std::size_t>(e); }
+
+        static std::size_t bucket(std::uint64_t value) {
+            std::size_t b = 0;
+            while (b + 1 < kBuckets && (std::uint64_t{1} << b) < value) ++b;
+            return b;
+        }
+
+        // Slots are handed out round-robin per thread and shared by all instances; with
+        // more than kSlots threads two threads share a slot, which stays correct.
+        Slot& local() {
+            static std::atomic<std::size_t> next_slot{0};
+            thread_local std::size_t slot = next_slot.fetch_add(1, std::memory_order_relaxed) % kSlots;
+            return slots_[slot];
+        }
+
+        static const char* counter_name(Counter counter) {
+            static constexpr const char* names[] = {
+                "relay_sessions_accepted_total",
+                "relay_sessions_closed_total",
+                "relay_logins_total",
+                "relay_messages_routed_total",
+                "relay_messages_stored_total",
+                "relay_messages_deferred_total",
+                "relay_channel_posts_total",
+                "relay_channel_posts_deferred_total",
+                "relay_bytes_in_total",
+                "relay_bytes_out_total",
+                "relay_parse_errors_total",
+                "relay_write_batches_total",
+                "relay_write_batch_messages_total",
+                "relay_stall_events_total",
+            };
+            static_assert(std::size(names) == kCounters);
+            return names[index(counter)];
+        }
+
+        static const char* gauge_name(Gauge gauge) {
+            static constexpr const char* names[] = {
+                "relay_open_sessions",
+                "relay_stalled_sessions",
+            };
+            static_assert(std::size(names) == kGauges);
+            return names[index(gauge)];
+        }
+
+        static const char* histogram_name(Histogram histogram) {
+            static constexpr const char* names[] = {
+                "relay_write_queue_depth",
+                "relay_write_batch_bytes",
+            };
+            static_assert(std::size(names) == kHistograms);
+            return names[index(histogram)];
+        }
+
+        static void append_header(std::string& out, const std::string& name, const char* type) {
+            out += "# TYPE " + name + " " + type + "\n";
+        }
+
+        static void append_sample(std::string& out, const std::string& name, const std::string& labels, const std::string& value) {
+            out += name + labels + " " + value + "\n";
+        }
+
+        std::array<Slot, kSlots> slots_{};
+    };
+} // CPCDMessenger
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace CPCDMessenger::Protocol {
+    // Standard alphabet with padding. Only the JSON line protocol needs it, for binary
+    // bodies sent to clients that did not switch to frames.
+    inline std::string base64_encode(std::string_view in) {
+        static constexpr char kAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        auto* p = reinterpret_cast<const unsigned char*>(in.data());
+        std::size_t n = in.size();
+        std::string out;
+        out.reserve((n + 2) / 3 * 4);
+        std::size_t i = 0;
+        for (; i + 3 <= n; i += 3) {
+            unsigned v = (unsigned(p[i]) << 16) | (unsigned(p[i + 1]) << 8) | p[i + 2];
+            out += kAlphabet[v >> 18];
+            out += kAlphabet[(v >> 12) & 63];
+            out += kAlphabet[(v >> 6) & 63];
+            out += kAlphabet[v & 63];
+        }
+        if (i < n) {
+            unsigned v = unsigned(p[i]) << 16;
+            if (i + 1 < n) v |= unsigned(p[i + 1]) << 8;
+            out += kAlphabet[v >> 18];
+            out += kAlphabet[(v >> 12) & 63];
+            out += i + 1 < n ? kAlphabet[(v >> 6) & 63] : '=';
+            out += '=';
+        }
+        return out;
+    }
+} // CPCDMessenger::Protocol
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string_view>
+
+namespace CPCDMessenger::Protocol {
+    // Routing fields of a command, as views into the scanned text.
+    struct ScannedCommand {
+        std::optional<std::string_view> cmd;
+        std::optional<std::string_view> to;
+        std::optional<std::string_view> channel;
+        std::optional<std::string_view> body;
+    };
+
+    namespace detail {
+        // Length of the UTF-8 sequence starting at p (lead byte >= 0x80), 0 if malformed.
+        inline std::size_t utf8_sequence(const unsigned char* p, const unsigned char* end) {
+            auto cont = [&](std::size_t i, unsigned char lo = 0x80, unsigned char hi = 0xBF) {
+                return p + i < end && p[i] >= lo && p[i] <= hi;
+            };
+            unsigned char c = p[0];
+            if (c >= 0xC2 && c <= 0xDF) return cont(1) ? 2 : 0;
+            if (c == 0xE0) return cont(1, 0xA0) && cont(2) ? 3 : 0;
+            if (c == 0xED) return cont(1, 0x80, 0x9F) && cont(2) ? 3 : 0;
+            if (c >= 0xE1 && c <= 0xEF) return cont(1) && cont(2) ? 3 : 0;
+            if (c == 0xF0) return cont(1, 0x90) && cont(2) && cont(3) ? 4 : 0;
+            if (c >= 0xF1 && c <= 0xF3) return cont(1) && cont(2) && cont(3) ? 4 : 0;
+            if (c == 0xF4) return cont(1, 0x80, 0x8F) && cont(2) && cont(3) ? 4 : 0;
+            return 0;
+        }
+
+        // Skips eight bytes at a time while none of them is a quote, a backslash, a control
+        // character or non-ASCII; those are left to the byte-wise loops.
+        inline const unsigned char* skip_plain_ascii(const unsigned char* p, const unsigned char* end) {
+            constexpr std::uint64_t ones = 0x0101010101010101ull;
+            constexpr std::uint64_t highs = 0x8080808080808080ull;
+            while (end - p >= 8) {
+                std::uint64_t w;
+                std::memcpy(&w, p, 8);
+                std::uint64_t quote = w ^ (ones * '"');
+                std::uint64_t slash = w ^ (ones * '\\');
+                std::uint64_t special = ((quote - ones) & ~quote) | ((slash - ones) & ~slash) | ((w - ones * 0x20) & ~w) | w;
+                if (special & highs) break;
+                p += 8;
+            }
+            return p;
+        }
+
+        // Scans the contents of a string literal starting after its opening quote, up to
+        // the closing quote. Fails on anything that would need escaping or decoding:
+        // backslashes, control characters and malformed UTF-8.
+        inline std::optional<std::string_view> plain_string(std::string_view text, std::size_t& pos) {
+            auto* begin = reinterpret_cast<const unsigned char*>(text.data());
+            auto* end = begin + text.size();
+            auto* p = begin + pos;
+            auto* start = p;
+            while (p < end) {
+                p = skip_plain_ascii(p, end);
+                if (p == end) break;
+                unsigned char c = *p;
+                if (c == '"') {
+                    pos = static_cast<std::size_t>(p - begin) + 1;
+                    return text.substr(static_cast<std::size_t>(start - begin), static_cast<std::size_t>(p - start));
+                }
+                if (c == '\\' || c < 0x20) return std::nullopt;
+                if (c < 0x80) {
+                    ++p;
+                    continue;
+                }
+                std::size_t n = utf8_sequence(p, end);
+                if (n == 0) return std::nullopt;
+                p += n;
+            }
+            return std::nullopt;
+        }
+
+        inline void skip_ws(std::string_view text, std::size_t& pos) {
+            while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r')) ++pos;
+        }
+    } // detail
+
+    // True when `s` can be written between two quotes as a JSON string unchanged, i.e. the
+    // serializer would copy it byte for byte.
+    inline bool is_plain_json_string(std::string_view s) {
+        auto* p = reinterpret_cast<const unsigned char*>(s.data());
+        auto* end = p + s.size();
+        while (p < end) {
+            p = detail::skip_plain_ascii(p, end);
+            if (p == end) break;
+            unsigned char c = *p;
+            if (c == '"' || c == '\\' || c < 0x20) return false;
+            if (c < 0x80) {
+                ++p;
+                continue;
+            }
+            std::size_t n = detail::utf8_sequence(p, end);
+            if (n == 0) return false;
+            p += n;
+        }
+        return true;
+    }
+
+    // Fast path for the hot commands. Accepts only a flat object whose values are all
+    // plain strings, without repeated routing keys; anything else, including input that
+    // may be invalid, returns nullopt and goes through the full JSON parser, which
+    // stays the authority on errors. Unknown keys are skipped, as the DOM path ignores them.
+    inline std::optional<ScannedCommand> scan_command(std::string_view text) {
+        ScannedCommand out;
+        std::size_t pos = 0;
+        detail::skip_ws(text, pos);
+        if (pos >= text.size() || text[pos++] != '{') return std::nullopt;
+        detail::skip_ws(text, pos);
+        if (pos < text.size() && text[pos] == '}') return std::nullopt;
+        while (true) {
+            if (pos >= text.size() || text[pos++] != '"') return std::nullopt;
+            auto key = detail::plain_string(text, pos);
+            if (!key) return std::nullopt;
+            detail::skip_ws(text, pos);
+            if (pos >= text.size() || text[pos++] != ':') return std::nullopt;
+            detail::skip_ws(text, pos);
+            if (pos >= text.size() || text[pos++] != '"') return std::nullopt;
+            auto value = detail::plain_string(text, pos);
+            if (!value) return std::nullopt;
+
+            std::optional<std::string_view>* field = nullptr;
+            if (*key == "cmd") field = &out.cmd;
+            else if (*key == "to") field = &out.to;
+            else if (*key == "channel") field = &out.channel;
+            else if (*key == "body") field = &out.body;
+            if (field) {
+                if (*field) return std::nullopt;
+                *field = value;
+            }
+
+            detail::skip_ws(text, pos);
+            if (pos >= text.size()) return std::nullopt;
+            char c = text[pos++];
+            if (c == '}') break;
+            if (c != ',') return std::nullopt;
+            detail::skip_ws(text, pos);
+        }
+        detail::skip_ws(text, pos);
+        if (pos != text.size()) return std::nullopt;
+        return out;
+    }
+} // CPCDMessenger::Protocol
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace CPCDMessenger::Protocol {
+    // Binary framing is negotiated with {"cmd":"hello","framing":"binary"}; after the
+    // server answers hello_ok both directions switch from JSON lines to frames.
+    //
+    // Header, 12 bytes, network byte order:
+    //   u32 length  payload size (header excluded)
+    //   u16 type    FrameType
+    //   u16 flags   reserved, zero
+    //   u32 peer    recipient id (client -> server), sender id (server -> client)
+    enum class FrameType : std::uint16_t {
+        Json        = 0,   // payload is a JSON command/response, same schema as the line protocol
+        Msg         = 1,   // payload is a raw message body
+        ChannelPost = 2,   // peer is a channel id; server -> client payload is u32 sender id + body
+        KeyExchange = 3,   // routed like Msg; payload is an RSA-wrapped session key, empty asks the peer to resend its key
+        Cipher      = 4,   // routed like Msg; payload is an AES-GCM sealed body the relay never looks into
+        FileOffer   = 5,   // file transfer, see Transfer/FileTransfer.h; forwarded to an online
+        FileChunk   = 6,   // recipient only, never stored, and the relay reads nothing
+        FileAck     = 7,   // but the leading u32 transfer id
+        ChunkQuery  = 8,   // attachment chunks, client <-> relay only, see Transfer/Attachment.h
+        ChunkPut    = 9,
+        ChunkGet    = 10,
+        Attachment  = 11,  // routed like Cipher; payload is a sealed attachment manifest
+    };
+
+    enum class Framing : std::uint8_t { JsonLines, Binary };
+
+    constexpr std::size_t   kFrameHeaderSize = 12;
+    constexpr std::uint32_t kMaxFramePayload = 16 * 1024 * 1024;
+    constexpr std::uint32_t kNoPeer = 0xFFFFFFFFu;
+
+    inline void put_u16(char* p, std::uint16_t v) {
+        p[0] = static_cast<char>(v >> 8);
+        p[1] = static_cast<char>(v);
+    }
+    inline void put_u32(char* p, std::uint32_t v) {
+        p[0] = static_cast<char>(v >> 24);
+        p[1] = static_cast<char>(v >> 16);
+        p[2] = static_cast<char>(v >> 8);
+        p[3] = static_cast<char>(v);
+    }
+    inline void put_u64(char* p, std::uint64_t v) {
+        put_u32(p, static_cast<std::uint32_t>(v >> 32));
+        put_u32(p + 4, static_cast<std::uint32_t>(v));
+    }
+    inline std::uint16_t get_u16(const char* p) {
+        auto u = reinterpret_cast<const unsigned char*>(p);
+        return static_cast<std::uint16_t>((u[0] << 8) | u[1]);
+    }
+    inline std::uint32_t get_u32(const char* p) {
+        auto u = reinterpret_cast<const unsigned char*>(p);
+        return (std::uint32_t(u[0]) << 24) | (std::uint32_t(u[1]) << 16) | (std::uint32_t(u[2]) << 8) | u[3];
+    }
+    inline std::uint64_t get_u64(const char* p) {
+        return (std::uint64_t(get_u32(p)) << 32) | get_u32(p + 4);
+    }
+
+    struct FrameHeader {
+        std::uint32_t length = 0;
+        FrameType     type = FrameType::Json;
+        std::uint16_t flags = 0;
+        std::uint32_t peer = kNoPeer;
+
+        void encode(char* out) const {
+            put_u32(out, length);
+            put_u16(out + 4, static_cast<std::uint16_t>(type));
+            put_u16(out + 6, flags);
+            put_u32(out + 8, peer);
+        }
+
+        static FrameHeader decode(const char* in) {
+            FrameHeader h;
+            h.length = get_u32(in);
+            h.type = static_cast<FrameType>(get_u16(in + 4));
+            h.flags = get_u16(in + 6);
+            h.peer = get_u32(in + 8);
+            return h;
+        }
+    };
+
+    // Appends a header for `length` payload bytes; the caller appends the payload.
+    template<typename String>
+    void append_frame_header(String& out, FrameType type, std::uint32_t peer, std::size_t length) {
+        char header[kFrameHeaderSize];
+        FrameHeader h;
+        h.length = static_cast<std::uint32_t>(length);
+        h.type = type;
+        h.peer = peer;
+        h.encode(header);
+        out.append(header, kFrameHeaderSize);
+    }
+
+    inline std::string make_frame(FrameType type, std::uint32_t peer, std::string_view payload) {
+        std::string out;
+        out.reserve(kFrameHeaderSize + payload.size());
+        append_frame_header(out, type, peer, payload.size());
+        out.append(payload);
+        return out;
+    }
+} // CPCDMessenger::Protocol
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <nlohmann/json.hpp>
+#include "Base64.h"
+#include "Frame.h"
+#include "CommandScanner.h"
+#include "../Memory/SlabPool.h"
+
+namespace CPCDMessenger::Protocol {
+    // Immutable wire bytes; every write queue that sends them holds a reference. Bytes and
+    // control block both come from the slab pool.
+    using FrameBytes = Memory::PooledString;
+    using SharedFrame = std::shared_ptr<const FrameBytes>;
+
+    inline SharedFrame make_shared_frame(FrameBytes bytes) {
+        return std::allocate_shared<const FrameBytes>(Memory::SlabAllocator<FrameBytes>{}, std::move(bytes));
+    }
+
+    inline SharedFrame make_shared_frame(std::string_view bytes) {
+        return make_shared_frame(FrameBytes(bytes));
+    }
+
+    // A message on its way through the relay. The wire encoding is produced on first
+    // use, at most once per framing, and then shared by every recipient using that
+    // framing, so fan-out and replay cost one serialization however many sessions
+    // receive it.
+    class RoutedMessage {
+    public:
+        // Names must outlive the message; NameDirectory entries never move. Direct
+        // messages keep the frame type they arrived with (Msg, KeyExchange, Cipher,
+        // Attachment or a file transfer frame, which only ever goes to binary sessions).
+        RoutedMessage(std::uint32_t from, std::string_view from_name, std::string_view body,
+                      std::uint32_t channel = kNoPeer, std::string_view channel_name = {},
+                      FrameType type = FrameType::Msg)
+        : from_(from),
+          channel_(channel),
+          type_(type),
+          from_name_(from_name),
+          channel_name_(channel_name),
+          body_(body)
+        {}
+
+        std::uint32_t from() const { return from_; }
+        std::uint32_t channel() const { return channel_; }
+        FrameType type() const { return type_; }
+        std::string_view from_name() const { return from_name_; }
+        std::string_view body() const { return body_; }
+
+        const SharedFrame& encoded(Framing framing) const {
+            auto i = static_cast<std::size_t>(framing);
+            std::call_once(once_[i], [&] { frames_[i] = make_shared_frame(encode(framing)); });
+            return frames_[i];
+        }
+
+    private:
+        FrameBytes encode(Framing framing) const {
+            FrameBytes s;
+            if (framing == Framing::Binary) {
+                if (channel_ == kNoPeer) {
+                    s.reserve(kFrameHeaderSize + body_.size());
+                    append_frame_header(s, type_, from_, body_.size());
+                } else {
+                    char from[4];
+                    put_u32(from, from_);
+                    s.reserve(kFrameHeaderSize + 4 + body_.size());
+                    append_frame_header(s, FrameType::ChannelPost, channel_, 4 + body_.size());
+                    s.append(from, 4);
+                }
+                s.append(body_);
+                return s;
+            }
+            // Binary bodies reach line-protocol clients base64-encoded.
+            if (type_ != FrameType::Msg && channel_ == kNoPeer) {
+                const char* type = type_ == FrameType::Cipher ? "cipher"
+                                 : type_ == FrameType::Attachment ? "attachment" : "key_exchange";
+                nlohmann::json j = { {"type", type},
+                                     {"from", from_name_}, {"from_id", from_}, {"body", base64_encode(body_)} };
+                std::string dumped = j.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+                s.assign(dumped);
+                s.push_back('\n');
+                return s;
+            }
+            // Same bytes the serializer would produce (keys in sorted order), copied straight
+            // from the body when nothing in it needs escaping.
+            if (is_plain_json_string(body_) && is_plain_json_string(from_name_) &&
+                (channel_ == kNoPeer || is_plain_json_string(channel_name_))) {
+                s.reserve(body_.size() + from_name_.size() + channel_name_.size() + 48);
+                s += R"({"body":")";
+                s += body_;
+                if (channel_ != kNoPeer) {
+                    s += R"(","channel":")";
+                    s += channel_name_;
+                }
+                s += R"(","from":")";
+                s += from_name_;
+                s += R"(","type":"msg"})";
+                s.push_back('\n');
+                return s;
+            }
+            nlohmann::json j = { {"type","msg"}, {"from", from_name_}, {"body", std::string_view(body_)} };
+            if (channel_ != kNoPeer) j["channel"] = channel_name_;
+            std::string dumped = j.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+            s.assign(dumped);
+            s.push_back('\n');
+            return s;
+        }
+
+        std::uint32_t from_;
+        std::uint32_t channel_;
+        FrameType type_;
+        std::string_view from_name_;
+        std::string_view channel_name_;
+        FrameBytes body_;
+
+        mutable std::array<std::once_flag, 2> once_;
+        mutable std::array<SharedFrame, 2> frames_;
+    };
+
+    using SharedMessage = std::shared_ptr<const RoutedMessage>;
+
+    template<typename... Args>
+    SharedMessage make_routed_message(Args&&... args) {
+        return std::allocate_shared<const RoutedMessage>(Memory::SlabAllocator<RoutedMessage>{}, std::forward<Args>(args)...);
+    }
+} // CPCDMessenger::Protocol
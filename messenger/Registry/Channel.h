@@ -0,0 +1,54 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "NameDirectory.h"
+
+namespace CPCDMessenger {
+    // Membership of one channel. Posts read an immutable sorted snapshot of the member
+    // ids; join/leave build a new snapshot under the channel mutex, so a fan-out in
+    // progress never blocks membership changes and never sees a half-updated set.
+    class Channel {
+    public:
+        using Members = std::vector<UserId>;
+
+        // nullptr while nobody ever joined.
+        std::shared_ptr<const Members> members() const {
+            return members_.load(std::memory_order_acquire);
+        }
+
+        bool join(UserId user) {
+            std::lock_guard<std::mutex> lk(mutex_);
+            auto current = members_.load(std::memory_order_relaxed);
+            auto next = current ? std::make_shared<Members>(*current) : std::make_shared<Members>();
+            auto it = std::lower_bound(next->begin(), next->end(), user);
+            if (it != next->end() && *it == user) return false;
+            next->insert(it, user);
+            members_.store(std::move(next), std::memory_order_release);
+            return true;
+        }
+
+        bool leave(UserId user) {
+            std::lock_guard<std::mutex> lk(mutex_);
+            auto current = members_.load(std::memory_order_relaxed);
+            if (!current || !contains(*current, user)) return false;
+            auto next = std::make_shared<Members>();
+            next->reserve(current->size() - 1);
+            std::copy_if(current->begin(), current->end(), std::back_inserter(*next),
+                         [user](UserId id) { return id != user; });
+            members_.store(std::move(next), std::memory_order_release);
+            return true;
+        }
+
+        static bool contains(const Members& members, UserId user) {
+            return std::binary_search(members.begin(), members.end(), user);
+        }
+
+    private:
+        std::mutex mutex_;
+        std::atomic<std::shared_ptr<const Members>> members_;
+    };
+} // CPCDMessenger
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include "NameDirectory.h"
+
+namespace CPCDMessenger {
+    // Public keys that users publish for end-to-end encryption, one PEM per UserId. The
+    // relay only stores and hands them out. Each key is mirrored to <dir>/<id>.pem so that
+    // a sender can still fetch the key of a user who is offline after a relay restart;
+    // clients republish on every login, so the files are not fsynced.
+    class KeyDirectory {
+    public:
+        static constexpr std::size_t kMaxKeyBytes = 16 * 1024;
+
+        explicit KeyDirectory(const std::filesystem::path& dir) : dir_(dir) {
+            std::filesystem::create_directories(dir_);
+            for (const auto& entry : std::filesystem::directory_iterator(dir_)) {
+                if (entry.path().extension() != ".pem") continue;
+                UserId user;
+                try {
+                    user = static_cast<UserId>(std::stoul(entry.path().stem().string()));
+                } catch (const std::exception&) {
+                    continue;
+                }
+                std::ifstream in(entry.path(), std::ios::binary);
+                std::string pem((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+                if (in.good() || in.eof()) keys_[user] = std::make_shared<const std::string>(std::move(pem));
+            }
+        }
+
+        // Only the in-memory entry; save() writes it out and belongs off the io threads.
+        void publish(UserId user, std::string pem) {
+            std::lock_guard<std::mutex> lk(mutex_);
+            keys_[user] = std::make_shared<const std::string>(std::move(pem));
+        }
+
+        std::shared_ptr<const std::string> find(UserId user) const {
+            std::lock_guard<std::mutex> lk(mutex_);
+            auto it = keys_.find(user);
+            return it == keys_.end() ? nullptr : it->second;
+        }
+
+        // Writes the current key through a temporary file, so a crash never leaves half a key.
+        bool save(UserId user) const {
+            auto pem = find(user);
+            if (!pem) return false;
+            auto path = dir_ / (std::to_string(user) + ".pem");
+            auto tmp = dir_ / (std::to_string(user) + ".pem.tmp");
+            {
+                std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+                out.write(pem->data(), static_cast<std::streamsize>(pem->size()));
+                if (!out) return false;
+            }
+            std::error_code ec;
+            std::filesystem::rename(tmp, path, ec);
+            return !ec;
+        }
+
+    private:
+        std::filesystem::path dir_;
+        mutable std::mutex mutex_;
+        std::unordered_map<UserId, std::shared_ptr<const std::string>> keys_;
+    };
+} // CPCDMessenger
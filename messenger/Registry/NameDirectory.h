@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include "ShardedRegistry.h"
+#include "StableArray.h"
+#include "../Protocol/Frame.h"
+#include "../Storage/SyncedFile.h"
+
+namespace CPCDMessenger {
+    using NameId = std::uint32_t;
+    using UserId = NameId;
+    using ChannelId = NameId;
+    constexpr NameId kInvalidId = 0xFFFFFFFFu;
+    constexpr UserId kInvalidUser = kInvalidId;
+
+    // Interning table: every name gets a dense 32-bit id the first time the relay
+    // sees it. Ids are never reused, so the name behind an id is immutable once published
+    // and can be read without locking. Users and channels each have their own table.
+    class NameDirectory {
+    public:
+        NameDirectory() = default;
+        NameDirectory(const NameDirectory&) = delete;
+        NameDirectory& operator=(const NameDirectory&) = delete;
+
+        ~NameDirectory() {
+            if (journal_) std::fclose(journal_);
+        }
+
+        NameId intern(const std::string& name) {
+            if (auto id = ids_.find(name)) return *id;
+
+            std::lock_guard<std::mutex> lk(intern_mutex_);
+            if (auto id = ids_.find(name)) return *id;
+            if (journal_) {
+                char len[4];
+                Protocol::put_u32(len, static_cast<std::uint32_t>(name.size()));
+                if (std::fwrite(len, 1, 4, journal_) != 4 ||
+                    std::fwrite(name.data(), 1, name.size(), journal_) != name.size()) {
+                    throw std::runtime_error("Failed to append to name journal");
+                }
+            }
+            return add_locked(name);
+        }
+
+        // Re-interns the names recorded in an append-only journal, in order, so ids stay
+        // stable across restarts (the offline store refers to users by id), then keeps
+        // appending every new name. Must be called before the first intern().
+        void open_journal(const std::filesystem::path& path) {
+            std::lock_guard<std::mutex> lk(intern_mutex_);
+            if (std::filesystem::exists(path)) {
+                std::FILE* in = open_file(path, "rb");
+                std::uintmax_t good = 0;
+                char len[4];
+                std::string name;
+                while (std::fread(len, 1, 4, in) == 4) {
+                    name.resize(Protocol::get_u32(len));
+                    if (std::fread(name.data(), 1, name.size(), in) != name.size()) break;
+                    add_locked(name);
+                    good += 4 + name.size();
+                }
+                std::fclose(in);
+                // Drop a record torn by a crash so new names append after a clean one.
+                if (std::filesystem::file_size(path) != good) std::filesystem::resize_file(path, good);
+            }
+            journal_ = open_file(path, "ab");
+        }
+
+        // The offline store calls this before syncing records that mention new ids.
+        bool sync_journal() {
+            std::lock_guard<std::mutex> lk(intern_mutex_);
+            return !journal_ || sync_file(journal_);
+        }
+
+        std::optional<NameId> find(const std::string& name) const {
+            return ids_.find(name);
+        }
+
+        // nullptr for ids that were never handed out.
+        const std::string* name(NameId id) const {
+            if (id >= count_.load(std::memory_order_acquire)) return nullptr;
+            return names_.get(id);
+        }
+
+        NameId size() const { return count_.load(std::memory_order_acquire); }
+
+    private:
+        NameId add_locked(const std::string& name) {
+            NameId id = count_.load(std::memory_order_relaxed);
+            if (id == kInvalidId) throw std::length_error("id space exhausted");
+            names_.ensure(id) = name;
+            count_.store(id + 1, std::memory_order_release);
+            ids_.insert_or_assign(name, id);
+            return id;
+        }
+
+        ShardedRegistry<NameId> ids_;
+        StableArray<std::string> names_;
+        std::atomic<NameId> count_{0};
+        std::mutex intern_mutex_;
+        std::FILE* journal_ = nullptr;
+    };
+
+    using UserDirectory = NameDirectory;
+    using ChannelDirectory = NameDirectory;
+} // CPCDMessenger
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include "StableArray.h"
+
+namespace CPCDMessenger {
+    // A small dense index for each running thread; the index of a thread that exited is
+    // handed to the next new thread, so indices stay below the peak thread count.
+    class ThreadSlot {
+    public:
+        static std::size_t current() {
+            thread_local ThreadSlot slot;
+            return slot.index_;
+        }
+
+        // One past the highest index handed out so far.
+        static std::size_t count() { return pool().next.load(std::memory_order_acquire); }
+
+    private:
+        struct Pool {
+            std::mutex mutex;
+            std::vector<std::size_t> free;
+            std::atomic<std::size_t> next{0};
+        };
+
+        static Pool& pool() {
+            static Pool pool;
+            return pool;
+        }
+
+        ThreadSlot() {
+            Pool& p = pool();
+            std::lock_guard<std::mutex> lk(p.mutex);
+            if (p.free.empty()) {
+                index_ = p.next.fetch_add(1, std::memory_order_release);
+            } else {
+                index_ = p.free.back();
+                p.free.pop_back();
+            }
+        }
+
+        ~ThreadSlot() {
+            Pool& p = pool();
+            std::lock_guard<std::mutex> lk(p.mutex);
+            p.free.push_back(index_);
+        }
+
+        std::size_t index_;
+    };
+
+    // Epoch-based reclamation for structures read without locks. A reader holds a Guard
+    // while it follows pointers into the structure; a writer that unlinks an object hands
+    // it to retire(), and it is deleted once every guard taken before the unlink is gone.
+    // Entering a guard is a store to the thread's own slot and a fence; readers never
+    // wait, retire() takes a mutex and frees in batches.
+    class EpochReclaimer {
+    public:
+        class Guard {
+        public:
+            Guard() : reclaimer_(EpochReclaimer::instance()) { reclaimer_.enter(); }
+            ~Guard() { reclaimer_.leave(); }
+
+            Guard(const Guard&) = delete;
+            Guard& operator=(const Guard&) = delete;
+
+        private:
+            EpochReclaimer& reclaimer_;
+        };
+
+        static EpochReclaimer& instance() {
+            static EpochReclaimer reclaimer;
+            return reclaimer;
+        }
+
+        EpochReclaimer(const EpochReclaimer&) = delete;
+        EpochReclaimer& operator=(const EpochReclaimer&) = delete;
+
+        ~EpochReclaimer() {
+            for (const auto& r : retired_) r.destroy(r.object);
+        }
+
+        // `object` must already be unreachable for a reader that enters after this call.
+        template<typename T>
+        void retire(T* object) {
+            if (!object) return;
+            std::lock_guard<std::mutex> lk(mutex_);
+            retired_.push_back({object, [](void* p) { delete static_cast<T*>(p); },
+                                epoch_.fetch_add(1, std::memory_order_acq_rel)});
+            if (retired_.size() >= kBatch) reclaim_locked();
+        }
+
+    private:
+        static constexpr std::size_t kBatch = 64;
+
+        struct Retired {
+            void* object;
+            void (*destroy)(void*);
+            std::uint64_t epoch;
+        };
+
+        // 0 while the thread holds no guard.
+        struct alignas(64) Slot {
+            std::atomic<std::uint64_t> epoch{0};
+        };
+
+        struct Local {
+            Slot* slot = nullptr;
+            unsigned depth = 0;
+        };
+
+        EpochReclaimer() = default;
+
+        static Local& local() {
+            thread_local Local state;
+            return state;
+        }
+
+        // The fence pairs with the one in reclaim_locked(): either the writer sees this
+        // slot, or this reader sees every unlink made before the writer's scan.
+        void enter() {
+            Local& state = local();
+            if (state.depth++ != 0) return;
+            if (!state.slot) state.slot = &slots_.ensure(ThreadSlot::current());
+            state.slot->epoch.store(epoch_.load(std::memory_order_acquire), std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+
+        void leave() {
+            Local& state = local();
+            if (--state.depth == 0) state.slot->epoch.store(0, std::memory_order_release);
+        }
+
+        // An object retired at epoch e may still be seen by a guard that entered at e or
+        // earlier, and by no other.
+        void reclaim_locked() {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            std::uint64_t oldest = UINT64_MAX;
+            for (std::size_t i = 0, n = ThreadSlot::count(); i < n; ++i) {
+                const Slot* slot = slots_.get(i);
+                std::uint64_t epoch = slot ? slot->epoch.load(std::memory_order_acquire) : 0;
+                if (epoch != 0 && epoch < oldest) oldest = epoch;
+            }
+            std::size_t kept = 0;
+            for (const auto& r : retired_) {
+                if (r.epoch < oldest) {
+                    r.destroy(r.object);
+                } else {
+                    retired_[kept++] = r;
+                }
+            }
+            retired_.resize(kept);
+        }
+
+        std::atomic<std::uint64_t> epoch_{1};
+        StableArray<Slot, 6, 1024> slots_;
+        std::mutex mutex_;
+        std::vector<Retired> retired_;
+    };
+} // CPCDMessenger
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include "Reclaimer.h"
+
+namespace CPCDMessenger {
+    // Read-mostly string-keyed map for the routing path.
+    //
+    // Every shard is an open-addressing table of pointers to immutable nodes. Writers
+    // take a per-shard mutex and publish one node per change: an insert fills a slot, an
+    // update swaps in a new node, an erase leaves a tombstone; a table past half full is
+    // rebuilt at twice the size, sharing its nodes. So a write costs amortized O(1), and
+    // a lookup is an epoch guard, one acquire load of the table and a probe, with no lock
+    // and no write to shared memory. Replaced nodes and tables are freed through
+    // EpochReclaimer once no reader can hold them.
+    template<typename Value, std::size_t ShardCount = 64>
+    class ShardedRegistry {
+    public:
+        ShardedRegistry() = default;
+
+        ShardedRegistry(const ShardedRegistry&) = delete;
+        ShardedRegistry& operator=(const ShardedRegistry&) = delete;
+
+        ~ShardedRegistry() {
+            for (auto& shard : shards_) {
+                Table* table = shard.table.load(std::memory_order_relaxed);
+                if (!table) continue;
+                for (std::size_t i = 0; i <= table->mask; ++i) {
+                    Node* node = table->slots[i].load(std::memory_order_relaxed);
+                    if (node && node != tombstone()) delete node;
+                }
+                delete table;
+            }
+        }
+
+        std::optional<Value> find(const std::string& key) const {
+            std::size_t h = std::hash<std::string>{}(key);
+            const Shard& shard = shards_[h % ShardCount];
+            EpochReclaimer::Guard guard;
+            const Table* table = shard.table.load(std::memory_order_acquire);
+            if (!table) return std::nullopt;
+            for (std::size_t i = start(h, *table);; i = (i + 1) & table->mask) {
+                const Node* node = table->slots[i].load(std::memory_order_acquire);
+                if (!node) return std::nullopt;
+                if (node != tombstone() && node->hash == h && node->key == key) return node->value;
+            }
+        }
+
+        void insert_or_assign(const std::string& key, Value value) {
+            std::size_t h = std::hash<std::string>{}(key);
+            Shard& shard = shards_[h % ShardCount];
+            std::lock_guard<std::mutex> lk(shard.write_mutex);
+            Table& table = reserve(shard);
+            std::size_t reuse = SIZE_MAX;
+            std::size_t i = start(h, table);
+            for (;; i = (i + 1) & table.mask) {
+                Node* node = table.slots[i].load(std::memory_order_relaxed);
+                if (!node) break;
+                if (node == tombstone()) {
+                    if (reuse == SIZE_MAX) reuse = i;
+                } else if (node->hash == h && node->key == key) {
+                    table.slots[i].store(new Node{key, std::move(value), h}, std::memory_order_release);
+                    EpochReclaimer::instance().retire(node);
+                    return;
+                }
+            }
+            if (reuse == SIZE_MAX) {
+                reuse = i;
+                ++shard.used;
+            }
+            table.slots[reuse].store(new Node{key, std::move(value), h}, std::memory_order_release);
+            shard.live.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        bool erase(const std::string& key) {
+            std::size_t h = std::hash<std::string>{}(key);
+            Shard& shard = shards_[h % ShardCount];
+            std::lock_guard<std::mutex> lk(shard.write_mutex);
+            Table* table = shard.table.load(std::memory_order_relaxed);
+            if (!table) return false;
+            for (std::size_t i = start(h, *table);; i = (i + 1) & table->mask) {
+                Node* node = table->slots[i].load(std::memory_order_relaxed);
+                if (!node) return false;
+                if (node != tombstone() && node->hash == h && node->key == key) {
+                    table->slots[i].store(tombstone(), std::memory_order_release);
+                    shard.live.fetch_sub(1, std::memory_order_relaxed);
+                    EpochReclaimer::instance().retire(node);
+                    return true;
+                }
+            }
+        }
+
+        std::size_t size() const {
+            std::size_t n = 0;
+            for (const auto& shard : shards_) n += shard.live.load(std::memory_order_relaxed);
+            return n;
+        }
+
+    private:
+        static constexpr std::size_t kMinCapacity = 16;
+
+        struct Node {
+            std::string key;
+            Value value;
+            std::size_t hash;
+        };
+
+        struct Table {
+            explicit Table(std::size_t capacity)
+            : mask(capacity - 1),
+              slots(new std::atomic<Node*>[capacity]())
+            {}
+
+            std::size_t mask;
+            std::unique_ptr<std::atomic<Node*>[]> slots;
+        };
+
+        struct alignas(64) Shard {
+            std::atomic<Table*> table{nullptr};
+            std::atomic<std::size_t> live{0};
+            // Slots holding a node or a tombstone; written under the mutex only.
+            std::size_t used = 0;
+            std::mutex write_mutex;
+        };
+
+        // The low bits of the hash chose the shard, the probe starts from the others.
+        static std::size_t start(std::size_t h, const Table& table) { return (h / ShardCount) & table.mask; }
+
+        static Node* tombstone() {
+            alignas(Node) static unsigned char marker;
+            return reinterpret_cast<Node*>(&marker);
+        }
+
+        // The shard's table with room for one more slot; at most half the slots are used,
+        // so a probe always ends at an empty one. A rebuild drops the tombstones.
+        Table& reserve(Shard& shard) {
+            Table* table = shard.table.load(std::memory_order_relaxed);
+            if (table && (shard.used + 1) * 2 <= table->mask + 1) return *table;
+            std::size_t live = shard.live.load(std::memory_order_relaxed);
+            std::size_t capacity = kMinCapacity;
+            while (capacity < (live + 1) * 4) capacity *= 2;
+            auto* next = new Table(capacity);
+            if (table) {
+                for (std::size_t i = 0; i <= table->mask; ++i) {
+                    Node* node = table->slots[i].load(std::memory_order_relaxed);
+                    if (!node || node == tombstone()) continue;
+                    std::size_t j = start(node->hash, *next);
+                    while (next->slots[j].load(std::memory_order_relaxed)) j = (j + 1) & next->mask;
+                    next->slots[j].store(node, std::memory_order_relaxed);
+                }
+            }
+            shard.table.store(next, std::memory_order_release);
+            shard.used = live;
+            EpochReclaimer::instance().retire(table);
+            return *next;
+        }
+
+        std::array<Shard, ShardCount> shards_;
+    };
+} // CPCDMessenger
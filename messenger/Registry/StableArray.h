@@ -0,0 +1,53 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+namespace CPCDMessenger {
+    // Flat array indexed by dense ids. Storage is a table of fixed-size chunks that are
+    // allocated on first use and never move, so readers index it without locking while
+    // writers grow it.
+    template<typename T, std::size_t ChunkBits = 12, std::size_t MaxChunks = 16384>
+    class StableArray {
+    public:
+        static constexpr std::size_t kChunkSize = std::size_t{1} << ChunkBits;
+        static constexpr std::size_t kCapacity = kChunkSize * MaxChunks;
+
+        StableArray() = default;
+        StableArray(const StableArray&) = delete;
+        StableArray& operator=(const StableArray&) = delete;
+
+        ~StableArray() {
+            for (auto& chunk : chunks_) delete[] chunk.load(std::memory_order_relaxed);
+        }
+
+        // nullptr when the chunk holding i was never allocated.
+        T* get(std::size_t i) const {
+            if (i >= kCapacity) return nullptr;
+            T* chunk = chunks_[i >> ChunkBits].load(std::memory_order_acquire);
+            return chunk ? chunk + (i & (kChunkSize - 1)) : nullptr;
+        }
+
+        T& ensure(std::size_t i) {
+            if (T* slot = get(i)) return *slot;
+            if (i >= kCapacity) throw std::length_error("StableArray capacity exceeded");
+
+            std::lock_guard<std::mutex> lk(grow_mutex_);
+            auto& chunk = chunks_[i >> ChunkBits];
+            T* data = chunk.load(std::memory_order_relaxed);
+            if (!data) {
+                data = new T[kChunkSize]();
+                chunk.store(data, std::memory_order_release);
+            }
+            return data[i & (kChunkSize - 1)];
+        }
+
+    private:
+        std::array<std::atomic<T*>, MaxChunks> chunks_{};
+        std::mutex grow_mutex_;
+    };
+} // CPCDMessenger
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include "text_parser_lib.h"
+#include "OfflineStore.h"
+
+namespace CPCDMessenger {
+    struct ImportResult {
+        std::uint64_t imported = 0;
+        std::uint64_t rejected = 0;
+    };
+
+    // Bulk import of archived messages into the offline store, from a file with one JSON
+    // object per line:
+    //   {"from": "bob", "to": "alice", "body": "hello"}
+    // Each line is queued for `to` as a plain message from `from`, as if sent while `to`
+    // was offline; new names are interned as a login would. Ranges of the file are
+    // parsed on `workers` threads (see FileParser::RecordReader) but appended in file
+    // order, so each recipient replays its messages in archive order. Each range resolves a
+    // name through the directory once. Lines that are not such an object are counted and
+    // skipped. Returns once everything is durable.
+    inline ImportResult import_archive(const std::string& path, OfflineStore& store, NameDirectory& users,
+                                       std::size_t workers) {
+        struct Parsed {
+            UserId to;
+            UserId from;
+            std::string body;
+        };
+
+        std::mutex mutex;
+        std::condition_variable turn;
+        std::size_t next = 0;
+        bool aborted = false;
+        ImportResult result;
+
+        FileParser::RecordReader::forEachRange(path, workers, [&](std::size_t index, FileParser::RecordReader& records) {
+            try {
+                std::vector<Parsed> parsed;
+                std::uint64_t rejected = 0;
+                std::unordered_map<std::string, UserId> ids;
+                auto id_of = [&](const std::string& name) {
+                    auto [it, fresh] = ids.try_emplace(name, kInvalidUser);
+                    if (fresh) it->second = users.intern(name);
+                    return it->second;
+                };
+                while (auto record = records.next()) {
+                    auto j = nlohmann::json::parse(record->begin(), record->end(), nullptr, false);
+                    auto field = [&](const char* key) -> const std::string* {
+                        if (!j.is_object()) return nullptr;
+                        auto it = j.find(key);
+                        if (it == j.end() || !it->is_string()) return nullptr;
+                        return &it->get_ref<const std::string&>();
+                    };
+                    const std::string* from = field("from");
+                    const std::string* to = field("to");
+                    const std::string* body = field("body");
+                    if (!from || !to || !body || from->empty() || to->empty()) {
+                        ++rejected;
+                        continue;
+                    }
+                    parsed.push_back({id_of(*to), id_of(*from), std::move(j["body"].get_ref<std::string&>())});
+                }
+
+                std::unique_lock<std::mutex> lk(mutex);
+                turn.wait(lk, [&] { return next == index || aborted; });
+                if (aborted) return;
+                for (const auto& message : parsed) {
+                    store.append(message.to, message.from, Protocol::FrameType::Msg, message.body);
+                }
+                result.imported += parsed.size();
+                result.rejected += rejected;
+                ++next;
+            } catch (...) {
+                {
+                    std::lock_guard<std::mutex> lk(mutex);
+                    aborted = true;
+                }
+                turn.notify_all();
+                throw;
+            }
+            turn.notify_all();
+        });
+        store.flush();
+        return result;
+    }
+} // CPCDMessenger
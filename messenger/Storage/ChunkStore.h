@@ -0,0 +1,225 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <openssl/evp.h>
+#include "SyncedFile.h"
+
+namespace CPCDMessenger {
+    // SHA-256 of a stored chunk's bytes.
+    using ChunkId = std::array<unsigned char, 32>;
+
+    struct ChunkIdHash {
+        std::size_t operator()(const ChunkId& id) const {
+            std::size_t h;
+            std::memcpy(&h, id.data(), sizeof(h));
+            return h;
+        }
+    };
+
+    // Content-addressed store of attachment chunks on the relay. A chunk is kept once
+    // however many senders upload it or recipients fetch it, under the hash of its bytes:
+    //   <dir>/<first 2 hex digits>/<other 62 hex digits>
+    // put() checks the bytes against the id, so a client cannot plant data under another
+    // chunk's id. Chunks are written to a temporary file, synced and renamed, so a crash
+    // never leaves a partial chunk under its id. The ids present are held in memory and
+    // rebuilt from the directory on start; contains() and touch() never touch the disk.
+    //
+    // The relay cannot read manifests, so it cannot tell which chunks an undelivered
+    // attachment still needs. Instead a chunk expires once nobody has uploaded, queried
+    // for or fetched it for `ttl`, which bounds how long a recipient may stay offline.
+    // Last use is kept in memory and written back as the file's mtime by expire(), so it
+    // survives a restart give or take an expiry interval. put() refuses new chunks past
+    // `capacity` bytes.
+    // Thread-safe.
+    class ChunkStore {
+    public:
+        static constexpr std::size_t kMaxChunkBytes = 1024 * 1024;
+
+        struct Limits {
+            std::uint64_t capacity = 64ull << 30;
+            std::chrono::seconds ttl = std::chrono::hours(24 * 30);
+        };
+
+        enum class PutResult { Stored, Present, Invalid, Full, Failed };
+
+        explicit ChunkStore(const std::filesystem::path& dir)
+        : ChunkStore(dir, Limits{})
+        {}
+
+        ChunkStore(const std::filesystem::path& dir, Limits limits)
+        : dir_(dir),
+          limits_(limits)
+        {
+            std::filesystem::create_directories(dir_);
+            for (const auto& entry : std::filesystem::recursive_directory_iterator(dir_)) {
+                if (!entry.is_regular_file()) continue;
+                const auto& path = entry.path();
+                if (path.extension() == ".tmp") {
+                    std::error_code ec;
+                    std::filesystem::remove(path, ec);
+                    continue;
+                }
+                auto id = from_hex(path.parent_path().filename().string() + path.filename().string());
+                if (id) {
+                    auto written = entry.last_write_time();
+                    index_.emplace(*id, Entry{entry.file_size(), written, written});
+                    bytes_ += entry.file_size();
+                }
+            }
+        }
+
+        ChunkStore(const ChunkStore&) = delete;
+        ChunkStore& operator=(const ChunkStore&) = delete;
+
+        bool contains(const ChunkId& id) const {
+            std::lock_guard<std::mutex> lk(mutex_);
+            return index_.count(id) != 0;
+        }
+
+        // contains(), and counts as a use of the chunk if it is there.
+        bool touch(const ChunkId& id) {
+            std::lock_guard<std::mutex> lk(mutex_);
+            auto it = index_.find(id);
+            if (it == index_.end()) return false;
+            it->second.used = Clock::now();
+            return true;
+        }
+
+        // Storing a chunk that is already there only checks the hash and touches it.
+        PutResult put(const ChunkId& id, std::string_view data) {
+            if (data.size() > kMaxChunkBytes || hash(data) != id) return PutResult::Invalid;
+            if (touch(id)) return PutResult::Present;
+            if (bytes() + data.size() > limits_.capacity) return PutResult::Full;
+            auto path = path_of(id);
+            auto tmp = path;
+            tmp += ".tmp";
+            try {
+                std::filesystem::create_directories(path.parent_path());
+                std::FILE* f = open_file(tmp, "wb");
+                bool ok = std::fwrite(data.data(), 1, data.size(), f) == data.size() && sync_file(f);
+                ok = std::fclose(f) == 0 && ok;
+                if (!ok) {
+                    std::filesystem::remove(tmp);
+                    return PutResult::Failed;
+                }
+                std::filesystem::rename(tmp, path);
+            } catch (const std::exception&) {
+                return PutResult::Failed;
+            }
+            auto now = Clock::now();
+            std::lock_guard<std::mutex> lk(mutex_);
+            if (index_.emplace(id, Entry{data.size(), now, now}).second) bytes_ += data.size();
+            return PutResult::Stored;
+        }
+
+        std::optional<std::string> get(const ChunkId& id) {
+            if (!touch(id)) return std::nullopt;
+            std::ifstream in(path_of(id), std::ios::binary);
+            if (!in) return std::nullopt;
+            std::string data(std::istreambuf_iterator<char>(in), (std::istreambuf_iterator<char>()));
+            return data;
+        }
+
+        std::size_t count() const {
+            std::lock_guard<std::mutex> lk(mutex_);
+            return index_.size();
+        }
+
+        std::uint64_t bytes() const {
+            std::lock_guard<std::mutex> lk(mutex_);
+            return bytes_;
+        }
+
+        // Removes the chunks unused for longer than the ttl and writes recent uses back
+        // to disk; returns how many chunks were removed. Meant to run periodically on the
+        // thread that calls put(), so a chunk is never removed while it is being stored.
+        std::size_t expire() {
+            auto now = Clock::now();
+            std::vector<ChunkId> expired;
+            std::vector<std::pair<ChunkId, Clock::time_point>> used;
+            {
+                std::lock_guard<std::mutex> lk(mutex_);
+                for (auto it = index_.begin(); it != index_.end();) {
+                    if (now - it->second.used > limits_.ttl) {
+                        expired.push_back(it->first);
+                        bytes_ -= it->second.size;
+                        it = index_.erase(it);
+                        continue;
+                    }
+                    if (it->second.used != it->second.written) {
+                        used.emplace_back(it->first, it->second.used);
+                        it->second.written = it->second.used;
+                    }
+                    ++it;
+                }
+            }
+            std::error_code ec;
+            for (const auto& id : expired) std::filesystem::remove(path_of(id), ec);
+            for (const auto& [id, when] : used) std::filesystem::last_write_time(path_of(id), when, ec);
+            return expired.size();
+        }
+
+        static ChunkId hash(std::string_view data) {
+            ChunkId id;
+            unsigned int len = 0;
+            EVP_Digest(data.data(), data.size(), id.data(), &len, EVP_sha256(), nullptr);
+            return id;
+        }
+
+        static std::string to_hex(const ChunkId& id) {
+            static constexpr char kDigits[] = "0123456789abcdef";
+            std::string out(id.size() * 2, '\0');
+            for (std::size_t i = 0; i < id.size(); ++i) {
+                out[2 * i] = kDigits[id[i] >> 4];
+                out[2 * i + 1] = kDigits[id[i] & 0xF];
+            }
+            return out;
+        }
+
+        static std::optional<ChunkId> from_hex(std::string_view hex) {
+            if (hex.size() != 64) return std::nullopt;
+            auto digit = [](char c) {
+                return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+            };
+            ChunkId id;
+            for (std::size_t i = 0; i < id.size(); ++i) {
+                int hi = digit(hex[2 * i]), lo = digit(hex[2 * i + 1]);
+                if (hi < 0 || lo < 0) return std::nullopt;
+                id[i] = static_cast<unsigned char>(hi << 4 | lo);
+            }
+            return id;
+        }
+
+    private:
+        using Clock = std::filesystem::file_time_type::clock;
+
+        struct Entry {
+            std::uint64_t size;
+            Clock::time_point used;
+            Clock::time_point written;      // last use known to be on disk as the mtime
+        };
+
+        std::filesystem::path path_of(const ChunkId& id) const {
+            std::string hex = to_hex(id);
+            return dir_ / hex.substr(0, 2) / hex.substr(2);
+        }
+
+        std::filesystem::path dir_;
+        Limits limits_;
+        mutable std::mutex mutex_;
+        std::unordered_map<ChunkId, Entry, ChunkIdHash> index_;
+        std::uint64_t bytes_ = 0;
+    };
+} // CPCDMessenger
@@ -0,0 +1,546 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "SyncedFile.h"
+#include "../Protocol/Frame.h"
+#include "../Registry/NameDirectory.h"
+#include "../Registry/StableArray.h"
+
+namespace CPCDMessenger {
+    // Disk-backed queue of messages for users that are offline.
+    //
+    // Layout under the store directory:
+    //   segment-NNNNNNNN.log  append-only records: u32 body length, u32 sender id,
+    //                         u16 frame type, u16 reserved, body
+    //   index/<user>.idx      per-recipient list of (u32 segment, u32 offset) entries
+    //
+    // append() only queues a record; a flusher thread writes whole batches, fsyncs every
+    // touched file once per batch and publishes index entries only after the segment data
+    // is durable. Memory holds the unflushed batch and a live-record count per segment,
+    // nothing per stored message, so it stays flat however large the backlog grows.
+    class OfflineStore {
+    public:
+        struct StoredMessage {
+            UserId from;
+            Protocol::FrameType type;
+            std::string body;
+        };
+
+        // Returning false leaves the record (and everything after it) in the store.
+        using Sink = std::function<bool(StoredMessage&&)>;
+
+        struct ReplayResult {
+            std::size_t delivered = 0;
+            // False if the sink stopped or the store could not be read or updated just
+            // now; what was not delivered stays queued for a later replay.
+            bool complete = false;
+        };
+
+        static constexpr std::uint32_t kSegmentBytes = 64 * 1024 * 1024;
+        static constexpr std::size_t kBatchBytes = 1024 * 1024;
+        static constexpr std::size_t kMaxPendingBytes = 32 * 1024 * 1024;
+        static constexpr auto kBatchDelay = std::chrono::milliseconds(2);
+
+        OfflineStore(const std::filesystem::path& dir, NameDirectory& users)
+        : dir_(dir),
+          users_(users)
+        {
+            std::filesystem::create_directories(dir_ / "index");
+            recover();
+            if (!open_segment(active_id_)) throw std::runtime_error("Failed to open file: " + segment_path(active_id_).string());
+            flusher_ = std::thread([this] { flush_loop(); });
+        }
+
+        OfflineStore(const OfflineStore&) = delete;
+        OfflineStore& operator=(const OfflineStore&) = delete;
+
+        ~OfflineStore() {
+            {
+                std::lock_guard<std::mutex> lk(mutex_);
+                stopping_ = true;
+            }
+            work_cv_.notify_all();
+            flusher_.join();
+            if (active_) std::fclose(active_);
+        }
+
+        void append(UserId to, UserId from, Protocol::FrameType type, std::string_view body) {
+            std::unique_lock<std::mutex> lk(mutex_);
+            // Only reached when the disk cannot keep up; bounds the in-memory batch.
+            space_cv_.wait(lk, [&] { return pending_bytes_ < kMaxPendingBytes || stopping_; });
+            pending_.push_back({to, from, type, std::string(body)});
+            pending_bytes_ += kRecordHeaderSize + body.size();
+            ++appended_seq_;
+            if (pending_.size() == 1 || pending_bytes_ >= kBatchBytes) work_cv_.notify_one();
+        }
+
+        // Blocks until everything appended so far is durable and indexed.
+        void flush() {
+            std::unique_lock<std::mutex> lk(mutex_);
+            std::uint64_t target = appended_seq_;
+            if (flushed_seq_ >= target) return;
+            flush_requested_ = true;
+            work_cv_.notify_one();
+            flushed_cv_.wait(lk, [&] { return flushed_seq_ >= target; });
+        }
+
+        // Streams the backlog of `user` to the sink, oldest first. Runs on the caller's
+        // thread and reads the index in fixed-size chunks; calls for the same user must not
+        // overlap. Records are removed only after the sink accepts them, so a crash
+        // mid-replay means redelivery, never loss. File system errors end the pass early,
+        // the caller retries later.
+        ReplayResult replay(UserId user, const Sink& sink) {
+            ReplayResult result;
+            flush();
+            while (true) {
+                std::filesystem::path taken = replay_path(user);
+                {
+                    std::lock_guard<std::mutex> lk(user_lock(user));
+                    std::error_code ec;
+                    if (!std::filesystem::exists(taken, ec)) {
+                        if (ec) return result;
+                        if (!std::filesystem::exists(index_path(user), ec)) {
+                            result.complete = !ec;
+                            return result;
+                        }
+                        std::filesystem::rename(index_path(user), taken, ec);
+                        if (ec) return result;
+                    }
+                }
+
+                std::map<std::uint32_t, std::uint64_t> consumed;
+                std::uint64_t position = 0;
+                bool stopped = false;
+                {
+                    std::FILE* idx = std::fopen(taken.string().c_str(), "rb");
+                    if (!idx) return result;
+                    SegmentReader reader(*this);
+                    std::vector<IndexEntry> chunk;
+                    while (!stopped && read_entries(idx, chunk)) {
+                        for (const auto& entry : chunk) {
+                            StoredMessage message;
+                            // Retried on the next replay; the segment may be readable then.
+                            ReadResult read = reader.read(entry, message);
+                            if (read == ReadResult::Unavailable ||
+                                (read == ReadResult::Ok && !sink(std::move(message)))) {
+                                stopped = true;
+                                break;
+                            }
+                            if (read == ReadResult::Ok) {
+                                ++result.delivered;
+                            } else {
+                                std::cerr << "Offline store: unreadable record for user " << user << " in segment "
+                                          << entry.segment << " at " << entry.offset << " dropped\n";
+                                ++unreadable_;
+                            }
+                            ++consumed[entry.segment];
+                            ++position;
+                        }
+                    }
+                    std::fclose(idx);
+                }
+
+                if (stopped) {
+                    // Left as it is, the .replay file is replayed from its start next
+                    // time: the delivered records come again, so their segments stay.
+                    if (requeue(user, taken, position)) release(consumed);
+                    return result;
+                }
+                {
+                    std::lock_guard<std::mutex> lk(user_lock(user));
+                    std::error_code ec;
+                    std::filesystem::remove(taken, ec);
+                    if (ec) return result;
+                }
+                release(consumed);
+                // Pick up records that were appended while this pass ran.
+                flush();
+            }
+        }
+
+        // Records dropped by replay() because their segment data was missing or damaged.
+        std::uint64_t unreadable() const { return unreadable_; }
+
+    private:
+        static constexpr std::size_t kRecordHeaderSize = 12;
+        static constexpr std::size_t kIndexEntrySize = 8;
+        static constexpr std::size_t kReplayChunk = 256;
+
+        struct PendingRecord {
+            UserId to;
+            UserId from;
+            Protocol::FrameType type;
+            std::string body;
+        };
+
+        enum class ReadResult { Ok, Unavailable, Corrupt };
+
+        struct IndexEntry {
+            std::uint32_t segment;
+            std::uint32_t offset;
+        };
+
+        // Keeps the last segment it touched open; a user's backlog is mostly clustered.
+        class SegmentReader {
+        public:
+            explicit SegmentReader(OfflineStore& store) : store_(store) {}
+            ~SegmentReader() { if (file_) std::fclose(file_); }
+
+            // Unavailable when the segment exists but cannot be opened now, e.g. out of
+            // descriptors; Corrupt when it is gone or the record is cut short.
+            ReadResult read(const IndexEntry& entry, StoredMessage& out) {
+                if (!file_ || segment_ != entry.segment) {
+                    if (file_) std::fclose(file_);
+                    auto path = store_.segment_path(entry.segment);
+                    file_ = std::fopen(path.string().c_str(), "rb");
+                    segment_ = entry.segment;
+                    if (!file_) {
+                        std::error_code ec;
+                        return std::filesystem::exists(path, ec) || ec ? ReadResult::Unavailable : ReadResult::Corrupt;
+                    }
+                }
+                std::array<char, kRecordHeaderSize> header{};
+                if (std::fseek(file_, entry.offset, SEEK_SET) != 0 ||
+                    std::fread(header.data(), 1, header.size(), file_) != header.size()) {
+                    return ReadResult::Corrupt;
+                }
+                std::uint32_t length = Protocol::get_u32(header.data());
+                if (length > Protocol::kMaxFramePayload) return ReadResult::Corrupt;
+                out.from = Protocol::get_u32(header.data() + 4);
+                out.type = static_cast<Protocol::FrameType>(Protocol::get_u16(header.data() + 8));
+                out.body.resize(length);
+                return std::fread(out.body.data(), 1, length, file_) == length ? ReadResult::Ok : ReadResult::Corrupt;
+            }
+
+        private:
+            OfflineStore& store_;
+            std::FILE* file_ = nullptr;
+            std::uint32_t segment_ = 0;
+        };
+
+        std::filesystem::path segment_path(std::uint32_t id) const {
+            char name[32];
+            std::snprintf(name, sizeof(name), "segment-%08u.log", id);
+            return dir_ / name;
+        }
+
+        std::filesystem::path index_path(UserId user) const {
+            return dir_ / "index" / (std::to_string(user) + ".idx");
+        }
+
+        std::filesystem::path replay_path(UserId user) const {
+            return dir_ / "index" / (std::to_string(user) + ".replay");
+        }
+
+        std::mutex& user_lock(UserId user) { return user_locks_.ensure(user); }
+
+        static bool read_entries(std::FILE* idx, std::vector<IndexEntry>& out) {
+            std::array<char, kReplayChunk * kIndexEntrySize> buf{};
+            std::size_t n = std::fread(buf.data(), kIndexEntrySize, kReplayChunk, idx);
+            out.clear();
+            for (std::size_t i = 0; i < n; ++i) {
+                const char* p = buf.data() + i * kIndexEntrySize;
+                out.push_back({Protocol::get_u32(p), Protocol::get_u32(p + 4)});
+            }
+            return n > 0;
+        }
+
+        // Writes `from[skip..]` followed by the current index back as the user's index,
+        // keeping unreplayed records ahead of the ones appended meanwhile. False, with
+        // both files untouched, if the merged index could not be written.
+        bool requeue(UserId user, const std::filesystem::path& from, std::uint64_t skip) {
+            std::lock_guard<std::mutex> lk(user_lock(user));
+            std::filesystem::path tmp = index_path(user);
+            tmp += ".tmp";
+            std::FILE* out = std::fopen(tmp.string().c_str(), "wb");
+            if (!out) return false;
+            auto copy = [&](const std::filesystem::path& src, std::uint64_t offset) {
+                std::FILE* in = std::fopen(src.string().c_str(), "rb");
+                if (!in) {
+                    std::error_code ec;
+                    return !std::filesystem::exists(src, ec) && !ec;
+                }
+                bool ok = std::fseek(in, static_cast<long>(offset), SEEK_SET) == 0;
+                std::array<char, 64 * 1024> buf{};
+                std::size_t n;
+                while (ok && (n = std::fread(buf.data(), 1, buf.size(), in)) > 0) ok = std::fwrite(buf.data(), 1, n, out) == n;
+                ok = ok && !std::ferror(in);
+                std::fclose(in);
+                return ok;
+            };
+            bool ok = copy(from, skip * kIndexEntrySize) && copy(index_path(user), 0) && sync_file(out);
+            ok = std::fclose(out) == 0 && ok;
+            std::error_code ec;
+            if (ok) std::filesystem::rename(tmp, index_path(user), ec);
+            if (!ok || ec) {
+                std::filesystem::remove(tmp, ec);
+                return false;
+            }
+            std::filesystem::remove(from, ec);
+            return true;
+        }
+
+        // Drops segments whose records have all been replayed.
+        void release(const std::map<std::uint32_t, std::uint64_t>& consumed) {
+            std::lock_guard<std::mutex> lk(segments_mutex_);
+            for (const auto& [segment, n] : consumed) {
+                auto it = live_.find(segment);
+                if (it == live_.end()) continue;
+                it->second = it->second > n ? it->second - n : 0;
+                if (it->second == 0 && segment != active_id_ && segment < writing_from_) {
+                    std::error_code ec;
+                    std::filesystem::remove(segment_path(segment), ec);
+                    live_.erase(it);
+                }
+            }
+        }
+
+        // Rebuilds live counts from the index files; an interrupted replay is merged back
+        // in front of its user's index. Writing always resumes in a fresh segment.
+        void recover() {
+            std::uint32_t last_segment = 0;
+            for (const auto& e : std::filesystem::directory_iterator(dir_)) {
+                unsigned id;
+                if (std::sscanf(e.path().filename().string().c_str(), "segment-%08u.log", &id) == 1) {
+                    live_.try_emplace(id, 0);
+                    last_segment = std::max<std::uint32_t>(last_segment, id);
+                }
+            }
+            for (const auto& e : std::filesystem::directory_iterator(dir_ / "index")) {
+                if (e.path().extension() != ".replay") continue;
+                std::string stem = e.path().stem().string();
+                UserId user;
+                auto [end, ec] = std::from_chars(stem.data(), stem.data() + stem.size(), user);
+                if (ec != std::errc() || end != stem.data() + stem.size()) {
+                    std::cerr << "Offline store: ignoring " << e.path() << "\n";
+                    continue;
+                }
+                if (!requeue(user, e.path(), 0)) throw std::runtime_error("Failed to requeue " + e.path().string());
+            }
+            for (const auto& e : std::filesystem::directory_iterator(dir_ / "index")) {
+                if (e.path().extension() != ".idx") continue;
+                std::FILE* idx = open_file(e.path(), "rb");
+                std::vector<IndexEntry> chunk;
+                while (read_entries(idx, chunk)) {
+                    for (const auto& entry : chunk) ++live_[entry.segment];
+                }
+                std::fclose(idx);
+            }
+            for (auto it = live_.begin(); it != live_.end();) {
+                if (it->second == 0) {
+                    std::filesystem::remove(segment_path(it->first));
+                    it = live_.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            active_id_ = last_segment + 1;
+        }
+
+        // False, with the active segment unchanged, if the file cannot be opened.
+        bool open_segment(std::uint32_t id) {
+            std::FILE* f = std::fopen(segment_path(id).string().c_str(), "ab");
+            if (!f) return false;
+            std::lock_guard<std::mutex> lk(segments_mutex_);
+            active_ = f;
+            active_id_ = id;
+            active_size_ = 0;
+            live_.try_emplace(id, 0);
+            return true;
+        }
+
+        void flush_loop() {
+            std::vector<PendingRecord> batch;
+            std::unique_lock<std::mutex> lk(mutex_);
+            while (true) {
+                work_cv_.wait(lk, [&] { return stopping_ || !pending_.empty(); });
+                if (pending_.empty()) break;
+                if (!stopping_ && !flush_requested_ && pending_bytes_ < kBatchBytes) {
+                    work_cv_.wait_for(lk, kBatchDelay, [&] {
+                        return stopping_ || flush_requested_ || pending_bytes_ >= kBatchBytes;
+                    });
+                }
+                batch.swap(pending_);
+                std::uint64_t seq = appended_seq_;
+                pending_bytes_ = 0;
+                flush_requested_ = false;
+                space_cv_.notify_all();
+
+                lk.unlock();
+                write_batch(batch);
+                batch.clear();
+                lk.lock();
+
+                flushed_seq_ = seq;
+                flushed_cv_.notify_all();
+            }
+        }
+
+        // Index entries are published only for records whose segment and the name
+        // journal were synced. A record that failed to write may leave a partial tail, so
+        // writing moves on to a fresh segment rather than appending after it. A full
+        // segment is kept while no new one can be opened; after a failed write the store
+        // has no segment, drops what it is given and tries to open one every batch.
+        void write_batch(const std::vector<PendingRecord>& batch) {
+            struct Written {
+                UserId to;
+                std::uint32_t segment;
+                std::uint32_t offset;
+            };
+            std::vector<Written> written;
+            std::map<std::uint32_t, bool> synced;
+            std::size_t dropped = 0;
+            // The failed segment's records from this batch are never published; if no
+            // earlier record lives there either, the file goes.
+            auto abandon = [&] {
+                std::uint32_t failed = active_id_;
+                std::fclose(active_);
+                active_ = nullptr;
+                if (!open_segment(failed + 1)) {
+                    std::cerr << "Offline store cannot open " << segment_path(failed + 1) << "\n";
+                }
+                std::lock_guard<std::mutex> lk(segments_mutex_);
+                auto it = live_.find(failed);
+                if (it != live_.end() && it->second == 0) {
+                    std::error_code ec;
+                    std::filesystem::remove(segment_path(failed), ec);
+                    live_.erase(it);
+                }
+            };
+            if (!active_ && !open_segment(active_id_ + 1)) {
+                std::cerr << "Offline store has no segment, " << batch.size() << " messages lost\n";
+                return;
+            }
+            {
+                // Records of this batch are not counted yet; their segments must stay.
+                std::lock_guard<std::mutex> lk(segments_mutex_);
+                writing_from_ = active_id_;
+            }
+
+            bool can_roll = true;
+            for (const auto& rec : batch) {
+                if (!active_) {
+                    ++dropped;
+                    continue;
+                }
+                if (active_size_ >= kSegmentBytes && can_roll) {
+                    std::FILE* full = active_;
+                    std::uint32_t full_id = active_id_;
+                    if (open_segment(active_id_ + 1)) {
+                        synced[full_id] = sync_file(full);
+                        std::fclose(full);
+                    } else {
+                        can_roll = false;
+                    }
+                }
+                std::array<char, kRecordHeaderSize> header{};
+                Protocol::put_u32(header.data(), static_cast<std::uint32_t>(rec.body.size()));
+                Protocol::put_u32(header.data() + 4, rec.from);
+                Protocol::put_u16(header.data() + 8, static_cast<std::uint16_t>(rec.type));
+                if (std::fwrite(header.data(), 1, header.size(), active_) != header.size() ||
+                    std::fwrite(rec.body.data(), 1, rec.body.size(), active_) != rec.body.size()) {
+                    std::cerr << "Offline store write failed, message for user " << rec.to << " lost\n";
+                    synced[active_id_] = sync_file(active_);
+                    abandon();
+                    continue;
+                }
+                written.push_back({rec.to, active_id_, active_size_});
+                active_size_ += static_cast<std::uint32_t>(kRecordHeaderSize + rec.body.size());
+            }
+            if (dropped != 0) std::cerr << "Offline store has no segment, " << dropped << " messages lost\n";
+            if (active_ && !(synced[active_id_] = sync_file(active_))) abandon();
+
+            // Sender ids must survive a crash before records that mention them do.
+            bool journal = users_.sync_journal();
+            std::unordered_map<UserId, std::vector<char>> index_updates;
+            std::size_t lost = 0;
+            {
+                // Counted before the entries are visible, so replay never sees a segment
+                // with fewer live records than it holds entries for.
+                std::lock_guard<std::mutex> lk(segments_mutex_);
+                for (const auto& w : written) {
+                    if (!journal || !synced[w.segment]) {
+                        ++lost;
+                        continue;
+                    }
+                    char entry[kIndexEntrySize];
+                    Protocol::put_u32(entry, w.segment);
+                    Protocol::put_u32(entry + 4, w.offset);
+                    auto& update = index_updates[w.to];
+                    update.insert(update.end(), entry, entry + kIndexEntrySize);
+                    ++live_[w.segment];
+                }
+                writing_from_ = UINT32_MAX;
+            }
+            if (lost != 0) {
+                std::cerr << "Offline store fsync failed, " << lost << " messages lost\n";
+            }
+
+            std::map<std::uint32_t, std::uint64_t> unpublished;
+            for (const auto& [user, entries] : index_updates) {
+                std::lock_guard<std::mutex> lk(user_lock(user));
+                auto path = index_path(user);
+                std::error_code ec;
+                std::uintmax_t before = std::filesystem::exists(path, ec) ? std::filesystem::file_size(path, ec) : 0;
+                std::FILE* idx = ec ? nullptr : std::fopen(path.string().c_str(), "ab");
+                bool ok = idx != nullptr;
+                if (idx) {
+                    ok = std::fwrite(entries.data(), 1, entries.size(), idx) == entries.size() && sync_file(idx);
+                    ok = std::fclose(idx) == 0 && ok;
+                }
+                if (ok) continue;
+                // A torn entry would shift every entry after it.
+                if (idx) std::filesystem::resize_file(path, before, ec);
+                std::cerr << "Offline store index write failed, " << entries.size() / kIndexEntrySize
+                          << " messages for user " << user << " lost\n";
+                for (std::size_t at = 0; at < entries.size(); at += kIndexEntrySize) {
+                    ++unpublished[Protocol::get_u32(entries.data() + at)];
+                }
+            }
+            if (!unpublished.empty()) release(unpublished);
+        }
+
+        std::filesystem::path dir_;
+        NameDirectory& users_;
+
+        std::mutex mutex_;
+        std::condition_variable work_cv_;
+        std::condition_variable flushed_cv_;
+        std::condition_variable space_cv_;
+        std::vector<PendingRecord> pending_;
+        std::size_t pending_bytes_ = 0;
+        std::uint64_t appended_seq_ = 0;
+        std::uint64_t flushed_seq_ = 0;
+        bool flush_requested_ = false;
+        bool stopping_ = false;
+
+        // Written by the flusher thread only.
+        std::FILE* active_ = nullptr;
+        std::uint32_t active_size_ = 0;
+
+        std::mutex segments_mutex_;
+        std::uint32_t active_id_ = 0;
+        std::uint32_t writing_from_ = UINT32_MAX;
+        std::map<std::uint32_t, std::uint64_t> live_;
+
+        StableArray<std::mutex> user_locks_;
+        std::atomic<std::uint64_t> unreadable_{0};
+        std::thread flusher_;
+    };
+} // CPCDMessenger
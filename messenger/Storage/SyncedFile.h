@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdio>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+    #include <io.h>
+#else
+    #include <unistd.h>
+#endif
+
+namespace CPCDMessenger {
+    // Flushes stdio buffers and forces the data to stable storage. Fails if any earlier
+    // write to the stream failed: a failed flush may drop the buffer, and the next flush
+    // then succeeds with the data gone.
+    inline bool sync_file(std::FILE* f) {
+        if (std::fflush(f) != 0 || std::ferror(f)) return false;
+#ifdef _WIN32
+        return _commit(_fileno(f)) == 0;
+#else
+        return fsync(fileno(f)) == 0;
+#endif
+    }
+
+    inline std::FILE* open_file(const std::filesystem::path& path, const char* mode) {
+        std::FILE* f = std::fopen(path.string().c_str(), mode);
+        if (!f) throw std::runtime_error("Failed to open file: " + path.string());
+        return f;
+    }
+} // CPCDMessenger
@@ -0,0 +1,404 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include "text_parser_lib.h"
+#include "FileTransfer.h"
+#include "../Crypto/SessionKeys.h"
+#include "../Protocol/Frame.h"
+#include "../Storage/ChunkStore.h"
+
+namespace CPCDMessenger::Attachment {
+    // Attachments are cut into content-defined chunks (FileParser::ContentChunker) that
+    // the relay keeps in its ChunkStore, so a file sent to many recipients, or sent again
+    // after a small edit, is uploaded and stored only once apart from the changed chunks.
+    // Each chunk is encrypted under a key derived from its own plaintext (convergent
+    // encryption): equal chunks give equal ciphertext whoever sends them, so the relay can
+    // deduplicate what it cannot read. It does learn which chunks are equal, and could
+    // confirm a guess of a whole chunk. The keys reach the recipient in the manifest,
+    // sealed under the session like a message.
+    //
+    // Sealed chunk: 12 zero bytes (the nonce; a key only ever seals one plaintext),
+    // ciphertext, tag. Its id, the SHA-256 of the sealed bytes, names it on the relay.
+    //
+    // Relay frames, peer field unused:
+    //   ChunkQuery  up to kQueryBatch ids; the answer lists the ones the relay lacks
+    //   ChunkPut    id, sealed chunk; the answer is the id and a u8, 1 if stored
+    //   ChunkGet    id; the answer is the id and the sealed chunk, or the id alone
+    // Manifest, the sealed payload of an Attachment frame to the recipient:
+    //   u64 size, u32 chunk count, u16 name length, name, per chunk: id, key, u32 size
+    constexpr std::size_t kIdSize = 32;
+    constexpr std::size_t kQueryBatch = 256;
+    // Sealed bytes held or requested per transfer; below the relay's high watermark.
+    constexpr std::size_t kWindowBytes = 4 * 1024 * 1024;
+    constexpr std::size_t kRefSize = kIdSize + kSessionKeySize + 4;
+
+    struct ChunkRef {
+        ChunkId id;
+        SessionKey key;
+        std::uint32_t size;
+    };
+
+    struct Manifest {
+        std::string name;
+        std::uint64_t size = 0;
+        std::vector<ChunkRef> chunks;
+
+        ~Manifest() {
+            for (auto& chunk : chunks) OPENSSL_cleanse(chunk.key.data(), chunk.key.size());
+        }
+
+        std::string encode() const {
+            std::string out(14, '\0');
+            Protocol::put_u64(out.data(), size);
+            Protocol::put_u32(out.data() + 8, static_cast<std::uint32_t>(chunks.size()));
+            Protocol::put_u16(out.data() + 12, static_cast<std::uint16_t>(name.size()));
+            out.append(name);
+            std::size_t at = out.size();
+            out.resize(at + chunks.size() * kRefSize);
+            for (const auto& chunk : chunks) {
+                std::memcpy(out.data() + at, chunk.id.data(), kIdSize);
+                std::memcpy(out.data() + at + kIdSize, chunk.key.data(), kSessionKeySize);
+                Protocol::put_u32(out.data() + at + kIdSize + kSessionKeySize, chunk.size);
+                at += kRefSize;
+            }
+            return out;
+        }
+
+        // nullopt unless the chunk sizes add up to the file size.
+        static std::optional<Manifest> decode(std::string_view in) {
+            if (in.size() < 14) return std::nullopt;
+            Manifest m;
+            m.size = Protocol::get_u64(in.data());
+            std::size_t count = Protocol::get_u32(in.data() + 8);
+            std::size_t name_size = Protocol::get_u16(in.data() + 12);
+            if (in.size() != 14 + name_size + count * kRefSize) return std::nullopt;
+            m.name = in.substr(14, name_size);
+            const char* p = in.data() + 14 + name_size;
+            std::uint64_t total = 0;
+            m.chunks.resize(count);
+            for (auto& chunk : m.chunks) {
+                std::memcpy(chunk.id.data(), p, kIdSize);
+                std::memcpy(chunk.key.data(), p + kIdSize, kSessionKeySize);
+                chunk.size = Protocol::get_u32(p + kIdSize + kSessionKeySize);
+                if (chunk.size == 0 || chunk.size > ChunkStore::kMaxChunkBytes - kSealOverhead) return std::nullopt;
+                total += chunk.size;
+                p += kRefSize;
+            }
+            if (total != m.size) return std::nullopt;
+            return m;
+        }
+    };
+
+    // Convergent sealing of chunks. One context per direction, rekeyed for every chunk.
+    class ChunkSealer {
+    public:
+        ChunkSealer() : digest_(EVP_MD_CTX_new()) {}
+        ~ChunkSealer() { EVP_MD_CTX_free(digest_); }
+        ChunkSealer(const ChunkSealer&) = delete;
+        ChunkSealer& operator=(const ChunkSealer&) = delete;
+
+        // Fills in ref and writes the sealed chunk to `sealed`.
+        bool seal(std::span<const char> plain, ChunkRef& ref, std::string& sealed) {
+            if (!derive_key(plain, ref.key)) return false;
+            if (!encrypt_) encrypt_ = GcmKey::create(ref.key.data(), true);
+            if (!encrypt_ || !encrypt_->rekey(ref.key.data())) return false;
+            sealed.resize(plain.size() + kSealOverhead);
+            unsigned char nonce[kNonceSize] = {};
+            auto* out = reinterpret_cast<unsigned char*>(sealed.data());
+            if (!encrypt_->seal(nonce, reinterpret_cast<const unsigned char*>(plain.data()), plain.size(), out)) return false;
+            ref.id = ChunkStore::hash(sealed);
+            ref.size = static_cast<std::uint32_t>(plain.size());
+            return true;
+        }
+
+        // Checks the sealed chunk against ref and writes ref.size bytes of plaintext.
+        bool open(const ChunkRef& ref, std::string_view sealed, char* out) {
+            if (sealed.size() != ref.size + kSealOverhead || ChunkStore::hash(sealed) != ref.id) return false;
+            if (!decrypt_) decrypt_ = GcmKey::create(ref.key.data(), false);
+            if (!decrypt_ || !decrypt_->rekey(ref.key.data())) return false;
+            return decrypt_->open(reinterpret_cast<const unsigned char*>(sealed.data()), sealed.size(),
+                                  reinterpret_cast<unsigned char*>(out));
+        }
+
+    private:
+        bool derive_key(std::span<const char> plain, SessionKey& key) {
+            static constexpr std::string_view kContext = "CPCDMessenger attachment chunk v1";
+            unsigned int len = 0;
+            return EVP_DigestInit_ex(digest_, EVP_sha256(), nullptr) &&
+                   EVP_DigestUpdate(digest_, kContext.data(), kContext.size()) &&
+                   EVP_DigestUpdate(digest_, plain.data(), plain.size()) &&
+                   EVP_DigestFinal_ex(digest_, key.data(), &len);
+        }
+
+        EVP_MD_CTX* digest_;
+        std::optional<GcmKey> encrypt_;
+        std::optional<GcmKey> decrypt_;
+    };
+
+    inline std::string_view id_view(const ChunkId& id) {
+        return {reinterpret_cast<const char*>(id.data()), id.size()};
+    }
+
+    inline ChunkId id_at(const char* p) {
+        ChunkId id;
+        std::memcpy(id.data(), p, kIdSize);
+        return id;
+    }
+
+    // Sender side: chunks the file, asks the relay which chunks it lacks a batch at a time
+    // and uploads only those. At most kWindowBytes of sealed chunks are held, whether
+    // waiting for the relay's answer or for the upload to be stored. A chunk that occurs
+    // again later in the same file is neither queried nor uploaded twice.
+    class Upload {
+    public:
+        // nullopt if the file cannot be opened.
+        static std::optional<Upload> open(const std::filesystem::path& path, std::uint32_t to) {
+            std::error_code ec;
+            if (!std::filesystem::is_regular_file(path, ec)) return std::nullopt;
+            try {
+                std::optional<Upload> upload(std::in_place, path, to);
+                return upload;
+            } catch (const std::exception&) {
+                return std::nullopt;
+            }
+        }
+
+        Upload(const std::filesystem::path& path, std::uint32_t to)
+        : to_(to), chunker_(std::make_unique<FileParser::ContentChunker>(path.string())),
+          sealer_(std::make_unique<ChunkSealer>())
+        {
+            manifest_.name = path.filename().string();
+        }
+
+        std::uint32_t to() const { return to_; }
+        const Manifest& manifest() const { return manifest_; }
+        bool done() const { return eof_ && queries_.empty() && puts_.empty(); }
+        std::uint64_t uploaded() const { return uploaded_; }
+        std::uint64_t deduplicated() const { return deduplicated_; }
+
+        // Reads and seals chunks and emits a ChunkQuery per batch while the window has
+        // room. False if the file cannot be read or a chunk cannot be sealed.
+        template<typename Emit>
+        bool pump(Emit&& emit) {
+            while (!eof_ && held_ < kWindowBytes) {
+                std::vector<Pending> batch;
+                std::string query;
+                while (batch.size() < kQueryBatch && held_ < kWindowBytes) {
+                    std::optional<FileParser::ContentChunker::Chunk> chunk;
+                    try {
+                        chunk = chunker_->next();
+                    } catch (const std::exception&) {
+                        return false;
+                    }
+                    if (!chunk) {
+                        eof_ = true;
+                        break;
+                    }
+                    ChunkRef ref;
+                    std::string sealed;
+                    if (!sealer_->seal(chunk->data, ref, sealed)) return false;
+                    manifest_.size += ref.size;
+                    manifest_.chunks.push_back(ref);
+                    OPENSSL_cleanse(ref.key.data(), ref.key.size());
+                    if (!seen_.insert(ref.id).second) {
+                        deduplicated_ += sealed.size();
+                        continue;
+                    }
+                    held_ += sealed.size();
+                    query.append(id_view(ref.id));
+                    batch.push_back({ref.id, std::move(sealed)});
+                }
+                if (batch.empty()) break;
+                queries_.push_back(std::move(batch));
+                emit(Protocol::make_frame(Protocol::FrameType::ChunkQuery, Protocol::kNoPeer, query));
+            }
+            return true;
+        }
+
+        // The relay's answer to the oldest query: the missing chunks go up, the rest are
+        // dropped. False if the answer does not fit the query.
+        template<typename Emit>
+        bool on_missing(std::string_view payload, Emit&& emit) {
+            if (queries_.empty() || payload.size() % kIdSize != 0) return false;
+            std::unordered_set<ChunkId, ChunkIdHash> missing;
+            for (std::size_t i = 0; i < payload.size(); i += kIdSize) missing.insert(id_at(payload.data() + i));
+            auto batch = std::move(queries_.front());
+            queries_.pop_front();
+            for (auto& pending : batch) {
+                if (!missing.count(pending.id)) {
+                    held_ -= pending.sealed.size();
+                    deduplicated_ += pending.sealed.size();
+                    continue;
+                }
+                puts_.emplace(pending.id, pending.sealed.size());
+                std::string frame;
+                frame.reserve(Protocol::kFrameHeaderSize + kIdSize + pending.sealed.size());
+                Protocol::append_frame_header(frame, Protocol::FrameType::ChunkPut, Protocol::kNoPeer, kIdSize + pending.sealed.size());
+                frame.append(id_view(pending.id));
+                frame.append(pending.sealed);
+                emit(std::move(frame));
+            }
+            return true;
+        }
+
+        // The relay's answer to a ChunkPut; false if it could not store the chunk.
+        bool on_stored(std::string_view payload) {
+            if (payload.size() != kIdSize + 1) return false;
+            auto it = puts_.find(id_at(payload.data()));
+            if (it == puts_.end() || payload[kIdSize] != 1) return false;
+            held_ -= it->second;
+            uploaded_ += it->second;
+            puts_.erase(it);
+            return true;
+        }
+
+    private:
+        struct Pending {
+            ChunkId id;
+            std::string sealed;
+        };
+
+        std::uint32_t to_;
+        std::unique_ptr<FileParser::ContentChunker> chunker_;
+        std::unique_ptr<ChunkSealer> sealer_;
+        Manifest manifest_;
+        std::unordered_set<ChunkId, ChunkIdHash> seen_;
+        std::deque<std::vector<Pending>> queries_;
+        std::unordered_map<ChunkId, std::size_t, ChunkIdHash> puts_;
+        std::size_t held_ = 0;
+        bool eof_ = false;
+        std::uint64_t uploaded_ = 0;
+        std::uint64_t deduplicated_ = 0;
+    };
+
+    // Recipient side: fetches every distinct chunk of the manifest once, keeping at most
+    // kWindowBytes requested, and writes it at each offset where it occurs. The file is
+    // assembled as a .part file and moved into place when complete.
+    class Download {
+    public:
+        // nullopt if the name is not a plain file name. Nothing is written before start().
+        static std::optional<Download> open(Manifest manifest, const std::filesystem::path& dir, std::uint32_t from) {
+            std::filesystem::path name = std::filesystem::path(manifest.name).filename();
+            if (name.empty() || name != manifest.name || name == "." || name == "..") return std::nullopt;
+            std::optional<Download> download(std::in_place);
+            download->from_ = from;
+            download->dir_ = dir;
+            download->target_ = dir / name;
+            download->part_ = dir / (name.string() + ".attachment.part");
+            std::uint64_t offset = 0;
+            for (std::size_t i = 0; i < manifest.chunks.size(); ++i) {
+                auto [it, fresh] = download->places_.try_emplace(manifest.chunks[i].id, Places{i, {}});
+                if (fresh) download->order_.push_back(i);
+                it->second.offsets.push_back(offset);
+                offset += manifest.chunks[i].size;
+            }
+            download->manifest_ = std::move(manifest);
+            return download;
+        }
+
+        Download() = default;
+
+        const Manifest& manifest() const { return manifest_; }
+        std::uint32_t from() const { return from_; }
+        bool done() const { return fetched_ == order_.size(); }
+        bool started() const { return out_.is_open(); }
+        bool failed() const { return failed_; }
+        // Every ChunkGet sent has been answered.
+        bool settled() const { return answered_ == next_; }
+
+        // Creates the .part file. Downloads are fetched one at a time and only the one
+        // being fetched holds its .part, so two attachments of the same name do not
+        // write over each other. False if it cannot be created.
+        bool start() {
+            std::error_code ec;
+            std::filesystem::create_directories(dir_, ec);
+            out_.open(part_, std::ios::binary | std::ios::out | std::ios::trunc);
+            return static_cast<bool>(out_);
+        }
+
+        // Gives the download up and removes its .part file; answers to requests already
+        // sent are still counted, see settled().
+        void abandon() {
+            failed_ = true;
+            out_.close();
+            std::error_code ec;
+            std::filesystem::remove(part_, ec);
+        }
+
+        // Emits a ChunkGet per chunk while the window has room.
+        template<typename Emit>
+        void pump(Emit&& emit) {
+            while (!failed_ && next_ < order_.size() && requested_ < kWindowBytes) {
+                const auto& ref = manifest_.chunks[order_[next_++]];
+                requested_ += ref.size + kSealOverhead;
+                emit(Protocol::make_frame(Protocol::FrameType::ChunkGet, Protocol::kNoPeer, id_view(ref.id)));
+            }
+        }
+
+        // The relay's answer to a ChunkGet; false if the relay lacks the chunk or it does
+        // not match the manifest.
+        bool on_chunk(std::string_view payload) {
+            ++answered_;
+            if (failed_ || payload.size() < kIdSize) return false;
+            auto places = places_.find(id_at(payload.data()));
+            if (places == places_.end() || places->second.offsets.empty()) return false;
+            const ChunkRef* ref = &manifest_.chunks[places->second.ref];
+            plain_.resize(ref->size);
+            if (!sealer_->open(*ref, payload.substr(kIdSize), plain_.data())) return false;
+            for (std::uint64_t offset : places->second.offsets) {
+                out_.seekp(static_cast<std::streamoff>(offset));
+                out_.write(plain_.data(), static_cast<std::streamsize>(plain_.size()));
+            }
+            if (!out_) return false;
+            places->second.offsets.clear();
+            requested_ -= ref->size + kSealOverhead;
+            ++fetched_;
+            return true;
+        }
+
+        // Returns the final path, empty on failure.
+        std::filesystem::path finish() {
+            out_.close();
+            std::filesystem::path path;
+            if (!out_.fail()) path = Transfer::move_into_place(part_, target_);
+            if (path.empty()) abandon();
+            return path;
+        }
+
+    private:
+        struct Places {
+            std::size_t ref;                        // first occurrence in the manifest
+            std::vector<std::uint64_t> offsets;     // emptied once written
+        };
+
+        Manifest manifest_;
+        std::uint32_t from_ = 0;
+        std::filesystem::path dir_;
+        std::filesystem::path target_;
+        std::filesystem::path part_;
+        std::ofstream out_;
+        std::unordered_map<ChunkId, Places, ChunkIdHash> places_;
+        std::vector<std::size_t> order_;            // first occurrences, in fetch order
+        std::size_t next_ = 0;
+        std::size_t fetched_ = 0;
+        std::size_t answered_ = 0;
+        std::size_t requested_ = 0;
+        bool failed_ = false;
+        std::string plain_;
+        std::unique_ptr<ChunkSealer> sealer_ = std::make_unique<ChunkSealer>();
+    };
+} // CPCDMessenger::Attachment
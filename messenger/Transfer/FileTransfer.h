@@ -0,0 +1,320 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <openssl/crypto.h>
+#include "text_parser_lib.h"
+#include "../Crypto/Crypto.h"
+#include "../Protocol/Frame.h"
+
+namespace CPCDMessenger::Transfer {
+    // A file goes to a peer as one FileOffer, then one FileChunk frame per block; the
+    // receiver answers the offer and every chunk with a FileAck of the bytes it has
+    // written so far. Payloads, after the 12-byte frame header:
+    //
+    //   FileOffer  u32 id, then sealed with the session key like a Cipher frame:
+    //              u32 id, u64 size, u64 mtime, u32 block size, 32-byte file key, name
+    //   FileChunk  u32 id, u64 offset, 12-byte IV, ciphertext, 16-byte tag; id and offset
+    //              are authenticated as AAD, so a chunk cannot be moved or replayed
+    //   FileAck    u32 id, u64 bytes received, or kAbort from either side to give up
+    //
+    // The answer to an offer is the offset to start from: the whole blocks an earlier
+    // attempt left in the receiver's .part file. Each transfer has its own random key.
+    constexpr std::size_t   kBlockSize = 256 * 1024;
+    // Unacknowledged bytes per transfer, half the relay's default high watermark. Only
+    // one transfer per recipient is in flight at a time (see ConsoleClient::offer_file),
+    // so one sender leaves room for chat traffic; several senders to one recipient can
+    // still stall it, and then their transfers stop and resume when sent again.
+    constexpr std::size_t   kWindowBytes = 16 * kBlockSize;
+    constexpr std::uint64_t kAbort = UINT64_MAX;
+    constexpr std::size_t   kChunkHeaderSize = 12;
+    constexpr std::size_t   kChunkOverhead = kChunkHeaderSize + Crypto::kGcmIvSize + Crypto::kGcmTagSize;
+    constexpr std::size_t   kAckSize = 12;
+
+    inline std::span<const unsigned char> as_bytes(const char* data, std::size_t size) {
+        return {reinterpret_cast<const unsigned char*>(data), size};
+    }
+
+    // The id every transfer frame starts with, 0 if the payload is too short.
+    inline std::uint32_t transfer_id(std::string_view payload) {
+        return payload.size() >= 4 ? Protocol::get_u32(payload.data()) : 0;
+    }
+
+    inline std::string make_ack_frame(std::uint32_t peer, std::uint32_t id, std::uint64_t received) {
+        char payload[kAckSize];
+        Protocol::put_u32(payload, id);
+        Protocol::put_u64(payload + 4, received);
+        return Protocol::make_frame(Protocol::FrameType::FileAck, peer, std::string_view(payload, kAckSize));
+    }
+
+    // Renames a completed .part file to `target`, or next to it as "name (n).ext" rather
+    // than over an existing file. Returns the final path, empty on failure.
+    inline std::filesystem::path move_into_place(const std::filesystem::path& part, const std::filesystem::path& target) {
+        std::filesystem::path path = target;
+        std::error_code ec;
+        for (int n = 1; std::filesystem::exists(path, ec); ++n) {
+            path = target.parent_path() / (target.stem().string() + " (" + std::to_string(n) + ")" + target.extension().string());
+        }
+        std::filesystem::rename(part, path, ec);
+        return ec ? std::filesystem::path() : path;
+    }
+
+    inline bool parse_ack(std::string_view payload, std::uint32_t& id, std::uint64_t& received) {
+        if (payload.size() != kAckSize) return false;
+        id = Protocol::get_u32(payload.data());
+        received = Protocol::get_u64(payload.data() + 4);
+        return true;
+    }
+
+    struct Offer {
+        static constexpr std::size_t kFixedSize = 4 + 8 + 8 + 4 + Crypto::kAesKeySize;
+        static constexpr std::size_t kMaxName = 255;
+
+        std::uint32_t id = 0;
+        std::uint64_t size = 0;
+        std::uint64_t mtime = 0;
+        std::uint32_t block = 0;
+        Crypto::AesKey key{};
+        std::string name;
+
+        ~Offer() { OPENSSL_cleanse(key.data(), key.size()); }
+
+        // The plaintext that is sealed into the offer.
+        std::string encode() const {
+            std::string out(kFixedSize, '\0');
+            Protocol::put_u32(out.data(), id);
+            Protocol::put_u64(out.data() + 4, size);
+            Protocol::put_u64(out.data() + 12, mtime);
+            Protocol::put_u32(out.data() + 20, block);
+            std::memcpy(out.data() + 24, key.data(), key.size());
+            out.append(name);
+            return out;
+        }
+
+        static std::optional<Offer> decode(std::string_view plain) {
+            if (plain.size() <= kFixedSize || plain.size() > kFixedSize + kMaxName) return std::nullopt;
+            Offer offer;
+            offer.id = Protocol::get_u32(plain.data());
+            offer.size = Protocol::get_u64(plain.data() + 4);
+            offer.mtime = Protocol::get_u64(plain.data() + 12);
+            offer.block = Protocol::get_u32(plain.data() + 20);
+            std::memcpy(offer.key.data(), plain.data() + 24, offer.key.size());
+            offer.name = plain.substr(kFixedSize);
+            if (offer.block == 0 || offer.block > Protocol::kMaxFramePayload - kChunkOverhead) return std::nullopt;
+            return offer;
+        }
+    };
+
+    // Sender side of one transfer. Blocks are read with FileBlockIterator and encrypted
+    // straight into the frames queued for writing; at most kWindowBytes are in flight, so
+    // neither the relay nor the receiver ever holds more than a window of the file.
+    class Outgoing {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        // nullopt if the path is not a readable regular file or no key can be made.
+        static std::optional<Outgoing> open(const std::filesystem::path& path, std::uint32_t id, std::uint32_t to) {
+            std::error_code ec;
+            if (!std::filesystem::is_regular_file(path, ec)) return std::nullopt;
+            Outgoing out;
+            out.path_ = path.string();
+            out.to_ = to;
+            out.offer_.id = id;
+            if (!stat(path, out.offer_.size, out.offer_.mtime)) return std::nullopt;
+            out.offer_.block = kBlockSize;
+            out.offer_.name = path.filename().string().substr(0, Offer::kMaxName);
+            if (out.offer_.name.empty() || !Crypto::gen_aes_key(out.offer_.key)) return std::nullopt;
+            return out;
+        }
+
+        const Offer& offer() const { return offer_; }
+        const std::string& path() const { return path_; }
+        std::uint32_t to() const { return to_; }
+        bool answered() const { return answered_; }
+        bool done() const { return answered_ && acked_ == offer_.size; }
+        std::uint64_t resumed_at() const { return resumed_at_; }
+        // Bytes sent in this attempt, and the seconds since the receiver answered the offer.
+        std::uint64_t transferred() const { return acked_ - resumed_at_; }
+        double seconds() const { return std::chrono::duration<double>(Clock::now() - started_).count(); }
+
+        // The receiver's answer to the offer: reading starts at `offset`. False for an
+        // offset that is not a block boundary within the file, or if the file is gone or
+        // no longer has the offered size and mtime.
+        bool start(std::uint64_t offset) {
+            if (answered_ || offset > offer_.size || (offset % offer_.block != 0 && offset != offer_.size)) return false;
+            answered_ = true;
+            started_ = Clock::now();
+            resumed_at_ = sent_ = acked_ = offset;
+            if (offset == offer_.size) return true;
+            if (!unchanged()) return false;
+            try {
+                reader_.emplace(FileParser::FileBlockIterator::startingAt(
+                    path_, static_cast<std::streamsize>(offer_.block), static_cast<std::streamoff>(offset)));
+            } catch (const std::exception&) {
+                return false;
+            }
+            return true;
+        }
+
+        // A later ack; acks only ever move the window forward.
+        void acknowledge(std::uint64_t received) {
+            if (received > acked_ && received <= sent_) acked_ = received;
+            if (acked_ == offer_.size) reader_.reset();
+        }
+
+        // Hands `emit` one frame per block until the window is full or the file is sent.
+        // False if the file no longer matches the offer or a block cannot be encrypted.
+        template<typename Emit>
+        bool pump(Emit&& emit) {
+            while (reader_ && sent_ < offer_.size && sent_ - acked_ < kWindowBytes) {
+                const std::vector<char>& block = **reader_;
+                if (block.empty() || block.size() > offer_.size - sent_) return false;
+                if (block.size() != offer_.block && sent_ + block.size() != offer_.size) return false;
+                std::size_t payload = kChunkOverhead + block.size();
+                bool ok = false;
+                std::string frame;
+                frame.resize_and_overwrite(Protocol::kFrameHeaderSize + payload, [&](char* p, std::size_t n) {
+                    Protocol::FrameHeader h;
+                    h.length = static_cast<std::uint32_t>(payload);
+                    h.type = Protocol::FrameType::FileChunk;
+                    h.peer = to_;
+                    h.encode(p);
+                    char* chunk = p + Protocol::kFrameHeaderSize;
+                    Protocol::put_u32(chunk, offer_.id);
+                    Protocol::put_u64(chunk + 4, sent_);
+                    Crypto::GcmIv iv;
+                    auto* sealed = reinterpret_cast<unsigned char*>(chunk + kChunkHeaderSize + iv.size());
+                    ok = crypto_.aes_gcm_encrypt(offer_.key, as_bytes(block.data(), block.size()), iv,
+                                                 std::span<unsigned char>(sealed, block.size() + Crypto::kGcmTagSize),
+                                                 as_bytes(chunk, kChunkHeaderSize));
+                    std::memcpy(chunk + kChunkHeaderSize, iv.data(), iv.size());
+                    return n;
+                });
+                if (!ok) return false;
+                // Everything sent has been read by now, so a write in place that kept the
+                // size shows as a new mtime here, before the receiver can complete the file.
+                if (sent_ + block.size() == offer_.size && !unchanged()) return false;
+                sent_ += block.size();
+                ++*reader_;
+                emit(std::move(frame));
+            }
+            return true;
+        }
+
+    private:
+        Outgoing() = default;
+
+        static bool stat(const std::filesystem::path& path, std::uint64_t& size, std::uint64_t& mtime) {
+            std::error_code ec;
+            size = std::filesystem::file_size(path, ec);
+            if (ec) return false;
+            auto written = std::filesystem::last_write_time(path, ec);
+            if (ec) return false;
+            mtime = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::file_clock::to_sys(written).time_since_epoch()).count());
+            return true;
+        }
+
+        bool unchanged() const {
+            std::uint64_t size = 0, mtime = 0;
+            return stat(path_, size, mtime) && size == offer_.size && mtime == offer_.mtime;
+        }
+
+        std::string path_;
+        std::uint32_t to_ = 0;
+        Offer offer_;
+        Crypto crypto_;
+        std::optional<FileParser::FileBlockIterator> reader_;
+        bool answered_ = false;
+        std::uint64_t resumed_at_ = 0;
+        std::uint64_t sent_ = 0;
+        std::uint64_t acked_ = 0;
+        Clock::time_point started_;
+    };
+
+    // Receiver side of one transfer. Chunks are decrypted and written to a .part file in
+    // the download directory as they arrive, and the file is renamed once complete. The
+    // .part name carries the offered size and mtime, so a new offer of the same file
+    // resumes from it and an offer of a different file with the same name does not.
+    class Incoming {
+    public:
+        // nullopt if the name is not a plain file name or the .part file cannot be opened.
+        static std::optional<Incoming> open(const Offer& offer, const std::filesystem::path& dir, std::uint32_t from) {
+            std::filesystem::path name = std::filesystem::path(offer.name).filename();
+            if (name.empty() || name != offer.name || name == "." || name == "..") return std::nullopt;
+            std::error_code ec;
+            std::filesystem::create_directories(dir, ec);
+            Incoming in;
+            in.offer_ = offer;
+            in.from_ = from;
+            in.target_ = dir / name;
+            in.part_ = dir / (name.string() + "." + std::to_string(offer.size) + "-" + std::to_string(offer.mtime) + ".part");
+
+            std::uint64_t existing = std::filesystem::exists(in.part_, ec) ? std::filesystem::file_size(in.part_, ec) : 0;
+            if (ec) existing = 0;
+            in.received_ = existing >= offer.size ? offer.size : existing / offer.block * offer.block;
+            { std::ofstream create(in.part_, std::ios::binary | std::ios::app); }
+            std::filesystem::resize_file(in.part_, in.received_, ec);
+            if (ec) return std::nullopt;
+            in.out_.open(in.part_, std::ios::binary | std::ios::in | std::ios::out);
+            if (!in.out_) return std::nullopt;
+            in.out_.seekp(static_cast<std::streamoff>(in.received_));
+            return in;
+        }
+
+        const Offer& offer() const { return offer_; }
+        std::uint32_t from() const { return from_; }
+        std::uint64_t received() const { return received_; }
+        bool done() const { return received_ == offer_.size; }
+
+        // Checks, decrypts and writes one FileChunk payload; false if it is not the next
+        // chunk, fails authentication or cannot be written.
+        bool write(std::string_view payload) {
+            if (payload.size() < kChunkOverhead || transfer_id(payload) != offer_.id) return false;
+            if (Protocol::get_u64(payload.data() + 4) != received_) return false;
+            std::size_t size = payload.size() - kChunkOverhead;
+            if (size == 0 || size > offer_.size - received_) return false;
+            if (size != offer_.block && received_ + size != offer_.size) return false;
+            Crypto::GcmIv iv;
+            std::memcpy(iv.data(), payload.data() + kChunkHeaderSize, iv.size());
+            plain_.resize(size);
+            auto sealed = payload.substr(kChunkHeaderSize + iv.size());
+            if (!crypto_.aes_gcm_decrypt(offer_.key, iv, as_bytes(sealed.data(), sealed.size()), plain_,
+                                         as_bytes(payload.data(), kChunkHeaderSize))) {
+                return false;
+            }
+            out_.write(reinterpret_cast<const char*>(plain_.data()), static_cast<std::streamsize>(size));
+            if (!out_) return false;
+            received_ += size;
+            return true;
+        }
+
+        // Closes the .part file and moves it into place; returns the final path, empty
+        // on failure.
+        std::filesystem::path finish() {
+            out_.close();
+            if (out_.fail()) return {};
+            return move_into_place(part_, target_);
+        }
+
+    private:
+        Incoming() = default;
+
+        Offer offer_;
+        std::uint32_t from_ = 0;
+        std::filesystem::path target_;
+        std::filesystem::path part_;
+        std::fstream out_;
+        std::uint64_t received_ = 0;
+        std::vector<unsigned char> plain_;
+        Crypto crypto_;
+    };
+} // CPCDMessenger::Transfer
@@ -3,20 +3,53 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <span>
+#include <iterator>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <utility>
+#include <memory>
+#include <optional>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <filesystem>
+#include <limits>
+#include <string_view>
 #include <stdexcept>
 
 #ifdef _WIN32
     #include <windows.h>
 #else
+    #include <sys/mman.h>
     #include <sys/stat.h>
+    #include <fcntl.h>
     #include <unistd.h>
 #endif
+#ifdef __linux__
+    #include <poll.h>
+    #include <sys/eventfd.h>
+    #include <sys/inotify.h>
+#endif
 
 namespace FileParser {
+    // With `trackContent` an identity also keeps the file's size and modification time,
+    // so a write in place compares unequal too, not only a different file at the path.
     class FileIdentity {
 #ifdef _WIN32
     public:
-        explicit FileIdentity(const std::string& path) {
+        explicit FileIdentity(const std::string& path, bool trackContent = false)
+        : tracked(trackContent)
+        {
             HANDLE file = CreateFileA(
                     path.c_str(),
                     GENERIC_READ,
@@ -40,6 +73,8 @@ namespace FileParser {
             volumeSerialNumber = info.dwVolumeSerialNumber;
             fileIndexHigh = info.nFileIndexHigh;
             fileIndexLow = info.nFileIndexLow;
+            size = (std::uint64_t(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+            mtime = (std::uint64_t(info.ftLastWriteTime.dwHighDateTime) << 32) | info.ftLastWriteTime.dwLowDateTime;
 
             CloseHandle(file);
         }
@@ -47,7 +82,8 @@ namespace FileParser {
         bool operator==(const FileIdentity& other) const {
             return volumeSerialNumber == other.volumeSerialNumber &&
                    fileIndexHigh == other.fileIndexHigh &&
-                   fileIndexLow == other.fileIndexLow;
+                   fileIndexLow == other.fileIndexLow &&
+                   (!tracked || !other.tracked || (size == other.size && mtime == other.mtime));
         }
 
         bool operator!=(const FileIdentity& other) const {
@@ -58,25 +94,231 @@ namespace FileParser {
         DWORD volumeSerialNumber;
         DWORD fileIndexHigh;
         DWORD fileIndexLow;
+        std::uint64_t size;
+        std::uint64_t mtime;
+        bool tracked;
 
 #else
     public:
-        FileIdentity(const std::string& path) {
+        FileIdentity(const std::string& path, bool trackContent = false) {
         struct stat s;
         if (stat(path.c_str(), &s) != 0) {
             throw std::runtime_error("stat() failed for file: " + path);
         }
         dev = s.st_dev;
         ino = s.st_ino;
+        size = s.st_size;
+        mtime = std::int64_t(s.st_mtim.tv_sec) * 1000000000 + s.st_mtim.tv_nsec;
+        tracked = trackContent;
     }
 
     bool operator==(const FileIdentity& other) const {
-        return dev == other.dev && ino == other.ino;
+        return dev == other.dev && ino == other.ino &&
+               (!tracked || !other.tracked || (size == other.size && mtime == other.mtime));
     }
 
     private:
         dev_t dev;
         ino_t ino;
+        off_t size;
+        std::int64_t mtime;
+        bool tracked;
+#endif
+    };
+
+    // How a FileBlockIterator notices that its file changed while it is read. The
+    // identity is always taken when the file is opened; the mode decides when it is
+    // compared again, which costs a stat() (on Windows an open and a query):
+    //   EveryCopy  on every copy of the iterator, post-increment included
+    //   OnOpen     never again
+    //   Periodic   on a copy, at most once per `interval`
+    //   Notify     on a copy after inotify reported an event on the file, so an
+    //              uneventful copy costs one atomic load. inotify only sees changes made
+    //              through the local kernel: on NFS and other network file systems,
+    //              writes from other hosts go unseen, use Periodic there. Falls back to
+    //              Periodic where the file cannot be watched or off Linux.
+    struct ChangePolicy {
+        enum class Mode { EveryCopy, OnOpen, Periodic, Notify };
+
+        Mode mode = Mode::EveryCopy;
+        bool trackContent = false;
+        std::chrono::milliseconds interval{1000};
+    };
+
+#ifdef __linux__
+    // One inotify instance and one thread for the process. Watchers of a file share its
+    // watch descriptor; an event sets the flag of every watcher of that file.
+    class ChangeNotifier {
+    public:
+        using Flag = std::shared_ptr<std::atomic<bool>>;
+
+        static ChangeNotifier& instance() {
+            static ChangeNotifier notifier;
+            return notifier;
+        }
+
+        // The watch descriptor, or -1 if the file cannot be watched.
+        int add(const std::string& path, std::uint32_t mask, const Flag& flag) {
+            if (inotify_ < 0) return -1;
+            std::lock_guard<std::mutex> lk(mutex_);
+            // IN_MASK_ADD: a second watcher of the same inode must not narrow the first one's mask.
+            int wd = inotify_add_watch(inotify_, path.c_str(), mask | IN_MASK_ADD);
+            if (wd >= 0) watchers_[wd].push_back(flag);
+            return wd;
+        }
+
+        void remove(int wd, const Flag& flag) {
+            std::lock_guard<std::mutex> lk(mutex_);
+            auto it = watchers_.find(wd);
+            if (it == watchers_.end()) return;
+            std::erase(it->second, flag);
+            if (it->second.empty()) {
+                inotify_rm_watch(inotify_, wd);
+                watchers_.erase(it);
+            }
+        }
+
+    private:
+        ChangeNotifier()
+        : inotify_(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+          wake_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+        {
+            if (inotify_ < 0 || wake_ < 0) {
+                if (inotify_ >= 0) ::close(inotify_);
+                if (wake_ >= 0) ::close(wake_);
+                inotify_ = wake_ = -1;
+                return;
+            }
+            thread_ = std::thread([this] { run(); });
+        }
+
+        ~ChangeNotifier() {
+            if (thread_.joinable()) {
+                std::uint64_t one = 1;
+                if (::write(wake_, &one, sizeof(one)) == sizeof(one)) thread_.join();
+                else thread_.detach();
+            }
+            if (inotify_ >= 0) ::close(inotify_);
+            if (wake_ >= 0) ::close(wake_);
+        }
+
+        void run() {
+            alignas(inotify_event) char buffer[4096];
+            pollfd fds[2] = {{inotify_, POLLIN, 0}, {wake_, POLLIN, 0}};
+            for (;;) {
+                if (::poll(fds, 2, -1) < 0) {
+                    if (errno == EINTR) continue;
+                    return;
+                }
+                if (fds[1].revents) return;
+                ssize_t n = ::read(inotify_, buffer, sizeof(buffer));
+                if (n <= 0) continue;
+                std::lock_guard<std::mutex> lk(mutex_);
+                for (char* p = buffer; p < buffer + n;) {
+                    auto* event = reinterpret_cast<inotify_event*>(p);
+                    p += sizeof(inotify_event) + event->len;
+                    if (event->mask & IN_Q_OVERFLOW) {
+                        for (auto& [wd, flags] : watchers_) {
+                            for (auto& flag : flags) flag->store(true, std::memory_order_release);
+                        }
+                        continue;
+                    }
+                    auto it = watchers_.find(event->wd);
+                    if (it == watchers_.end()) continue;
+                    for (auto& flag : it->second) flag->store(true, std::memory_order_release);
+                    // The kernel dropped the watch and may reuse the descriptor.
+                    if (event->mask & IN_IGNORED) watchers_.erase(it);
+                }
+            }
+        }
+
+        int inotify_;
+        int wake_;
+        std::mutex mutex_;
+        std::unordered_map<int, std::vector<Flag>> watchers_;
+        std::thread thread_;
+    };
+#endif
+
+    // The identity a file had when it was opened and what the policy needs to decide when
+    // to compare it again; shared by an iterator and its copies. A change once seen stays
+    // seen.
+    class FileWatch {
+    public:
+        FileWatch(std::string path, const FileIdentity& opened, ChangePolicy policy)
+        : path_(std::move(path)),
+          opened_(policy.trackContent ? FileIdentity(path_, true) : opened),
+          policy_(policy),
+          lastCheck_(Clock::now().time_since_epoch().count())
+        {
+            if (policy_.mode != ChangePolicy::Mode::Notify) return;
+#ifdef __linux__
+            flag_ = std::make_shared<std::atomic<bool>>(false);
+            // The path being deleted or replaced shows as a link count change on our inode.
+            std::uint32_t mask = IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF | (policy_.trackContent ? IN_MODIFY : 0);
+            wd_ = ChangeNotifier::instance().add(path_, mask, flag_);
+            if (wd_ >= 0) return;
+            flag_.reset();
+#endif
+            policy_.mode = ChangePolicy::Mode::Periodic;
+        }
+
+        FileWatch(const FileWatch&) = delete;
+        FileWatch& operator=(const FileWatch&) = delete;
+
+        ~FileWatch() {
+#ifdef __linux__
+            if (flag_) ChangeNotifier::instance().remove(wd_, flag_);
+#endif
+        }
+
+        // Throws if the file is known to have changed since it was opened.
+        void verify() const {
+            if (changed_.load(std::memory_order_relaxed)) throwChanged();
+            switch (policy_.mode) {
+                case ChangePolicy::Mode::EveryCopy:
+                    compare();
+                    break;
+                case ChangePolicy::Mode::OnOpen:
+                    break;
+                case ChangePolicy::Mode::Periodic: {
+                    auto now = Clock::now().time_since_epoch().count();
+                    auto last = lastCheck_.load(std::memory_order_relaxed);
+                    auto interval = std::chrono::duration_cast<Clock::duration>(policy_.interval).count();
+                    if (now - last < interval || !lastCheck_.compare_exchange_strong(last, now)) break;
+                    compare();
+                    break;
+                }
+                case ChangePolicy::Mode::Notify:
+#ifdef __linux__
+                    if (flag_->exchange(false, std::memory_order_acquire)) compare();
+#endif
+                    break;
+            }
+        }
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        void compare() const {
+            if (FileIdentity(path_, policy_.trackContent) != opened_) {
+                changed_.store(true, std::memory_order_relaxed);
+                throwChanged();
+            }
+        }
+
+        [[noreturn]] void throwChanged() const {
+            throw std::runtime_error("Underlying file has changed during iteration: " + path_);
+        }
+
+        std::string                         path_;
+        FileIdentity                        opened_;
+        ChangePolicy                        policy_;
+        mutable std::atomic<Clock::rep>     lastCheck_;
+        mutable std::atomic<bool>           changed_{false};
+#ifdef __linux__
+        std::shared_ptr<std::atomic<bool>>  flag_;
+        int                                 wd_ = -1;
 #endif
     };
 
@@ -93,8 +335,14 @@ namespace FileParser {
         {}
 
         FileBlockIterator(const char* path, std::streamsize blockSize, bool is_end = false)
+                : FileBlockIterator(path, blockSize, ChangePolicy{}, is_end)
+        {}
+
+        // Copies check the file as `policy` says; the copies of an iterator share its watch.
+        FileBlockIterator(const std::string& path, std::streamsize blockSize, ChangePolicy policy, bool is_end = false)
         : path_(path),
           fileID_(path),
+          watch_(std::make_shared<const FileWatch>(path, fileID_, policy)),
           in_(path, std::ios::binary),
           blockSize_(blockSize),
           position_(0),
@@ -106,6 +354,20 @@ namespace FileParser {
             ++(*this);
         }
 
+        // An iterator whose first block starts `offset` bytes into the file, e.g. to resume
+        // a transfer at a block boundary; an offset at or past the end gives an end iterator.
+        static FileBlockIterator startingAt(const std::string& path, std::streamsize blockSize, std::streamoff offset,
+                                            ChangePolicy policy = {}) {
+            FileBlockIterator it(path, blockSize, policy, true);
+            it.isEnd_ = false;
+            it.in_.seekg(offset);
+            if (it.in_.fail()) {
+                throw std::runtime_error("Failed to seek to position");
+            }
+            it.readBlock();
+            return it;
+        }
+
         ~FileBlockIterator() {
             if (in_.is_open()) {
                 in_.close();
@@ -115,6 +377,7 @@ namespace FileParser {
         FileBlockIterator(const FileBlockIterator& other)
         : path_(other.path_),
           fileID_(other.fileID_),
+          watch_(other.watch_),
           blockSize_(other.blockSize_),
           buffer_(other.buffer_),
           position_(other.position_),
@@ -146,6 +409,7 @@ namespace FileParser {
 
             path_ = other.path_;
             fileID_ = other.fileID_;
+            watch_ = other.watch_;
             buffer_ = other.buffer_;
             blockSize_ = other.blockSize_;
             position_ = other.position_;
@@ -171,6 +435,7 @@ namespace FileParser {
         FileBlockIterator(FileBlockIterator&& other) noexcept
         : path_(std::move(other.path_)),
           fileID_(std::move(other.fileID_)),
+          watch_(std::move(other.watch_)),
           in_(std::move(other.in_)),
           buffer_(std::move(other.buffer_)),
           blockSize_(other.blockSize_),
@@ -186,6 +451,7 @@ namespace FileParser {
 
             path_ = std::move(other.path_);
             fileID_ = std::move(other.fileID_);
+            watch_ = std::move(other.watch_);
             in_ = std::move(other.in_);
             buffer_ = std::move(other.buffer_);
             blockSize_ = other.blockSize_;
@@ -223,8 +489,7 @@ namespace FileParser {
 
     private:
         void verifyFileUnchanged() const {
-            if (FileIdentity(path_) != fileID_)
-                throw std::runtime_error("Underlying file has changed during iteration: " + path_);
+            if (watch_) watch_->verify();
         }
 
         void readBlock() {
@@ -243,12 +508,797 @@ namespace FileParser {
             }
         }
 
+        std::string                         path_;
+        FileIdentity                        fileID_;
+        std::shared_ptr<const FileWatch>    watch_;
+        std::ifstream                       in_;
+        std::vector<char>                   buffer_;
+        std::streamsize                     blockSize_;
+        std::streampos                      position_;
+        bool                                isEnd_;
+    };
+
+    // The whole file mapped read-only and cut into blocks of `blockSize` bytes, handed out
+    // as views into the mapping. Nothing is zero-filled or copied into a buffer, and an
+    // iterator is an offset, so copying one does not reopen the file. The kernel is told
+    // the access is sequential so it reads ahead and drops pages behind. Views stay valid
+    // for the lifetime of the range. FileIdentity catches the path being replaced by
+    // another file, as with FileBlockIterator; a file truncated in place while mapped is
+    // not caught and faults on access to the lost pages.
+    class MappedBlockRange {
+    public:
+        class iterator {
+        public:
+            using iterator_concept  = std::forward_iterator_tag;
+            using iterator_category = std::input_iterator_tag;
+            using value_type        = std::span<const char>;
+            using difference_type   = std::ptrdiff_t;
+            using reference         = std::span<const char>;
+
+            iterator() = default;
+
+            reference operator*() const {
+                return {data_ + offset_, std::min(blockSize_, size_ - offset_)};
+            }
+
+            iterator& operator++() {
+                offset_ = std::min(offset_ + blockSize_, size_);
+                return *this;
+            }
+
+            iterator operator++(int) {
+                iterator tmp = *this;
+                ++(*this);
+                return tmp;
+            }
+
+            bool operator==(const iterator& other) const {
+                return data_ == other.data_ && offset_ == other.offset_;
+            }
+
+        private:
+            friend class MappedBlockRange;
+
+            iterator(const char* data, std::size_t size, std::size_t blockSize, std::size_t offset)
+            : data_(data), size_(size), blockSize_(blockSize), offset_(offset)
+            {}
+
+            const char*  data_ = nullptr;
+            std::size_t  size_ = 0;
+            std::size_t  blockSize_ = 1;
+            std::size_t  offset_ = 0;
+        };
+
+        MappedBlockRange(const std::string& path, std::size_t blockSize)
+        : path_(path),
+          fileID_(path),
+          blockSize_(blockSize)
+        {
+            if (blockSize_ == 0) {
+                throw std::invalid_argument("Block size must be positive");
+            }
+            map();
+        }
+
+        ~MappedBlockRange() {
+            unmap();
+        }
+
+        MappedBlockRange(const MappedBlockRange&) = delete;
+        MappedBlockRange& operator=(const MappedBlockRange&) = delete;
+
+        MappedBlockRange(MappedBlockRange&& other) noexcept
+        : path_(std::move(other.path_)),
+          fileID_(other.fileID_),
+          blockSize_(other.blockSize_),
+          data_(std::exchange(other.data_, nullptr)),
+          size_(std::exchange(other.size_, 0))
+#ifdef _WIN32
+          , file_(std::exchange(other.file_, INVALID_HANDLE_VALUE)),
+          mapping_(std::exchange(other.mapping_, nullptr))
+#endif
+        {
+        }
+
+        MappedBlockRange& operator=(MappedBlockRange&& other) noexcept {
+            if (this == &other) {
+                return *this;
+            }
+
+            unmap();
+            path_ = std::move(other.path_);
+            fileID_ = other.fileID_;
+            blockSize_ = other.blockSize_;
+            data_ = std::exchange(other.data_, nullptr);
+            size_ = std::exchange(other.size_, 0);
+#ifdef _WIN32
+            file_ = std::exchange(other.file_, INVALID_HANDLE_VALUE);
+            mapping_ = std::exchange(other.mapping_, nullptr);
+#endif
+            return *this;
+        }
+
+        // Checks that the path still names the mapped file before the first block.
+        iterator begin() const {
+            verifyFileUnchanged();
+            return {data_, size_, blockSize_, 0};
+        }
+
+        iterator end() const { return {data_, size_, blockSize_, size_}; }
+
+        std::span<const char> data() const { return {data_, size_}; }
+
+        std::size_t size() const { return size_; }
+
+        void verifyFileUnchanged() const {
+            if (FileIdentity(path_) != fileID_)
+                throw std::runtime_error("Underlying file has changed during iteration: " + path_);
+        }
+
+    private:
+#ifdef _WIN32
+        void map() {
+            file_ = CreateFileA(path_.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            if (file_ == INVALID_HANDLE_VALUE) {
+                throw std::runtime_error("CreateFileA failed for: " + path_);
+            }
+            LARGE_INTEGER size;
+            if (!GetFileSizeEx(file_, &size)) {
+                unmap();
+                throw std::runtime_error("GetFileSizeEx failed for: " + path_);
+            }
+            size_ = static_cast<std::size_t>(size.QuadPart);
+            if (size_ == 0) {
+                return;
+            }
+            mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping_ != nullptr) {
+                data_ = static_cast<const char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+            }
+            if (data_ == nullptr) {
+                unmap();
+                throw std::runtime_error("Failed to map file: " + path_);
+            }
+        }
+
+        void unmap() {
+            if (data_ != nullptr) UnmapViewOfFile(data_);
+            if (mapping_ != nullptr) CloseHandle(mapping_);
+            if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+            data_ = nullptr;
+            mapping_ = nullptr;
+            file_ = INVALID_HANDLE_VALUE;
+            size_ = 0;
+        }
+#else
+        void map() {
+            int fd = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                throw std::runtime_error("Failed to open file: " + path_);
+            }
+            struct stat s;
+            if (fstat(fd, &s) != 0) {
+                ::close(fd);
+                throw std::runtime_error("fstat() failed for file: " + path_);
+            }
+            size_ = static_cast<std::size_t>(s.st_size);
+            if (size_ > 0) {
+                void* p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p == MAP_FAILED) {
+                    ::close(fd);
+                    size_ = 0;
+                    throw std::runtime_error("mmap() failed for file: " + path_);
+                }
+                data_ = static_cast<const char*>(p);
+                madvise(p, size_, MADV_SEQUENTIAL);
+            }
+            ::close(fd);
+        }
+
+        void unmap() {
+            if (data_ != nullptr) munmap(const_cast<char*>(data_), size_);
+            data_ = nullptr;
+            size_ = 0;
+        }
+#endif
+
         std::string         path_;
         FileIdentity        fileID_;
-        std::ifstream       in_;
+        std::size_t         blockSize_;
+        const char*         data_ = nullptr;
+        std::size_t         size_ = 0;
+#ifdef _WIN32
+        HANDLE              file_ = INVALID_HANDLE_VALUE;
+        HANDLE              mapping_ = nullptr;
+#endif
+    };
+
+    // Reads a file ahead of its consumers. Reader threads fill a fixed set of `depth`
+    // buffers with the next blocks, each read at its own offset, while consumer threads
+    // work on blocks handed out earlier; a buffer is reused once its Block is destroyed,
+    // so nothing is allocated after construction. Ordered delivery hands blocks out by
+    // index; unordered hands out whichever block is read first, which only differs with
+    // more than one reader. Consumers still finish in any order, Block::index() tells
+    // them where a block belongs. next() and forEach() may be called from any thread.
+    // Blocks must be destroyed before the pipeline.
+    class BlockPipeline {
+    public:
+        enum class Delivery { Ordered, Unordered };
+
+        class Block {
+        public:
+            Block(Block&& other) noexcept
+            : owner_(std::exchange(other.owner_, nullptr)), slot_(other.slot_), index_(other.index_),
+              offset_(other.offset_), data_(other.data_)
+            {}
+
+            Block& operator=(Block&& other) noexcept {
+                if (this != &other) {
+                    release();
+                    owner_ = std::exchange(other.owner_, nullptr);
+                    slot_ = other.slot_;
+                    index_ = other.index_;
+                    offset_ = other.offset_;
+                    data_ = other.data_;
+                }
+                return *this;
+            }
+
+            ~Block() {
+                release();
+            }
+
+            std::size_t index() const { return index_; }
+            std::uint64_t offset() const { return offset_; }
+            std::span<const char> data() const { return data_; }
+
+        private:
+            friend class BlockPipeline;
+
+            Block(BlockPipeline* owner, std::size_t slot, std::size_t index, std::uint64_t offset, std::span<const char> data)
+            : owner_(owner), slot_(slot), index_(index), offset_(offset), data_(data)
+            {}
+
+            void release() {
+                if (owner_ != nullptr) std::exchange(owner_, nullptr)->release(slot_);
+            }
+
+            BlockPipeline*        owner_;
+            std::size_t           slot_;
+            std::size_t           index_;
+            std::uint64_t         offset_;
+            std::span<const char> data_;
+        };
+
+        BlockPipeline(const std::string& path, std::size_t blockSize, std::size_t depth = 8,
+                      std::size_t readers = 1, Delivery delivery = Delivery::Ordered)
+        : path_(path),
+          fileID_(path),
+          blockSize_(blockSize),
+          delivery_(delivery),
+          slots_(std::max<std::size_t>(depth, 1))
+        {
+            if (blockSize_ == 0) {
+                throw std::invalid_argument("Block size must be positive");
+            }
+            open();
+            verifyFileUnchanged();
+            blockCount_ = static_cast<std::size_t>((size_ + blockSize_ - 1) / blockSize_);
+            for (auto& slot : slots_) {
+                slot.buffer = std::make_unique_for_overwrite<char[]>(blockSize_);
+            }
+            for (std::size_t i = 0; i < std::max<std::size_t>(readers, 1); ++i) {
+                readers_.emplace_back([this] { readLoop(); });
+            }
+        }
+
+        ~BlockPipeline() {
+            cancel();
+            for (auto& reader : readers_) {
+                reader.join();
+            }
+            close();
+        }
+
+        BlockPipeline(const BlockPipeline&) = delete;
+        BlockPipeline& operator=(const BlockPipeline&) = delete;
+
+        // The next block, waiting for it to be read; nullopt once every block was handed
+        // out or after cancel(). Rethrows a read error.
+        std::optional<Block> next() {
+            std::unique_lock<std::mutex> lock(mutex_);
+            std::size_t slot = 0;
+            readyCv_.wait(lock, [&] {
+                return error_ || stopped_ || delivered_ == blockCount_ || findReady(slot);
+            });
+            if (error_) {
+                std::rethrow_exception(error_);
+            }
+            if (stopped_ || delivered_ == blockCount_) {
+                return std::nullopt;
+            }
+            Slot& s = slots_[slot];
+            s.state = SlotState::Leased;
+            ++delivered_;
+            if (delivery_ == Delivery::Ordered) {
+                ++nextOrdered_;
+            }
+            return Block(this, slot, s.index, static_cast<std::uint64_t>(s.index) * blockSize_,
+                         std::span<const char>(s.buffer.get(), s.size));
+        }
+
+        // Runs fn(const Block&) on `workers` threads, the calling thread being one of them,
+        // until the file is done. The first exception from fn or a read stops the rest and
+        // is rethrown here.
+        template<typename F>
+        void forEach(std::size_t workers, F&& fn) {
+            std::exception_ptr failure;
+            std::mutex failureMutex;
+            auto work = [&] {
+                try {
+                    while (auto block = next()) {
+                        fn(static_cast<const Block&>(*block));
+                    }
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(failureMutex);
+                    if (!failure) failure = std::current_exception();
+                    cancel();
+                }
+            };
+            std::vector<std::thread> threads;
+            for (std::size_t i = 1; i < workers; ++i) {
+                threads.emplace_back(work);
+            }
+            work();
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            if (failure) {
+                std::rethrow_exception(failure);
+            }
+        }
+
+        // Stops reading ahead and makes next() return nullopt.
+        void cancel() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopped_ = true;
+            }
+            readyCv_.notify_all();
+            freeCv_.notify_all();
+        }
+
+        std::size_t blockCount() const { return blockCount_; }
+
+        std::uint64_t size() const { return size_; }
+
+        void verifyFileUnchanged() const {
+            if (FileIdentity(path_) != fileID_)
+                throw std::runtime_error("Underlying file has changed during iteration: " + path_);
+        }
+
+    private:
+        enum class SlotState { Free, Reading, Ready, Leased };
+
+        struct Slot {
+            std::unique_ptr<char[]> buffer;
+            SlotState               state = SlotState::Free;
+            std::size_t             index = 0;
+            std::size_t             size = 0;
+        };
+
+        // Called with mutex_ held.
+        bool findReady(std::size_t& slot) const {
+            bool found = false;
+            for (std::size_t i = 0; i < slots_.size(); ++i) {
+                const Slot& s = slots_[i];
+                if (s.state != SlotState::Ready) continue;
+                if (delivery_ == Delivery::Ordered ? s.index == nextOrdered_ : !found || s.index < slots_[slot].index) {
+                    slot = i;
+                    found = true;
+                }
+            }
+            return found;
+        }
+
+        void release(std::size_t slot) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                slots_[slot].state = SlotState::Free;
+            }
+            freeCv_.notify_one();
+        }
+
+        void readLoop() {
+            while (true) {
+                std::unique_lock<std::mutex> lock(mutex_);
+                std::size_t slot = 0;
+                freeCv_.wait(lock, [&] {
+                    if (stopped_ || error_ || nextRead_ == blockCount_) return true;
+                    for (slot = 0; slot < slots_.size(); ++slot) {
+                        if (slots_[slot].state == SlotState::Free) return true;
+                    }
+                    return false;
+                });
+                if (stopped_ || error_ || nextRead_ == blockCount_) {
+                    return;
+                }
+                Slot& s = slots_[slot];
+                s.state = SlotState::Reading;
+                s.index = nextRead_++;
+                lock.unlock();
+
+                std::uint64_t offset = static_cast<std::uint64_t>(s.index) * blockSize_;
+                std::size_t n = static_cast<std::size_t>(std::min<std::uint64_t>(blockSize_, size_ - offset));
+                std::exception_ptr failure;
+                try {
+                    readAt(offset, s.buffer.get(), n);
+                } catch (...) {
+                    failure = std::current_exception();
+                }
+
+                lock.lock();
+                if (failure) {
+                    if (!error_) error_ = failure;
+                    lock.unlock();
+                    readyCv_.notify_all();
+                    freeCv_.notify_all();
+                    return;
+                }
+                s.size = n;
+                s.state = SlotState::Ready;
+                lock.unlock();
+                readyCv_.notify_all();
+            }
+        }
+
+#ifdef _WIN32
+        void open() {
+            file_ = CreateFileA(path_.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            if (file_ == INVALID_HANDLE_VALUE) {
+                throw std::runtime_error("CreateFileA failed for: " + path_);
+            }
+            LARGE_INTEGER size;
+            if (!GetFileSizeEx(file_, &size)) {
+                close();
+                throw std::runtime_error("GetFileSizeEx failed for: " + path_);
+            }
+            size_ = static_cast<std::uint64_t>(size.QuadPart);
+        }
+
+        void close() {
+            if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+            file_ = INVALID_HANDLE_VALUE;
+        }
+
+        void readAt(std::uint64_t offset, char* out, std::size_t n) const {
+            while (n > 0) {
+                OVERLAPPED at{};
+                at.Offset = static_cast<DWORD>(offset);
+                at.OffsetHigh = static_cast<DWORD>(offset >> 32);
+                DWORD got = 0;
+                if (!ReadFile(file_, out, static_cast<DWORD>(n), &got, &at) || got == 0) {
+                    throw std::runtime_error("Failed to read block of: " + path_);
+                }
+                out += got;
+                offset += got;
+                n -= got;
+            }
+        }
+#else
+        void open() {
+            fd_ = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd_ < 0) {
+                throw std::runtime_error("Failed to open file: " + path_);
+            }
+            struct stat s;
+            if (fstat(fd_, &s) != 0) {
+                close();
+                throw std::runtime_error("fstat() failed for file: " + path_);
+            }
+            size_ = static_cast<std::uint64_t>(s.st_size);
+            posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+
+        void close() {
+            if (fd_ >= 0) ::close(fd_);
+            fd_ = -1;
+        }
+
+        void readAt(std::uint64_t offset, char* out, std::size_t n) const {
+            while (n > 0) {
+                ssize_t got = pread(fd_, out, n, static_cast<off_t>(offset));
+                if (got < 0 && errno == EINTR) continue;
+                if (got <= 0) {
+                    throw std::runtime_error("Failed to read block of: " + path_);
+                }
+                out += got;
+                offset += static_cast<std::uint64_t>(got);
+                n -= static_cast<std::size_t>(got);
+            }
+        }
+#endif
+
+        std::string              path_;
+        FileIdentity             fileID_;
+        std::size_t              blockSize_;
+        Delivery                 delivery_;
+        std::uint64_t            size_ = 0;
+        std::size_t              blockCount_ = 0;
+#ifdef _WIN32
+        HANDLE                   file_ = INVALID_HANDLE_VALUE;
+#else
+        int                      fd_ = -1;
+#endif
+        std::mutex               mutex_;
+        std::condition_variable  freeCv_;
+        std::condition_variable  readyCv_;
+        std::vector<Slot>        slots_;
+        std::size_t              nextRead_ = 0;
+        std::size_t              nextOrdered_ = 0;
+        std::size_t              delivered_ = 0;
+        bool                     stopped_ = false;
+        std::exception_ptr       error_;
+        std::vector<std::thread> readers_;
+    };
+
+    // Content-defined chunking (FastCDC) of a file read through FileBlockIterator. Cut
+    // points depend only on the bytes around them: a gear hash rolls over the data and a
+    // chunk ends where its top bits are zero, with a stricter mask before the average
+    // size and a looser one after it, so chunk sizes cluster around the average. An edit
+    // moves the boundaries next to it and no others, and the chunks of an edited or
+    // re-sent file are mostly the chunks seen before. Boundaries are part of the format:
+    // the gear table and the masks must never change.
+    class ContentChunker {
+    public:
+        struct Params {
+            std::size_t minSize = 16 * 1024;
+            std::size_t avgSize = 64 * 1024;     // power of two
+            std::size_t maxSize = 256 * 1024;
+        };
+
+        struct Chunk {
+            std::uint64_t          offset;
+            std::span<const char>  data;
+        };
+
+        explicit ContentChunker(const std::string& path)
+        : ContentChunker(path, Params{})
+        {}
+
+        ContentChunker(const std::string& path, Params params, std::streamsize blockSize = 1 << 20)
+        : params_(params),
+          it_(path, std::max<std::streamsize>(blockSize, static_cast<std::streamsize>(params.maxSize)))
+        {
+            if (params_.minSize == 0 || params_.minSize > params_.avgSize || params_.avgSize > params_.maxSize ||
+                (params_.avgSize & (params_.avgSize - 1)) != 0) {
+                throw std::invalid_argument("Invalid chunk size parameters");
+            }
+        }
+
+        // The next chunk; its data stays valid until the following call. nullopt at the
+        // end of the file.
+        std::optional<Chunk> next() {
+            if (buffer_.size() - pos_ < params_.maxSize) refill();
+            std::size_t available = buffer_.size() - pos_;
+            if (available == 0) return std::nullopt;
+            std::size_t size = cut(buffer_.data() + pos_, available, params_);
+            Chunk chunk{offset_, {buffer_.data() + pos_, size}};
+            pos_ += size;
+            offset_ += size;
+            return chunk;
+        }
+
+        // Length of the chunk that starts at `data`, given `size` bytes from there on; the
+        // whole of `size` if the data ends before a boundary.
+        static std::size_t cut(const char* data, std::size_t size, const Params& params) {
+            if (size <= params.minSize) return size;
+            if (size > params.maxSize) size = params.maxSize;
+            std::size_t normal = std::min(size, params.avgSize);
+            int bits = std::countr_zero(params.avgSize);
+            std::uint64_t strict = ~0ull << (64 - bits - 2);
+            std::uint64_t loose = ~0ull << (64 - bits + 2);
+            auto bytes = reinterpret_cast<const unsigned char*>(data);
+            std::uint64_t hash = 0;
+            std::size_t i = params.minSize;
+            for (; i < normal; ++i) {
+                hash = (hash << 1) + kGear[bytes[i]];
+                if (!(hash & strict)) return i;
+            }
+            for (; i < size; ++i) {
+                hash = (hash << 1) + kGear[bytes[i]];
+                if (!(hash & loose)) return i;
+            }
+            return size;
+        }
+
+    private:
+        // Fixed pseudo-random values, one per byte value (splitmix64 from a fixed seed).
+        static constexpr std::array<std::uint64_t, 256> kGear = [] {
+            std::array<std::uint64_t, 256> table{};
+            std::uint64_t state = 0x43504344u;
+            for (auto& v : table) {
+                std::uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+                v = z ^ (z >> 31);
+            }
+            return table;
+        }();
+
+        // Moves the unread tail to the front and appends blocks until a whole maximal
+        // chunk is buffered or the file ends, so the tail is copied once per block.
+        void refill() {
+            buffer_.erase(buffer_.begin(), buffer_.begin() + static_cast<std::ptrdiff_t>(pos_));
+            pos_ = 0;
+            while (buffer_.size() < params_.maxSize && !it_->empty()) {
+                buffer_.insert(buffer_.end(), it_->begin(), it_->end());
+                ++it_;
+            }
+        }
+
+        Params              params_;
+        FileBlockIterator   it_;
         std::vector<char>   buffer_;
-        std::streamsize     blockSize_;
-        std::streampos      position_;
-        bool                isEnd_;
+        std::size_t         pos_ = 0;
+        std::uint64_t       offset_ = 0;
+    };
+
+    // Newline-delimited records of a file, such as NDJSON, in file order. A record that
+    // lies within one block is a view into that block; only one that crosses a block
+    // boundary is copied, into a carry buffer. Blank lines are skipped and a trailing
+    // '\r' is dropped. A reader can be limited to the records that start in [begin, end):
+    // it then skips the partial record it starts in and reads the one that straddles
+    // `end` to its newline, so adjacent ranges split a file without losing or repeating
+    // a record. forEachRange() and forEach() read such ranges on several threads.
+    class RecordReader {
+    public:
+        static constexpr std::uint64_t kToEnd = std::numeric_limits<std::uint64_t>::max();
+
+        explicit RecordReader(const std::string& path, std::streamsize blockSize = 1 << 20)
+        : RecordReader(path, 0, kToEnd, blockSize)
+        {}
+
+        RecordReader(const std::string& path, std::uint64_t begin, std::uint64_t end, std::streamsize blockSize = 1 << 20)
+        : it_(FileBlockIterator::startingAt(path, checkedBlockSize(blockSize), static_cast<std::streamoff>(begin > 0 ? begin - 1 : 0))),
+          blockOffset_(begin > 0 ? begin - 1 : 0),
+          end_(end),
+          skip_(begin > 0)
+        {}
+
+        // The next record; it stays valid until the following call. nullopt once the
+        // range or the file is done.
+        std::optional<std::string_view> next() {
+            while (skip_ || blockOffset_ + pos_ < end_) {
+                auto line = readLine();
+                if (!line) break;
+                if (skip_) {
+                    // The rest of the line that holds the byte before `begin`.
+                    skip_ = false;
+                    continue;
+                }
+                if (!line->empty() && line->back() == '\r') line->remove_suffix(1);
+                if (!line->empty()) return line;
+            }
+            return std::nullopt;
+        }
+
+        // File offset of the record next() returned last.
+        std::uint64_t offset() const { return offset_; }
+
+        // Cuts the file into ranges of about `rangeBytes` and runs fn(index, RecordReader&)
+        // for each on `workers` threads, the calling thread being one of them. Ranges are
+        // taken in order but finish in any order; `index` tells where a range belongs. The
+        // first exception from fn or a read stops the rest and is rethrown here.
+        template<typename F>
+        static void forEachRange(const std::string& path, std::size_t workers, F&& fn,
+                                 std::uint64_t rangeBytes = 16 << 20, std::streamsize blockSize = 1 << 20) {
+            if (rangeBytes == 0) {
+                throw std::invalid_argument("Range size must be positive");
+            }
+            std::uint64_t size = std::filesystem::file_size(path);
+            std::size_t ranges = static_cast<std::size_t>(std::max<std::uint64_t>(1, (size + rangeBytes - 1) / rangeBytes));
+            std::atomic<std::size_t> nextRange{0};
+            std::atomic<bool> failed{false};
+            std::exception_ptr failure;
+            std::mutex failureMutex;
+            auto work = [&] {
+                try {
+                    while (!failed.load(std::memory_order_relaxed)) {
+                        std::size_t i = nextRange++;
+                        if (i >= ranges) break;
+                        std::uint64_t begin = i * rangeBytes;
+                        std::uint64_t end = i + 1 == ranges ? kToEnd : begin + rangeBytes;
+                        RecordReader records(path, begin, end, blockSize);
+                        fn(i, records);
+                    }
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(failureMutex);
+                    if (!failure) failure = std::current_exception();
+                    failed = true;
+                }
+            };
+            std::vector<std::thread> threads;
+            for (std::size_t i = 1; i < std::min(workers, ranges); ++i) {
+                threads.emplace_back(work);
+            }
+            work();
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            if (failure) {
+                std::rethrow_exception(failure);
+            }
+        }
+
+        // Runs fn(std::string_view) for every record of the file, in no particular order,
+        // and returns how many there were. See forEachRange().
+        template<typename F>
+        static std::uint64_t forEach(const std::string& path, std::size_t workers, F&& fn,
+                                     std::uint64_t rangeBytes = 16 << 20, std::streamsize blockSize = 1 << 20) {
+            std::atomic<std::uint64_t> count{0};
+            forEachRange(path, workers, [&](std::size_t, RecordReader& records) {
+                std::uint64_t n = 0;
+                while (auto record = records.next()) {
+                    fn(*record);
+                    ++n;
+                }
+                count += n;
+            }, rangeBytes, blockSize);
+            return count;
+        }
+
+    private:
+        static std::streamsize checkedBlockSize(std::streamsize blockSize) {
+            if (blockSize <= 0) {
+                throw std::invalid_argument("Block size must be positive");
+            }
+            return blockSize;
+        }
+
+        // The next line without its newline, the last one with or without; nullopt at the
+        // end of the file.
+        std::optional<std::string_view> readLine() {
+            offset_ = blockOffset_ + pos_;
+            carry_.clear();
+            bool carrying = false;
+            for (;;) {
+                const std::vector<char>& block = *it_;
+                if (pos_ == block.size()) {
+                    if (block.empty()) {
+                        if (!carrying) return std::nullopt;
+                        return std::string_view(carry_);
+                    }
+                    blockOffset_ += block.size();
+                    pos_ = 0;
+                    ++it_;
+                    continue;
+                }
+                const char* from = block.data() + pos_;
+                std::size_t available = block.size() - pos_;
+                auto newline = static_cast<const char*>(std::memchr(from, '\n', available));
+                if (newline == nullptr) {
+                    carry_.append(from, available);
+                    carrying = true;
+                    pos_ = block.size();
+                    continue;
+                }
+                std::size_t length = static_cast<std::size_t>(newline - from);
+                pos_ += length + 1;
+                if (!carrying) return std::string_view(from, length);
+                carry_.append(from, length);
+                return std::string_view(carry_);
+            }
+        }
+
+        FileBlockIterator   it_;
+        std::uint64_t       blockOffset_;
+        std::size_t         pos_ = 0;
+        std::uint64_t       end_;
+        std::uint64_t       offset_ = 0;
+        std::string         carry_;
+        bool                skip_;
     };
 }